@@ -0,0 +1,186 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Microbenchmark comparing format_vlq() with the routine it replaced.  Run it without arguments;
+ * it prints nanoseconds per quantity for both versions.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "smf.h"
+#include "smf_private.h"
+
+#define NUMBER_OF_VALUES	(1 << 20)
+#define NUMBER_OF_ROUNDS	20
+
+/** format_vlq() as it was before the fast paths. */
+static int
+old_format_vlq(unsigned char *buf, int length, unsigned long value)
+{
+	int i;
+	unsigned long buffer;
+
+	buffer = value & 0x7F;
+
+	while ((value >>= 7)) {
+		buffer <<= 8;
+		buffer |= ((value & 0x7F) | 0x80);
+	}
+
+	for (i = 0;; i++) {
+		buf[i] = buffer;
+
+		if (buffer & 0x80)
+			buffer >>= 8;
+		else
+			break;
+	}
+
+	assert(i <= length);
+
+	return (i + 1);
+}
+
+/**
+ * Makes up values distributed roughly like delta times in real files: most of them
+ * fit in one byte, some in two, and a few need more.
+ */
+static void
+make_values(unsigned long *values, int number_of_values)
+{
+	int i, r;
+
+	srand(1);
+
+	for (i = 0; i < number_of_values; i++) {
+		r = rand() % 100;
+
+		if (r < 85)
+			values[i] = rand() % 0x80;
+		else if (r < 98)
+			values[i] = 0x80 + rand() % (0x4000 - 0x80);
+		else
+			values[i] = 0x4000 + rand() % (0x0FFFFFFF - 0x4000);
+	}
+}
+
+/** Keeps the compiler from throwing the loops away. */
+static unsigned long sum = 0;
+
+/**
+ * Encodes all the values into the buffer NUMBER_OF_ROUNDS times.  Routines are called
+ * through a pointer, so that the old one, defined here, does not get inlined.
+ * \return Time taken, in seconds.
+ */
+static double
+time_format(int (*format)(unsigned char *, int, unsigned long), unsigned char *buffer, const unsigned long *values)
+{
+	int i, round, offset;
+	clock_t start = clock();
+
+	for (round = 0; round < NUMBER_OF_ROUNDS; round++) {
+		for (i = 0, offset = 0; i < NUMBER_OF_VALUES; i++)
+			offset += format(buffer + offset, 4, values[i]);
+
+		sum += offset;
+	}
+
+	return ((double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+static void
+print_result(const char *name, double old_seconds, double new_seconds)
+{
+	double total = (double)NUMBER_OF_VALUES * NUMBER_OF_ROUNDS;
+
+	printf("%-12s old %6.2f ns, new %6.2f ns per quantity; speedup %.2fx\n", name,
+		old_seconds * 1e9 / total, new_seconds * 1e9 / total, old_seconds / new_seconds);
+}
+
+int
+main(void)
+{
+	int i, offset, value, len, buffer_length;
+	unsigned long *values;
+	unsigned char *buffer;
+	double old_seconds, new_seconds;
+	int (*volatile format)(unsigned char *, int, unsigned long);
+
+	values = malloc(NUMBER_OF_VALUES * sizeof(unsigned long));
+	buffer = malloc(NUMBER_OF_VALUES * 4);
+	if (values == NULL || buffer == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return (1);
+	}
+
+	make_values(values, NUMBER_OF_VALUES);
+
+	/* Both versions must produce the same bytes, and decode them back to the same values. */
+	buffer_length = 0;
+	for (i = 0; i < NUMBER_OF_VALUES; i++) {
+		unsigned char old_bytes[4];
+
+		len = format_vlq(buffer + buffer_length, 4, values[i]);
+		if (len != old_format_vlq(old_bytes, 4, values[i]) || memcmp(old_bytes, buffer + buffer_length, len)) {
+			fprintf(stderr, "format_vlq() differs from the old version for %lu.\n", values[i]);
+			return (1);
+		}
+
+		buffer_length += len;
+	}
+
+	for (i = 0, offset = 0; i < NUMBER_OF_VALUES; i++) {
+		if (extract_vlq(buffer + offset, buffer_length - offset, &value, &len) || value != values[i]) {
+			fprintf(stderr, "extract_vlq() did not decode %lu.\n", values[i]);
+			return (1);
+		}
+
+		offset += len;
+	}
+
+	/* Volatile, so that the compiler cannot see which routine is called. */
+	format = old_format_vlq;
+	old_seconds = time_format(format, buffer, values);
+	format = format_vlq;
+	new_seconds = time_format(format, buffer, values);
+	print_result("format_vlq", old_seconds, new_seconds);
+
+	if (sum == 0)
+		printf("\n");
+
+	free(values);
+	free(buffer);
+
+	return (0);
+}
@@ -22,14 +22,26 @@ do
 		}) do
 			defines (k .. "=" .. v)
 		end
+
+		-- macOS has no clock_nanosleep(); smf_player.c falls back to nanosleep() there
+		filter "system:linux or bsd"
+			defines { "HAVE_CLOCK_NANOSLEEP" }
+		filter {}
 	end
 	
 	files { 
 		"../../src/smf.h",
 		"../../src/smf.c",
+		"../../src/smf_arena.c",
+		"../../src/smf_chase.c",
+		"../../src/smf_columns.c",
+		"../../src/smf_cursor.c",
 		"../../src/smf_decode.c",
+		"../../src/smf_journal.c",
 		"../../src/smf_load.c",
+		"../../src/smf_player.c",
 		"../../src/smf_tempo.c",
+		"../../src/smf_timeline.c",
 		"../../src/smf_private.h",
 		"../../src/smf_save.c"
 	}
@@ -21,6 +21,10 @@ do
 	}
 
 	links { "smf" }
+
+	filter "system:not windows"
+		links { "pthread" }
+	filter {}
 	
 	if not useglib
 	then
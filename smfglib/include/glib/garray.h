@@ -43,6 +43,17 @@ void
 g_ptr_array_add(GPtrArray *array,
                 gpointer data);
 
+/**
+ *
+ * @param array
+ * @param length
+ *
+ * @see https://developer.gnome.org/glib/stable/glib-Pointer-Arrays.html#g-ptr-array-set-size
+ */
+void
+g_ptr_array_set_size(GPtrArray *array,
+                     gint length);
+
 
 gpointer
 g_ptr_array_index(GPtrArray *array,
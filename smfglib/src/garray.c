@@ -25,6 +25,35 @@ GPtrArray *g_ptr_array_new(void)
 	return (GPtrArray *)array;
 }
 
+/*
+ * Makes room for at least "length" elements.  Storage grows geometrically,
+ * so that appending N elements costs O(N) copies in total.
+ */
+static void
+g_ptr_array_maybe_expand(GPtrArrayImplementation *array,
+                         guint length)
+{
+	guint physical_size = array->physical_size;
+	
+	if (length <= physical_size)
+	{
+		return;
+	}
+	
+	if (physical_size < 8)
+	{
+		physical_size = 8;
+	}
+	
+	while (physical_size < length)
+	{
+		physical_size *= 2;
+	}
+	
+	array->storage = (gpointer *) realloc(array->storage, physical_size * sizeof(gpointer));
+	array->physical_size = physical_size;
+}
+
 gpointer *g_ptr_array_free(GPtrArray *arrayInterface,
                            gboolean free_seg)
 {
@@ -72,21 +101,34 @@ g_ptr_array_add(GPtrArray *arrayInterface,
 {
 	GPtrArrayImplementation *array = (GPtrArrayImplementation *)arrayInterface;
 	
-	if (array->logical_size == array->physical_size)
-	{
-		array->physical_size += 8;
-		gpointer *new_storage = (gpointer *) malloc(
-		                            array->physical_size * sizeof(gpointer)
-		                        );
-		memcpy(new_storage, array->storage, array->logical_size * sizeof(gpointer));
-		free(array->storage);
-		array->storage = new_storage;
-	}
+	g_ptr_array_maybe_expand(array, array->logical_size + 1);
 	
 	array->storage[array->logical_size] = data;
 	++array->logical_size;
 }
 
+void
+g_ptr_array_set_size(GPtrArray *arrayInterface,
+                     gint length)
+{
+	GPtrArrayImplementation *array = (GPtrArrayImplementation *)arrayInterface;
+	
+	if (length < 0)
+	{
+		return;
+	}
+	
+	g_ptr_array_maybe_expand(array, (guint)length);
+	
+	if ((guint)length > array->logical_size)
+	{
+		memset(array->storage + array->logical_size, 0,
+		       ((guint)length - array->logical_size) * sizeof(gpointer));
+	}
+	
+	array->logical_size = (guint)length;
+}
+
 
 gboolean
 g_ptr_array_remove(GPtrArray *arrayInterface,
@@ -81,27 +81,225 @@ smf_new(void)
 	return (smf);
 }
 
+/**
+ * Allocates new smf_t structure, just like smf_new(), except that the events added to it
+ * by the library, e.g. when loading, and its tempo map are allocated from an arena owned
+ * by the smf.  Memory is taken from the system in big slabs, instead of event by event,
+ * and freed events are kept for reuse.  Deleting the smf just frees the slabs, which
+ * is much faster than freeing every event.
+ *
+ * The downside is that these events, even if removed from the track, must not be used
+ * after the smf is deleted.  Also, memory taken by MIDI messages longer than
+ * SMF_EVENT_INLINE_BUFFER_LENGTH is not reused until the smf is deleted.
+ *
+ * \return pointer to smf_t or NULL.
+ */
+smf_t *
+smf_new_with_arena(void)
+{
+	smf_t *smf;
+
+	smf = smf_new();
+	if (smf == NULL)
+		return (NULL);
+
+	/* Initial tempo was allocated by smf_new() from the heap; allocate it from the arena instead. */
+	smf_fini_tempo(smf);
+
+	smf->arena = smf_arena_new();
+	if (smf->arena == NULL) {
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	smf_init_tempo(smf);
+
+	return (smf);
+}
+
 /**
  * Frees smf and all it's descendant structures.
  */
 void
 smf_delete(smf_t *smf)
 {
-	/* Remove all the tracks, from last to first. */
-	while (smf->tracks_array->len > 0)
-		smf_track_delete(g_ptr_array_index(smf->tracks_array, smf->tracks_array->len - 1));
+	int i, j;
+	smf_track_t *track;
+	smf_event_t *event;
+
+	/*
+	 * Everything goes away, so there is no point in detaching events one by one, renumbering
+	 * the rest and recomputing tempo map.  Events allocated from the arena go away with it.
+	 */
+	for (i = 0; i < smf->tracks_array->len; i++) {
+		track = g_ptr_array_index(smf->tracks_array, i);
+
+		for (j = 0; j < track->events_array->len; j++) {
+			event = g_ptr_array_index(track->events_array, j);
+			if (smf->arena != NULL && event->arena == smf->arena)
+				continue;
+
+			event->track = NULL;
+			smf_event_delete(event);
+		}
+
+		g_ptr_array_free(track->events_array, TRUE);
+
+		memset(track, 0, sizeof(smf_track_t));
+		free(track);
+	}
+
+	g_ptr_array_set_size(smf->tracks_array, 0);
+	smf->number_of_tracks = 0;
 
 	smf_fini_tempo(smf);
+	smf_release_lazy_buffer(smf);
 
 	assert(smf->tracks_array->len == 0);
 	assert(smf->number_of_tracks == 0);
 	g_ptr_array_free(smf->tracks_array, TRUE);
 	g_ptr_array_free(smf->tempo_array, TRUE);
 
+	if (smf->journal != NULL)
+		smf_disable_undo(smf);
+
+	free(smf->next_event_heap);
+	smf_delete_timeline(smf);
+
+	if (smf->arena != NULL)
+		smf_arena_delete(smf->arena);
+
 	memset(smf, 0, sizeof(smf_t));
 	free(smf);
 }
 
+/**
+ * Copies events of "track" into "cloned_track", which must be empty.  If "cloned_track" belongs to smf
+ * with an arena, the copies are allocated from it in a single block.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+clone_events(smf_track_t *cloned_track, const smf_track_t *track)
+{
+	int i, number_of_events = track->number_of_events;
+	smf_event_t *event, *copy, *events_block = NULL;
+	struct smf_arena_struct *arena = cloned_track->smf->arena;
+
+	assert(cloned_track->number_of_events == 0);
+
+	if (number_of_events == 0)
+		return (0);
+
+	if (arena != NULL) {
+		events_block = smf_arena_alloc(arena, number_of_events * sizeof(smf_event_t));
+		if (events_block == NULL)
+			return (-1);
+	}
+
+	smf_track_reserve_events(cloned_track, number_of_events);
+	g_ptr_array_set_size(cloned_track->events_array, number_of_events);
+
+	for (i = 0; i < number_of_events; i++) {
+		event = g_ptr_array_index(track->events_array, i);
+
+		if (events_block != NULL) {
+			copy = events_block + i;
+		} else {
+			copy = malloc(sizeof(smf_event_t));
+			if (copy == NULL) {
+				g_critical("Cannot allocate smf_event_t structure: %s", strerror(errno));
+				break;
+			}
+		}
+
+		/* Times, numbers and short messages are copied as they are. */
+		memcpy(copy, event, sizeof(smf_event_t));
+		copy->track = cloned_track;
+		copy->arena = arena;
+		copy->midi_buffer = NULL;
+
+		if (smf_event_allocate_midi_buffer(copy, event->midi_buffer_length)) {
+			if (arena == NULL)
+				free(copy);
+			break;
+		}
+
+		memcpy(copy->midi_buffer, event->midi_buffer, event->midi_buffer_length);
+
+		cloned_track->events_array->pdata[i] = copy;
+	}
+
+	/* Keep what was copied, so that smf_delete() can free it. */
+	g_ptr_array_set_size(cloned_track->events_array, i);
+	cloned_track->number_of_events = i;
+
+	if (i < number_of_events)
+		return (-2);
+
+	return (0);
+}
+
+/**
+ * Makes a deep copy of the smf: tracks, events and tempo map.  Nothing is parsed or recomputed;
+ * times of the events are copied as they are.  This is much faster than saving the smf and loading
+ * it back.  Position of the copy, e.g. for smf_get_next_event(), is the same as of the original.
+ * user_pointer fields are copied as well; they point to the same things as in the original.
+ * If the smf was created with an arena, the copy gets an arena of its own.
+ *
+ * \return Copy of the smf or NULL, if there was an error.
+ */
+smf_t *
+smf_clone(smf_t *smf)
+{
+	int i;
+	smf_t *clone;
+	smf_track_t *track, *cloned_track;
+
+	clone = smf->arena != NULL ? smf_new_with_arena() : smf_new();
+	if (clone == NULL)
+		return (NULL);
+
+	if (smf_copy_tempo_map(clone, smf))
+		goto error;
+
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		/* This also parses tracks of lazily loaded smf. */
+		track = smf_get_track_by_number(smf, i);
+		assert(track);
+
+		cloned_track = smf_track_new();
+		if (cloned_track == NULL)
+			goto error;
+
+		smf_add_track(clone, cloned_track);
+
+		if (clone_events(cloned_track, track))
+			goto error;
+
+		cloned_track->next_event_number = track->next_event_number;
+		cloned_track->time_of_next_event = track->time_of_next_event;
+		cloned_track->user_pointer = track->user_pointer;
+	}
+
+	/* smf_add_track() might have changed the format. */
+	clone->format = smf->format;
+	clone->ppqn = smf->ppqn;
+	clone->frames_per_second = smf->frames_per_second;
+	clone->resolution = smf->resolution;
+	clone->last_seek_position = smf->last_seek_position;
+
+	/* Copy is not part of any edit in progress; bring it up to date. */
+	if (smf->tempo_map_is_stale)
+		smf_create_tempo_map_and_compute_seconds(clone);
+
+	return (clone);
+
+error:
+	smf_delete(clone);
+
+	return (NULL);
+}
+
 /**
  * Allocates new smf_track_t structure.
  * \return pointer to smf_track_t or NULL.
@@ -124,22 +322,64 @@ smf_track_new(void)
 	return (track);
 }
 
+/**
+ * Makes room for at least "number_of_events" events in the track, so that adding them
+ * does not need to reallocate storage.  Useful if the number of events is known, or can
+ * be estimated, in advance.
+ */
+void
+smf_track_reserve_events(smf_track_t *track, int number_of_events)
+{
+	assert(number_of_events >= 0);
+	assert(track->events_array->len == track->number_of_events);
+
+	if (number_of_events <= track->number_of_events)
+		return;
+
+	/* GPtrArray has no call for reserving; growing it and shrinking back keeps the storage. */
+	g_ptr_array_set_size(track->events_array, number_of_events);
+	g_ptr_array_set_size(track->events_array, track->number_of_events);
+}
+
+static int remove_events(smf_track_t *track, int (*predicate)(const smf_event_t *event, void *ctx), void *ctx,
+	int first_event_number, int last_event_number);
+
 /**
  * Detaches track from its smf and frees it.
  */
 void
 smf_track_delete(smf_track_t *track)
 {
+	smf_event_t *event;
+	smf_t *smf = track->smf;
+
 	assert(track);
 	assert(track->events_array);
 
-	/* Remove all the events, from last to first. */
-	while (track->events_array->len > 0)
-		smf_event_delete(g_ptr_array_index(track->events_array, track->events_array->len - 1));
+	/* Removing events and then the track itself is a single undo step. */
+	if (smf != NULL)
+		smf_begin_edit(smf);
+
+	/* Remove all the events at once; this recomputes tempo map at most once. */
+	if (track->smf != NULL && track->number_of_events > 0)
+		remove_events(track, NULL, NULL, 1, track->number_of_events);
+
+	/* Track was removed from its smf, but still contains events; nothing to keep consistent. */
+	while (track->events_array->len > 0) {
+		event = g_ptr_array_index(track->events_array, track->events_array->len - 1);
+		g_ptr_array_remove_index(track->events_array, track->events_array->len - 1);
+		track->number_of_events--;
+
+		event->track = NULL;
+		smf_event_delete(event);
+	}
 
 	if (track->smf)
 		smf_track_remove_from_smf(track);
 
+	if (smf != NULL)
+		smf_commit_edit(smf);
+
 	assert(track->events_array->len == 0);
 	assert(track->number_of_events == 0);
 	g_ptr_array_free(track->events_array, TRUE);
@@ -150,20 +390,54 @@ smf_track_delete(smf_track_t *track)
 
 
 /**
- * Appends smf_track_t to smf.
+ * Renumbers tracks of the smf, starting from "first_track_number", together with their events,
+ * so that they are consecutively numbered.  Tracks that are still waiting to be parsed have
+ * no events yet; they get the number when they are parsed.
+ */
+static void
+renumber_tracks(smf_t *smf, int first_track_number)
+{
+	int i, j;
+	smf_track_t *track;
+
+	for (i = first_track_number; i <= smf->number_of_tracks; i++) {
+		track = smf_peek_track_by_number(smf, i);
+		track->track_number = i;
+
+		for (j = 0; j < track->events_array->len; j++)
+			((smf_event_t *)track->events_array->pdata[j])->track_number = i;
+	}
+}
+
+/**
+ * \internal
+ *
+ * Inserts smf_track_t into smf, so that it becomes track number "track_number".
  */
 void
-smf_add_track(smf_t *smf, smf_track_t *track)
+smf_insert_track(smf_t *smf, smf_track_t *track, int track_number)
 {
 	int cantfail;
 
 	assert(track->smf == NULL);
+	assert(track_number >= 1 && track_number <= smf->number_of_tracks + 1);
+
+	smf_journal_record_track(smf, SMF_JOURNAL_TRACK_ADDED, track_number);
+
+	smf->next_event_heap_is_valid = 0;
+	smf->generation++;
 
 	track->smf = smf;
 	g_ptr_array_add(smf->tracks_array, track);
-
 	smf->number_of_tracks++;
-	track->track_number = smf->number_of_tracks;
+
+	if (track_number < smf->number_of_tracks) {
+		memmove(smf->tracks_array->pdata + track_number, smf->tracks_array->pdata + track_number - 1,
+			(smf->number_of_tracks - track_number) * sizeof(gpointer));
+		smf->tracks_array->pdata[track_number - 1] = track;
+	}
+
+	renumber_tracks(smf, track_number);
 
 	if (smf->number_of_tracks > 1) {
 		cantfail = smf_set_format(smf, 1);
@@ -171,40 +445,79 @@ smf_add_track(smf_t *smf, smf_track_t *track)
 	}
 }
 
+/**
+ * Appends smf_track_t to smf.
+ */
+void
+smf_add_track(smf_t *smf, smf_track_t *track)
+{
+	int i, has_tempo = 0;
+	smf_event_t *event;
+
+	smf_begin_edit(smf);
+
+	smf_insert_track(smf, track, smf->number_of_tracks + 1);
+
+	/* Track might contain events already, if it was removed from another smf. */
+	for (i = 1; i <= track->number_of_events; i++) {
+		event = smf_track_get_event_by_number(track, i);
+
+		if (smf_event_is_tempo_change_or_time_signature(event))
+			has_tempo = 1;
+
+		smf_journal_record_event(smf, SMF_JOURNAL_EVENT_ADDED, track->track_number, i, event);
+	}
+
+	if (has_tempo)
+		smf_create_tempo_map_and_compute_seconds(smf);
+
+	smf_commit_edit(smf);
+}
+
 /**
  * Detaches track from the smf.
  */
 void
 smf_track_remove_from_smf(smf_track_t *track)
 {
-	int i, j;
-	smf_track_t *tmp;
-	smf_event_t *ev;
+	int i, had_tempo = 0;
+	smf_t *smf = track->smf;
+	smf_event_t *event;
 
 	assert(track->smf != NULL);
 
+	smf_begin_edit(smf);
+
+	/* Events stay in the track, but they are gone from the smf. */
+	for (i = track->number_of_events; i >= 1; i--) {
+		event = smf_track_get_event_by_number(track, i);
+
+		if (smf_event_is_tempo_change_or_time_signature(event))
+			had_tempo = 1;
+
+		smf_journal_record_event(smf, SMF_JOURNAL_EVENT_REMOVED, track->track_number, i, event);
+	}
+
+	smf_journal_record_track(smf, SMF_JOURNAL_TRACK_REMOVED, track->track_number);
+
+	smf->next_event_heap_is_valid = 0;
+	smf->generation++;
+
 	track->smf->number_of_tracks--;
 
 	assert(track->smf->tracks_array);
 	g_ptr_array_remove(track->smf->tracks_array, track);
 
-	/* Renumber the rest of the tracks, so they are consecutively numbered. */
-	for (i = track->track_number; i <= track->smf->number_of_tracks; i++) {
-		tmp = smf_get_track_by_number(track->smf, i);
-		tmp->track_number = i;
-
-		/*
-		 * Events have track numbers too.  I guess this wasn't a wise
-		 * decision.  ;-/
-		 */
-		for (j = 1; j <= tmp->number_of_events; j++) {
-			ev = smf_track_get_event_by_number(tmp, j);
-			ev->track_number = i;
-		}
-	}
+	/* Renumber the rest of the tracks, so they are consecutively numbered.  No need to parse them for that. */
+	renumber_tracks(track->smf, track->track_number);
 
 	track->track_number = -1;
 	track->smf = NULL;
+
+	if (had_tempo)
+		smf_create_tempo_map_and_compute_seconds(smf);
+
+	smf_commit_edit(smf);
 }
 
 /**
@@ -228,11 +541,72 @@ smf_event_new(void)
 	event->time_pulses = -1;
 	event->time_seconds = -1.0;
 	event->time_microseconds = 0;
-	event->track_number = -1;
 
 	return (event);
 }
 
+/**
+ * \internal
+ *
+ * Same as smf_event_new(), but allocates the event from "arena", if it is not NULL.
+ */
+smf_event_t *
+smf_event_new_from_arena(struct smf_arena_struct *arena)
+{
+	smf_event_t *event;
+
+	if (arena == NULL)
+		return (smf_event_new());
+
+	event = smf_arena_alloc_event(arena);
+	if (event == NULL) {
+		g_critical("Cannot allocate smf_event_t structure.");
+		return (NULL);
+	}
+
+	memset(event, 0, sizeof(smf_event_t));
+
+	event->delta_time_pulses = -1;
+	event->time_pulses = -1;
+	event->time_seconds = -1.0;
+	event->time_microseconds = 0;
+	event->arena = arena;
+
+	return (event);
+}
+
+/**
+ * \internal
+ *
+ * Sets event->midi_buffer_length to "len" and points event->midi_buffer to storage for that
+ * many bytes: inside the event itself, if the message is short enough, or allocated otherwise.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_event_allocate_midi_buffer(smf_event_t *event, int len)
+{
+	assert(len >= 0);
+
+	event->midi_buffer_length = len;
+
+	if (len <= SMF_EVENT_INLINE_BUFFER_LENGTH) {
+		event->midi_buffer = event->midi_buffer_inline;
+		return (0);
+	}
+
+	if (event->arena != NULL)
+		event->midi_buffer = smf_arena_alloc(event->arena, len);
+	else
+		event->midi_buffer = malloc(len);
+	if (event->midi_buffer == NULL) {
+		g_critical("Cannot allocate MIDI buffer structure: %s", strerror(errno));
+		event->midi_buffer_length = 0;
+		return (-1);
+	}
+
+	return (0);
+}
+
 /**
  * Allocates an smf_event_t structure and fills it with "len" bytes copied
  * from "midi_data".
@@ -249,10 +623,7 @@ smf_event_new_from_pointer(void *midi_data, int len)
 	if (event == NULL)
 		return (NULL);
 
-	event->midi_buffer_length = len;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate MIDI buffer structure: %s", strerror(errno));
+	if (smf_event_allocate_midi_buffer(event, len)) {
 		smf_event_delete(event);
 
 		return (NULL); 
@@ -339,10 +710,7 @@ smf_event_new_from_bytes(int first_byte, int second_byte, int third_byte)
 		}
 	}
 
-	event->midi_buffer_length = len;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate MIDI buffer structure: %s", strerror(errno));
+	if (smf_event_allocate_midi_buffer(event, len)) {
 		smf_event_delete(event);
 
 		return (NULL); 
@@ -366,7 +734,14 @@ smf_event_delete(smf_event_t *event)
 	if (event->track != NULL)
 		smf_event_remove_from_track(event);
 
-	if (event->midi_buffer != NULL) {
+	/* MIDI buffer stays in the arena until it is deleted; the event itself can be reused. */
+	if (event->arena != NULL) {
+		smf_arena_free_event(event->arena, event);
+		return;
+	}
+
+	/* Short messages live inside the event; see smf_event_allocate_midi_buffer(). */
+	if (event->midi_buffer != NULL && event->midi_buffer != event->midi_buffer_inline) {
 		memset(event->midi_buffer, 0, event->midi_buffer_length);
 		free(event->midi_buffer);
 	}
@@ -376,35 +751,63 @@ smf_event_delete(smf_event_t *event)
 }
 
 /**
- * Used for sorting track->events_array.
+ * Replaces MIDI message of the event with "len" bytes copied from "midi_data".  If the event
+ * is attached to a track, this is recorded for smf_undo(), and tempo map is updated, if needed.
+ * Use this instead of modifying event->midi_buffer directly, unless the new message
+ * has the same length and the event is neither Tempo Change nor Time Signature, before or after.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
  */
-static gint
-events_array_compare_function(gconstpointer aa, gconstpointer bb)
+int
+smf_event_set_midi_buffer(smf_event_t *event, const void *midi_data, int len)
 {
-	smf_event_t *a, *b;
-	
-	/* "The comparison function for g_ptr_array_sort() doesn't take the pointers
-	    from the array as arguments, it takes pointers to the pointers in the array." */
-	a = (smf_event_t *)*(gpointer *)aa;
-	b = (smf_event_t *)*(gpointer *)bb;
+	int was_tempo = 0;
+	unsigned char *new_buffer = NULL, *old_buffer;
 
-	if (a->time_pulses < b->time_pulses)
+	if (len < 1) {
+		g_critical("smf_event_set_midi_buffer: invalid length %d.", len);
 		return (-1);
+	}
 
-	if (a->time_pulses > b->time_pulses)
-		return (1);
+	/* Allocate first, so that the event is left intact if it fails. */
+	if (len > SMF_EVENT_INLINE_BUFFER_LENGTH) {
+		if (event->arena != NULL)
+			new_buffer = smf_arena_alloc(event->arena, len);
+		else
+			new_buffer = malloc(len);
 
-	/*
-	 * We need to preserve original order, otherwise things will break
-	 * when there are several events with the same ->time_pulses.
-	 * XXX: This is an ugly hack; we should remove sorting altogether.
-	 */
+		if (new_buffer == NULL) {
+			g_critical("Cannot allocate MIDI buffer structure: %s", strerror(errno));
+			return (-2);
+		}
+	} else {
+		new_buffer = event->midi_buffer_inline;
+	}
 
-	if (a->event_number < b->event_number)
-		return (-1);
+	if (event->track != NULL) {
+		was_tempo = smf_event_is_tempo_change_or_time_signature(event);
+		smf_journal_record_event(event->track->smf, SMF_JOURNAL_EVENT_CHANGED, event->track->track_number,
+			event->event_number, event);
+	}
 
-	if (a->event_number > b->event_number)
-		return (1);
+	/* "midi_data" might point into the old buffer. */
+	old_buffer = event->midi_buffer;
+	memmove(new_buffer, midi_data, len);
+
+	if (old_buffer != NULL && old_buffer != event->midi_buffer_inline && event->arena == NULL)
+		free(old_buffer);
+
+	event->midi_buffer = new_buffer;
+	event->midi_buffer_length = len;
+
+	if (event->track == NULL)
+		return (0);
+
+	/* Seek checkpoints keep controller and program values; make them again. */
+	event->track->smf->generation++;
+
+	if (was_tempo || smf_event_is_tempo_change_or_time_signature(event))
+		smf_create_tempo_map_and_compute_seconds(event->track->smf);
 
 	return (0);
 }
@@ -431,6 +834,72 @@ remove_eot_if_before_pulses(smf_track_t *track, int pulses)
 	smf_event_remove_from_track(event);
 }
 
+/**
+ * \internal
+ *
+ * Inserts the event into the track, so that it becomes event number "event_number", and computes
+ * ->delta_pulses.  Event needs to have ->time_pulses and ->time_seconds already set, and it has to
+ * fit there, i.e. not happen before the previous event nor after the next one.
+ */
+void
+smf_track_insert_event(smf_track_t *track, smf_event_t *event, int event_number)
+{
+	int i, index = event_number - 1, last_pulses = 0;
+	smf_event_t *next_event;
+
+	assert(track->smf != NULL);
+	assert(event->track == NULL);
+	assert(event->delta_time_pulses == -1);
+	assert(event->time_pulses >= 0);
+	assert(event->time_seconds >= 0.0);
+	assert(index >= 0 && index <= track->number_of_events);
+
+	event->track = track;
+	event->track_number = track->track_number;
+
+	if (track->number_of_events == 0) {
+		assert(track->next_event_number == -1);
+		track->next_event_number = 1;
+		track->smf->next_event_heap_is_valid = 0;
+	}
+
+	track->number_of_events++;
+	track->smf->generation++;
+
+	if (index > 0)
+		last_pulses = ((smf_event_t *)track->events_array->pdata[index - 1])->time_pulses;
+
+	event->delta_time_pulses = event->time_pulses - last_pulses;
+	assert(event->delta_time_pulses >= 0);
+	event->event_number = event_number;
+
+	/* Make room by appending, then move the events that follow one slot further. */
+	g_ptr_array_add(track->events_array, event);
+
+	if (index < track->number_of_events - 1) {
+		memmove(track->events_array->pdata + index + 1, track->events_array->pdata + index,
+			(track->number_of_events - 1 - index) * sizeof(gpointer));
+		track->events_array->pdata[index] = event;
+
+		/* Only the next event changes its ->delta_time_pulses; the ones after it just get renumbered. */
+		next_event = track->events_array->pdata[index + 1];
+		assert(next_event->time_pulses >= event->time_pulses);
+		next_event->delta_time_pulses = next_event->time_pulses - event->time_pulses;
+
+		for (i = index + 1; i < track->number_of_events; i++)
+			((smf_event_t *)track->events_array->pdata[i])->event_number = i + 1;
+	}
+
+	smf_journal_record_event(track->smf, SMF_JOURNAL_EVENT_ADDED, track->track_number, event_number, event);
+
+	if (smf_event_is_tempo_change_or_time_signature(event)) {
+		if (smf_event_is_last(event))
+			maybe_add_to_tempo_map(event);
+		else
+			smf_create_tempo_map_and_compute_seconds(event->track->smf);
+	}
+}
+
 /**
  * Adds the event to the track and computes ->delta_pulses.  Note that it is faster
  * to append events to the end of the track than to insert them in the middle.
@@ -441,75 +910,421 @@ remove_eot_if_before_pulses(smf_track_t *track, int pulses)
 void
 smf_track_add_event(smf_track_t *track, smf_event_t *event)
 {
-	int i, last_pulses = 0;
+	int low, high, middle;
 
 	assert(track->smf != NULL);
 	assert(event->track == NULL);
-	assert(event->delta_time_pulses == -1);
 	assert(event->time_pulses >= 0);
-	assert(event->time_seconds >= 0.0);
+
+	/* Removing the EOT is undone together with adding the event. */
+	smf_begin_edit(track->smf);
 
 	remove_eot_if_before_pulses(track, event->time_pulses);
 
+	/* Are we just appending element at the end of the track? */
+	if (track->number_of_events == 0 || smf_track_get_last_event(track)->time_pulses <= event->time_pulses) {
+		smf_track_insert_event(track, event, track->number_of_events + 1);
+		smf_commit_edit(track->smf);
+		return;
+	}
+
+	/*
+	 * Find the first event that does not happen before the new one; new event goes right
+	 * before it.  Binary search is fine, events are sorted by ->time_pulses.
+	 */
+	low = 0;
+	high = track->number_of_events - 1;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (((smf_event_t *)track->events_array->pdata[middle])->time_pulses < event->time_pulses)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	smf_track_insert_event(track, event, low + 1);
+
+	smf_commit_edit(track->smf);
+}
+
+/**
+ * \internal
+ *
+ * Appends the event at the end of the track, "delta" pulses after the last event.
+ * Unlike smf_track_add_event_delta_pulses(), this does not compute ->time_seconds
+ * and does not touch the tempo map; the loader does that afterwards, for the whole
+ * track at once, using smf_track_compute_seconds().  It does not touch anything
+ * in the smf either - smf_load_from_memory_parallel() calls it from several threads
+ * at once - so the loader has to bump smf->generation and invalidate the heap
+ * of next events when the tracks are parsed.
+ */
+void
+smf_track_append_event_delta_pulses(smf_track_t *track, smf_event_t *event, int delta)
+{
+	smf_event_t *last_event;
+
+	assert(track->smf != NULL);
+	assert(event->track == NULL);
+	assert(event->delta_time_pulses == -1);
+	assert(delta >= 0);
+
+	last_event = smf_track_get_last_event(track);
+
 	event->track = track;
 	event->track_number = track->track_number;
+	event->delta_time_pulses = delta;
+	event->time_pulses = delta;
+	if (last_event != NULL)
+		event->time_pulses += last_event->time_pulses;
 
 	if (track->number_of_events == 0) {
 		assert(track->next_event_number == -1);
 		track->next_event_number = 1;
 	}
 
-	if (track->number_of_events > 0)
-		last_pulses = smf_track_get_last_event(track)->time_pulses;
-
+	g_ptr_array_add(track->events_array, event);
 	track->number_of_events++;
+	event->event_number = track->number_of_events;
+}
 
-	/* Are we just appending element at the end of the track? */
-	if (last_pulses <= event->time_pulses) {
-		event->delta_time_pulses = event->time_pulses - last_pulses;
-		assert(event->delta_time_pulses >= 0);
-		g_ptr_array_add(track->events_array, event);
-		event->event_number = track->number_of_events;
+struct packed_event_order {
+	int	time_pulses;
+	int	index;
+};
 
-	/* We need to insert in the middle of the track.  XXX: This is slow. */
-	} else {
-		/* Append, then sort according to ->time_pulses. */
-		g_ptr_array_add(track->events_array, event);
-		g_ptr_array_sort(track->events_array, events_array_compare_function);
+static int
+packed_event_order_compare_function(const void *aa, const void *bb)
+{
+	const struct packed_event_order *a = aa, *b = bb;
+
+	if (a->time_pulses < b->time_pulses)
+		return (-1);
 
-		/* Renumber entries and fix their ->delta_pulses. */
-		for (i = 1; i <= track->number_of_events; i++) {
-			smf_event_t *tmp = smf_track_get_event_by_number(track, i);
-			tmp->event_number = i;
+	if (a->time_pulses > b->time_pulses)
+		return (1);
 
-			if (tmp->delta_time_pulses != -1)
-				continue;
+	/* Keep events with the same time in the order they were given. */
+	return (a->index - b->index);
+}
+
+/**
+ * Checks metaevent passed to smf_track_add_events_packed() the same way smf_event_is_valid() would:
+ * 0xFF, type, length and then "length" bytes.  Tempo Change and Time Signature must also be long enough
+ * for the tempo map to read them.
+ * \return Nonzero, if the metaevent is valid, 0 otherwise.
+ */
+static int
+packed_metaevent_is_valid(const unsigned char *midi_buffer, int midi_buffer_length)
+{
+	if (midi_buffer_length < 3)
+		return (0);
+
+	if (expected_message_length(0xFF, midi_buffer + 1, midi_buffer_length - 1) != midi_buffer_length)
+		return (0);
+
+	if (midi_buffer[1] == 0x51 && midi_buffer_length < 6)
+		return (0);
+
+	if (midi_buffer[1] == 0x58 && midi_buffer_length < 7)
+		return (0);
+
+	return (1);
+}
+
+/**
+ * Creates an event from the "index"-th element of the arrays passed to smf_track_add_events_packed().
+ * \return Event or NULL.
+ */
+static smf_event_t *
+new_packed_event(struct smf_arena_struct *arena, int index, const int *pulses, const uint32_t *messages,
+	const unsigned char * const *long_messages, const int *long_message_lengths)
+{
+	int len, long_message_number;
+	unsigned char status;
+	smf_event_t *event;
+
+	event = smf_event_new_from_arena(arena);
+	if (event == NULL)
+		return (NULL);
+
+	event->time_pulses = pulses[index];
+
+	status = messages[index] & 0xFF;
+
+	if (status == 0xF0 || status == 0xF7 || status == 0xFF) {
+		long_message_number = messages[index] >> 8;
+		len = long_message_lengths[long_message_number];
+
+		if (smf_event_allocate_midi_buffer(event, len)) {
+			smf_event_delete(event);
+			return (NULL);
+		}
+
+		memcpy(event->midi_buffer, long_messages[long_message_number], len);
+
+		return (event);
+	}
+
+	len = expected_message_length(status, NULL, 0);
+	assert(len >= 1 && len <= 3);
+
+	if (smf_event_allocate_midi_buffer(event, len)) {
+		smf_event_delete(event);
+		return (NULL);
+	}
+
+	event->midi_buffer[0] = status;
+	if (len > 1)
+		event->midi_buffer[1] = (messages[index] >> 8) & 0xFF;
+	if (len > 2)
+		event->midi_buffer[2] = (messages[index] >> 16) & 0xFF;
+
+	return (event);
+}
+
+/**
+ * Adds "number_of_events" events to the track at once.  Much faster than creating the events
+ * one by one and adding them with smf_track_add_event_pulses().
+ *
+ * Event number i happens at "pulses[i]" and contains MIDI message packed into "messages[i]":
+ * status byte in the lowest eight bits, then the first data byte, then the second one,
+ * e.g. 0x7F3C90 for Note On, middle C, velocity 127.  Unused data bytes are ignored.
+ * SysEx, escaped events and metaevents do not fit there; for them, the lowest eight bits
+ * contain their status byte (0xF0, 0xF7 or 0xFF, respectively) and the upper 24 bits contain
+ * index into "long_messages", which holds the complete message, including the status byte,
+ * of the length given in "long_message_lengths".  These can be NULL, with "number_of_long_messages"
+ * of zero, if there are no such events.  Data is copied; caller keeps ownership of the arrays.
+ *
+ * Pulses do not have to be sorted.  Events with the same time are kept in the order they were
+ * given, after the events already in the track.  If the events go after the EOT, it is removed.
+ * Times in seconds are computed in one pass over the tempo map, and the tempo map is recomputed
+ * only if some of the new events are Tempo Change or Time Signature metaevents.
+ *
+ * Nothing is added if any of the events is invalid.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_track_add_events_packed(smf_track_t *track, int number_of_events, const int *pulses, const uint32_t *messages,
+	int number_of_long_messages, const unsigned char * const *long_messages, const int *long_message_lengths)
+{
+	int i, j, k, sorted = 1, added_tempo = 0, old_number_of_events, first_changed, max_pulses = 0;
+	int long_message_number, previous_pulses, low, high, middle;
+	unsigned char status;
+	smf_event_t **new_events, **old_events = NULL, *event;
+	struct packed_event_order *order = NULL;
+
+	assert(track->smf != NULL);
+
+	if (number_of_events < 0) {
+		g_critical("smf_track_add_events_packed: invalid number of events: %d.", number_of_events);
+		return (-1);
+	}
+
+	if (number_of_events == 0)
+		return (0);
+
+	/* Check everything first, so that we do not have to undo anything later. */
+	for (i = 0; i < number_of_events; i++) {
+		if (pulses[i] < 0) {
+			g_critical("smf_track_add_events_packed: event %d has negative time (%d pulses).", i, pulses[i]);
+			return (-2);
+		}
+
+		if (i > 0 && pulses[i] < pulses[i - 1])
+			sorted = 0;
+
+		if (pulses[i] > max_pulses)
+			max_pulses = pulses[i];
+
+		status = messages[i] & 0xFF;
+
+		if (!is_status_byte(status)) {
+			g_critical("smf_track_add_events_packed: event %d does not start with status byte (0x%x).", i, status);
+			return (-3);
+		}
+
+		if (status == 0xF0 || status == 0xF7 || status == 0xFF) {
+			long_message_number = messages[i] >> 8;
+
+			if (long_message_number >= number_of_long_messages) {
+				g_critical("smf_track_add_events_packed: event %d refers to nonexistent long message %d.",
+					i, long_message_number);
+				return (-4);
+			}
 
-			if (i == 1) {
-				tmp->delta_time_pulses = tmp->time_pulses;
-			} else {
-				tmp->delta_time_pulses = tmp->time_pulses -
-					smf_track_get_event_by_number(track, i - 1)->time_pulses;
-				assert(tmp->delta_time_pulses >= 0);
+			if (long_message_lengths[long_message_number] < 1 ||
+			    long_messages[long_message_number][0] != status) {
+				g_critical("smf_track_add_events_packed: long message %d does not match event %d.",
+					long_message_number, i);
+				return (-5);
 			}
+
+			if (status == 0xFF && !packed_metaevent_is_valid(long_messages[long_message_number],
+			    long_message_lengths[long_message_number])) {
+				g_critical("smf_track_add_events_packed: long message %d is not a valid metaevent.",
+					long_message_number);
+				return (-5);
+			}
+
+			if (status == 0xFF &&
+			    (long_messages[long_message_number][1] == 0x51 || long_messages[long_message_number][1] == 0x58))
+				added_tempo = 1;
+
+		} else if (expected_message_length(status, NULL, 0) < 0) {
+			g_critical("smf_track_add_events_packed: event %d has invalid status byte (0x%x).", i, status);
+			return (-6);
+		}
+	}
+
+	new_events = malloc(number_of_events * sizeof(smf_event_t *));
+	if (new_events == NULL) {
+		g_critical("Cannot allocate memory for events: %s", strerror(errno));
+		return (-7);
+	}
+
+	if (!sorted) {
+		order = malloc(number_of_events * sizeof(struct packed_event_order));
+		if (order == NULL) {
+			g_critical("Cannot allocate memory for events: %s", strerror(errno));
+			free(new_events);
+			return (-7);
 		}
 
-		/* Adjust ->delta_time_pulses of the next event. */
-		if (event->event_number < track->number_of_events) {
-			smf_event_t *next_event = smf_track_get_event_by_number(track, event->event_number + 1);
-			assert(next_event);
-			assert(next_event->time_pulses >= event->time_pulses);
-			next_event->delta_time_pulses -= event->delta_time_pulses;
-			assert(next_event->delta_time_pulses >= 0);
+		for (i = 0; i < number_of_events; i++) {
+			order[i].time_pulses = pulses[i];
+			order[i].index = i;
 		}
+
+		qsort(order, number_of_events, sizeof(struct packed_event_order), packed_event_order_compare_function);
 	}
 
-	if (smf_event_is_tempo_change_or_time_signature(event)) {
-		if (smf_event_is_last(event))
-			maybe_add_to_tempo_map(event);
+	/* Events are created already sorted. */
+	for (i = 0; i < number_of_events; i++) {
+		event = new_packed_event(track->smf->arena, order != NULL ? order[i].index : i, pulses, messages,
+			long_messages, long_message_lengths);
+
+		if (event == NULL) {
+			for (j = 0; j < i; j++)
+				smf_event_delete(new_events[j]);
+
+			free(new_events);
+			free(order);
+			return (-7);
+		}
+
+		new_events[i] = event;
+	}
+
+	free(order);
+
+	/*
+	 * Room for existing events that need to be merged with the new ones; allocated before anything
+	 * is changed, so that there is nothing to undo if it fails.  Removing End Of Track below
+	 * can only make it fewer.
+	 */
+	if (track->number_of_events > 0) {
+		old_events = malloc(track->number_of_events * sizeof(smf_event_t *));
+		if (old_events == NULL) {
+			g_critical("Cannot allocate memory for events: %s", strerror(errno));
+
+			for (j = 0; j < number_of_events; j++)
+				smf_event_delete(new_events[j]);
+
+			free(new_events);
+			return (-7);
+		}
+	}
+
+	/* The whole import is a single undo step. */
+	smf_begin_edit(track->smf);
+
+	remove_eot_if_before_pulses(track, max_pulses);
+
+	old_number_of_events = track->number_of_events;
+
+	/* Find the first existing event that happens after the first new one; everything before it stays in place. */
+	low = 0;
+	high = old_number_of_events;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (((smf_event_t *)track->events_array->pdata[middle])->time_pulses <= new_events[0]->time_pulses)
+			low = middle + 1;
 		else
-			smf_create_tempo_map_and_compute_seconds(event->track->smf);
+			high = middle;
+	}
+
+	first_changed = low;
+
+	/* Save events that need to be merged with the new ones. */
+	if (first_changed < old_number_of_events) {
+		memcpy(old_events, track->events_array->pdata + first_changed,
+			(old_number_of_events - first_changed) * sizeof(smf_event_t *));
+	}
+
+	smf_track_reserve_events(track, old_number_of_events + number_of_events);
+	g_ptr_array_set_size(track->events_array, old_number_of_events + number_of_events);
+
+	/* Merge; existing events go first when times are equal. */
+	i = first_changed;
+	j = 0;
+	for (k = first_changed; k < old_number_of_events + number_of_events; k++) {
+		if (j >= number_of_events || (i < old_number_of_events &&
+		    old_events[i - first_changed]->time_pulses <= new_events[j]->time_pulses))
+			event = old_events[i++ - first_changed];
+		else
+			event = new_events[j++];
+
+		track->events_array->pdata[k] = event;
+	}
+
+	free(old_events);
+
+	track->number_of_events = old_number_of_events + number_of_events;
+
+	if (first_changed > 0)
+		previous_pulses = ((smf_event_t *)track->events_array->pdata[first_changed - 1])->time_pulses;
+	else
+		previous_pulses = 0;
+
+	for (k = first_changed; k < track->number_of_events; k++) {
+		event = track->events_array->pdata[k];
+
+		event->track = track;
+		event->track_number = track->track_number;
+		event->event_number = k + 1;
+		event->delta_time_pulses = event->time_pulses - previous_pulses;
+		previous_pulses = event->time_pulses;
+	}
+
+	if (old_number_of_events == 0) {
+		assert(track->next_event_number == -1);
+		track->next_event_number = 1;
+		track->time_of_next_event = ((smf_event_t *)track->events_array->pdata[0])->time_pulses;
+		track->smf->next_event_heap_is_valid = 0;
 	}
+
+	track->smf->generation++;
+
+	/* New events are in the order of their final positions, so they can be replayed one by one. */
+	for (j = 0; j < number_of_events; j++)
+		smf_journal_record_event(track->smf, SMF_JOURNAL_EVENT_ADDED, track->track_number,
+			new_events[j]->event_number, new_events[j]);
+
+	if (added_tempo)
+		smf_create_tempo_map_and_compute_seconds(track->smf);
+	else
+		smf_compute_seconds_of_events(track->smf, new_events, number_of_events);
+
+	smf_commit_edit(track->smf);
+
+	free(new_events);
+
+	return (0);
 }
 
 /**
@@ -560,6 +1375,8 @@ smf_track_add_eot_seconds(smf_track_t *track, double seconds)
 {
 	smf_event_t *event, *last_event;
 
+	smf_update_tempo_map_if_stale(track->smf);
+
 	last_event = smf_track_get_last_event(track);
 	if (last_event != NULL) {
 		if (last_event->time_seconds > seconds)
@@ -591,6 +1408,8 @@ smf_event_remove_from_track(smf_event_t *event)
 	track = event->track;
 	was_last = smf_event_is_last(event);
 
+	smf_journal_record_event(track->smf, SMF_JOURNAL_EVENT_REMOVED, track->track_number, event->event_number, event);
+
 	/* Adjust ->delta_time_pulses of the next event. */
 	if (event->event_number < track->number_of_events) {
 		tmp = smf_track_get_event_by_number(track, event->event_number + 1);
@@ -599,31 +1418,147 @@ smf_event_remove_from_track(smf_event_t *event)
 	}
 
 	track->number_of_events--;
-	g_ptr_array_remove(track->events_array, event);
+	track->smf->generation++;
+	/* No need to search for it, event number is the position in the array. */
+	assert(g_ptr_array_index(track->events_array, event->event_number - 1) == event);
+	g_ptr_array_remove_index(track->events_array, event->event_number - 1);
+
+	if (track->number_of_events == 0) {
+		track->next_event_number = -1;
+		track->smf->next_event_heap_is_valid = 0;
+	}
+
+	/* Renumber the rest of the events, so they are consecutively numbered. */
+	for (i = event->event_number; i <= track->number_of_events; i++) {
+		tmp = smf_track_get_event_by_number(track, i);
+		tmp->event_number = i;
+	}
+
+	if (smf_event_is_tempo_change_or_time_signature(event)) {
+		/* XXX: This will cause problems, when there is more than one Tempo Change event at a given time. */
+		if (was_last)
+			remove_last_tempo_with_pulses(event->track->smf, event->time_pulses);
+		else
+			smf_create_tempo_map_and_compute_seconds(track->smf);
+	}
+
+	event->track = NULL;
+	event->track_number = -1;
+	event->event_number = -1;
+	event->delta_time_pulses = -1;
+	event->time_pulses = -1;
+	event->time_seconds = -1.0;
+	event->time_microseconds = -1;
+}
+
+/**
+ * Removes from the track, and frees using smf_event_delete(), all the events for which
+ * "predicate" returns nonzero, or, if "predicate" is NULL, events numbered from "first_event_number"
+ * to "last_event_number".  Remaining events are compacted and renumbered in a single pass,
+ * and tempo map is recomputed at most once.  Returns number of removed events.
+ */
+static int
+remove_events(smf_track_t *track, int (*predicate)(const smf_event_t *event, void *ctx), void *ctx,
+	int first_event_number, int last_event_number)
+{
+	int i, remove, number_of_removed_events, number_of_kept_events = 0, previous_pulses = 0, removed_tempo = 0;
+	int next_event_number = -1;
+	smf_event_t *event;
+
+	assert(track->smf != NULL);
+
+	/* Removing many events is a single undo step. */
+	smf_begin_edit(track->smf);
+
+	for (i = 0; i < track->number_of_events; i++) {
+		event = track->events_array->pdata[i];
+
+		/* Iteration continues from the first remaining event at or after the old position. */
+		if (i + 1 == track->next_event_number)
+			next_event_number = number_of_kept_events + 1;
+
+		if (predicate != NULL)
+			remove = predicate(event, ctx);
+		else
+			remove = event->event_number >= first_event_number && event->event_number <= last_event_number;
+
+		if (remove) {
+			if (smf_event_is_tempo_change_or_time_signature(event))
+				removed_tempo = 1;
+
+			/* As if the events were removed one by one, in order. */
+			smf_journal_record_event(track->smf, SMF_JOURNAL_EVENT_REMOVED, track->track_number,
+				number_of_kept_events + 1, event);
+
+			/* Already taken care of; do not let smf_event_delete() remove it again. */
+			event->track = NULL;
+			smf_event_delete(event);
+			continue;
+		}
+
+		event->delta_time_pulses = event->time_pulses - previous_pulses;
+		previous_pulses = event->time_pulses;
+
+		event->event_number = number_of_kept_events + 1;
+		track->events_array->pdata[number_of_kept_events] = event;
+		number_of_kept_events++;
+	}
+
+	number_of_removed_events = track->number_of_events - number_of_kept_events;
+
+	g_ptr_array_set_size(track->events_array, number_of_kept_events);
+	track->number_of_events = number_of_kept_events;
+
+	if (next_event_number > number_of_kept_events)
+		next_event_number = -1;
+
+	track->next_event_number = next_event_number;
+	if (next_event_number != -1)
+		track->time_of_next_event = smf_track_get_event_by_number(track, next_event_number)->time_pulses;
+	track->smf->next_event_heap_is_valid = 0;
+	track->smf->generation++;
+
+	if (removed_tempo)
+		smf_create_tempo_map_and_compute_seconds(track->smf);
+
+	smf_commit_edit(track->smf);
+
+	return (number_of_removed_events);
+}
+
+/**
+ * Removes from the track, and frees, all the events for which "predicate" returns nonzero,
+ * e.g. all the Control Change events.  This is much faster than calling smf_event_delete()
+ * for every one of them.  "ctx" is passed to the predicate, which must not modify the track.
+ *
+ * \return Number of removed events.
+ */
+int
+smf_track_remove_events_if(smf_track_t *track, int (*predicate)(const smf_event_t *event, void *ctx), void *ctx)
+{
+	assert(predicate != NULL);
 
-	if (track->number_of_events == 0)
-		track->next_event_number = -1;
+	return (remove_events(track, predicate, ctx, 0, -1));
+}
 
-	/* Renumber the rest of the events, so they are consecutively numbered. */
-	for (i = event->event_number; i <= track->number_of_events; i++) {
-		tmp = smf_track_get_event_by_number(track, i);
-		tmp->event_number = i;
+/**
+ * Removes from the track, and frees, events numbered from "first_event_number"
+ * to "last_event_number", inclusive.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_track_remove_range(smf_track_t *track, int first_event_number, int last_event_number)
+{
+	if (first_event_number < 1 || last_event_number > track->number_of_events || first_event_number > last_event_number) {
+		g_critical("smf_track_remove_range: invalid range of events: %d-%d, track has %d events.",
+			first_event_number, last_event_number, track->number_of_events);
+		return (-1);
 	}
 
-	if (smf_event_is_tempo_change_or_time_signature(event)) {
-		/* XXX: This will cause problems, when there is more than one Tempo Change event at a given time. */
-		if (was_last)
-			remove_last_tempo_with_pulses(event->track->smf, event->time_pulses);
-		else
-			smf_create_tempo_map_and_compute_seconds(track->smf);
-	}
+	remove_events(track, NULL, NULL, first_event_number, last_event_number);
 
-	event->track = NULL;
-	event->event_number = -1;
-	event->delta_time_pulses = -1;
-	event->time_pulses = -1;
-	event->time_seconds = -1.0;
-	event->time_microseconds = -1;
+	return (0);
 }
 
 /**
@@ -685,15 +1620,10 @@ smf_set_ppqn(smf_t *smf, int ppqn)
 }
 
 /**
-  * Returns next event from the track given and advances next event counter.
-  * Do not depend on End Of Track event being the last event on the track - it
-  * is possible that the track will not end with EOT if you haven't added it
-  * yet.  EOTs are added automatically during smf_save().
-  *
-  * \return Event or NULL, if there are no more events left in this track.
-  */
-smf_event_t *
-smf_track_get_next_event(smf_track_t *track)
+ * Does the work of smf_track_get_next_event(), without telling the smf that the track moved.
+ */
+static smf_event_t *
+advance_track(smf_track_t *track)
 {
 	smf_event_t *event, *next_event;
 
@@ -722,6 +1652,24 @@ smf_track_get_next_event(smf_track_t *track)
 	return (event);
 }
 
+/**
+  * Returns next event from the track given and advances next event counter.
+  * Do not depend on End Of Track event being the last event on the track - it
+  * is possible that the track will not end with EOT if you haven't added it
+  * yet.  EOTs are added automatically during smf_save().
+  *
+  * \return Event or NULL, if there are no more events left in this track.
+  */
+smf_event_t *
+smf_track_get_next_event(smf_track_t *track)
+{
+	/* The heap used by smf_get_next_event() does not know that this track moved. */
+	if (track->smf != NULL)
+		track->smf->next_event_heap_is_valid = 0;
+
+	return (advance_track(track));
+}
+
 /**
   * Returns next event from the track given.  Does not change next event counter,
   * so repeatedly calling this routine will return the same event.
@@ -745,11 +1693,13 @@ smf_peek_next_event_from_track(smf_track_t *track)
 }
 
 /**
- * \return Track with a given number or NULL, if there is no such track.
- * Tracks are numbered consecutively starting from one.
+ * \internal
+ *
+ * Same as smf_get_track_by_number(), but does not parse the track, if the song was loaded lazily.
+ * Events and event counts of such track are not valid yet; use it only for the other fields.
  */
 smf_track_t *
-smf_get_track_by_number(const smf_t *smf, int track_number)
+smf_peek_track_by_number(const smf_t *smf, int track_number)
 {
 	smf_track_t *track;
 
@@ -765,6 +1715,47 @@ smf_get_track_by_number(const smf_t *smf, int track_number)
 	return (track);
 }
 
+/**
+ * \return Track with a given number or NULL, if there is no such track.
+ * Tracks are numbered consecutively starting from one.  If the song was
+ * loaded lazily, this parses the track, if it was not parsed yet.
+ */
+smf_track_t *
+smf_get_track_by_number(smf_t *smf, int track_number)
+{
+	smf_track_t *track;
+
+	track = smf_peek_track_by_number(smf, track_number);
+	if (track == NULL)
+		return (NULL);
+
+	/* Song was loaded lazily and nobody looked at this track yet? */
+	if (track->parse_pending)
+		smf_track_parse_pending_events(track);
+
+	return (track);
+}
+
+/**
+ * Parses all the tracks of the song loaded lazily that were not parsed yet.  Parsing a track
+ * changes the song - it invalidates timelines, checkpoints and cursors made before - so a lazy
+ * song must not be shared between threads, even if they only read it, until this is called.
+ * Does nothing for songs that were not loaded lazily.
+ */
+void
+smf_parse_all_tracks(smf_t *smf)
+{
+	int i;
+	smf_track_t *track;
+
+	for (i = 1; smf->number_of_unparsed_tracks > 0 && i <= smf->number_of_tracks; i++) {
+		track = smf_peek_track_by_number(smf, i);
+
+		if (track->parse_pending)
+			smf_track_parse_pending_events(track);
+	}
+}
+
 /**
  * \return Event with a given number or NULL, if there is no such event.
  * Events are numbered consecutively starting from one.
@@ -803,20 +1794,145 @@ smf_track_get_last_event(const smf_track_t *track)
 }
 
 /**
- * Searches for track that contains next event, in time order.  In other words,
- * returns the track that contains event that should be played next.
- * \return Track with next event or NULL, if there are no events left.
+ * \return Nonzero if next event of entry "a" should be played before next event of entry "b".
+ * Of events that happen at the same time, the one from the track with lower number goes first.
  */
-smf_track_t *
-smf_find_track_with_next_event(smf_t *smf);
+static int
+plays_before(const smf_heap_entry_t *a, const smf_heap_entry_t *b)
+{
+	if (a->time_of_next_event != b->time_of_next_event)
+		return (a->time_of_next_event < b->time_of_next_event);
 
-smf_track_t *
-smf_find_track_with_next_event(smf_t *smf)
+	return (a->track_number < b->track_number);
+}
+
+/**
+ * \internal
+ *
+ * Moves the entry at position "i" of the heap down, until it is not after any of its children.
+ * Used for smf_get_next_event() and for cursors, so that both return events in the same order.
+ */
+void
+smf_heap_sift_down(smf_heap_entry_t *heap, int heap_length, int i)
+{
+	int child;
+	smf_heap_entry_t entry = heap[i];
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap_length)
+			break;
+
+		if (child + 1 < heap_length && plays_before(heap + child + 1, heap + child))
+			child++;
+
+		if (!plays_before(heap + child, &entry))
+			break;
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = entry;
+}
+
+/**
+ * \internal
+ *
+ * Orders "heap_length" entries, filled in any order, into a heap.
+ */
+void
+smf_heap_build(smf_heap_entry_t *heap, int heap_length)
+{
+	int i;
+
+	for (i = heap_length / 2 - 1; i >= 0; i--)
+		smf_heap_sift_down(heap, heap_length, i);
+}
+
+/**
+ * \internal
+ *
+ * Puts the first entry of the heap where it belongs, after its track moved to the next event.
+ * If there are no events left in the track, it is removed from the heap.
+ * \return New length of the heap.
+ */
+int
+smf_heap_update_first(smf_heap_entry_t *heap, int heap_length, int next_event_number, int time_of_next_event)
+{
+	assert(heap_length > 0);
+
+	if (next_event_number == -1) {
+		heap_length--;
+		heap[0] = heap[heap_length];
+	} else {
+		heap[0].time_of_next_event = time_of_next_event;
+	}
+
+	if (heap_length > 0)
+		smf_heap_sift_down(heap, heap_length, 0);
+
+	return (heap_length);
+}
+
+/**
+ * Builds the heap of tracks that have events left, ordered by time of their next event.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+build_next_event_heap(smf_t *smf)
+{
+	int i, allocated;
+	smf_track_t *track;
+	smf_heap_entry_t *heap, *entry;
+
+	if (smf->next_event_heap_allocated < smf->number_of_tracks) {
+		allocated = smf->number_of_tracks > 16 ? smf->number_of_tracks : 16;
+
+		heap = realloc(smf->next_event_heap, allocated * sizeof(smf_heap_entry_t));
+		if (heap == NULL) {
+			g_critical("Cannot allocate memory for next event heap: %s", strerror(errno));
+			return (-1);
+		}
+
+		smf->next_event_heap = heap;
+		smf->next_event_heap_allocated = allocated;
+	}
+
+	smf->next_event_heap_length = 0;
+
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
+
+		assert(track);
+
+		/* No more events in this track? */
+		if (track->next_event_number == -1)
+			continue;
+
+		entry = smf->next_event_heap + smf->next_event_heap_length++;
+		entry->time_of_next_event = track->time_of_next_event;
+		entry->track_number = track->track_number;
+		entry->position = track;
+	}
+
+	smf_heap_build(smf->next_event_heap, smf->next_event_heap_length);
+
+	smf->next_event_heap_is_valid = 1;
+
+	return (0);
+}
+
+/**
+ * Searches for track that contains next event, in time order, by looking at every track.
+ * Used if the heap cannot be built.
+ */
+static smf_track_t *
+scan_for_track_with_next_event(smf_t *smf)
 {
-	int i, min_time = 0;
+	int i;
 	smf_track_t *track = NULL, *min_time_track = NULL;
 
-	/* Find track with event that should be played next. */
 	for (i = 1; i <= smf->number_of_tracks; i++) {
 		track = smf_get_track_by_number(smf, i);
 
@@ -826,15 +1942,36 @@ smf_find_track_with_next_event(smf_t *smf)
 		if (track->next_event_number == -1)
 			continue;
 
-		if (track->time_of_next_event < min_time || min_time_track == NULL) {
-			min_time = track->time_of_next_event;
+		/* Tracks are looked at in order, so of the same times, the first one wins. */
+		if (min_time_track == NULL || track->time_of_next_event < min_time_track->time_of_next_event)
 			min_time_track = track;
-		}
 	}
 
 	return (min_time_track);
 }
 
+/**
+ * Searches for track that contains next event, in time order.  In other words,
+ * returns the track that contains event that should be played next.  Tracks are kept
+ * in a binary heap, so this does not need to look at every track; the heap is rebuilt
+ * only after tracks were changed or repositioned by something else than smf_get_next_event().
+ * \return Track with next event or NULL, if there are no events left.
+ */
+smf_track_t *
+smf_find_track_with_next_event(smf_t *smf);
+
+smf_track_t *
+smf_find_track_with_next_event(smf_t *smf)
+{
+	if (!smf->next_event_heap_is_valid && build_next_event_heap(smf))
+		return (scan_for_track_with_next_event(smf));
+
+	if (smf->next_event_heap_length == 0)
+		return (NULL);
+
+	return (smf->next_event_heap[0].position);
+}
+
 /**
   * \return Next event, in time order, or NULL, if there are none left.
   */
@@ -852,10 +1989,18 @@ smf_get_next_event(smf_t *smf)
 		return (NULL);
 	}
 
-	event = smf_track_get_next_event(track);
+	event = advance_track(track);
 	
 	assert(event != NULL);
 
+	/* Only the first track in the heap moved; put it where it belongs now. */
+	if (smf->next_event_heap_is_valid) {
+		assert(smf->next_event_heap[0].position == track);
+
+		smf->next_event_heap_length = smf_heap_update_first(smf->next_event_heap, smf->next_event_heap_length,
+			track->next_event_number, track->time_of_next_event);
+	}
+
 	event->track->smf->last_seek_position = -1.0;
 
 	return (event);
@@ -913,6 +2058,7 @@ smf_rewind(smf_t *smf)
 	assert(smf);
 
 	smf->last_seek_position = 0.0;
+	smf->next_event_heap_is_valid = 0;
 
 	for (i = 1; i <= smf->number_of_tracks; i++) {
 		track = smf_get_track_by_number(smf, i);
@@ -934,6 +2080,83 @@ smf_rewind(smf_t *smf)
 	}
 }
 
+/**
+ * \internal
+ *
+ * \return Number of the first event in the track that happens at "pulses" or later or, if "after"
+ * is nonzero, strictly later than "pulses"; number_of_events + 1 if there is no such event.
+ * Events are sorted by ->time_pulses, so this is a binary search.
+ */
+int
+smf_track_find_event_by_pulses(const smf_track_t *track, int pulses, int after)
+{
+	int low = 0, high = track->number_of_events, middle, time_pulses;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		time_pulses = ((smf_event_t *)track->events_array->pdata[middle])->time_pulses;
+
+		if (time_pulses < pulses || (after && time_pulses == pulses))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return (low + 1);
+}
+
+/**
+ * \internal
+ *
+ * \return Number of the first event in the track that happens at "seconds" or later;
+ * number_of_events + 1 if there is no such event.  ->time_seconds must be up to date.
+ */
+int
+smf_track_find_event_by_seconds(const smf_track_t *track, double seconds)
+{
+	int low = 0, high = track->number_of_events, middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (((smf_event_t *)track->events_array->pdata[middle])->time_seconds < seconds)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return (low + 1);
+}
+
+/**
+ * \internal
+ *
+ * Sets position in the track, kept in "next_event_number" and "time_of_next_event", so that event
+ * number "event_number" is the next one, or, if there is no such event, to the end of the track.
+ * Used for the position of the track itself and for cursors.
+ */
+void
+smf_track_set_position(const smf_track_t *track, int event_number, int *next_event_number, int *time_of_next_event)
+{
+	if (event_number > track->number_of_events) {
+		*next_event_number = -1;
+		return;
+	}
+
+	*next_event_number = event_number;
+	*time_of_next_event = ((smf_event_t *)track->events_array->pdata[event_number - 1])->time_pulses;
+}
+
+/**
+ * Makes event number "event_number" the next one returned from the track, or, if there is
+ * no such event, moves the track to its end.
+ */
+static void
+set_next_event_number(smf_track_t *track, int event_number)
+{
+	smf_track_set_position(track, event_number, &track->next_event_number, &track->time_of_next_event);
+}
+
 /**
   * Seeks the SMF to the given event.  After calling this routine, smf_get_next_event
   * will return the event that was the second argument of this call.
@@ -941,27 +2164,32 @@ smf_rewind(smf_t *smf)
 int
 smf_seek_to_event(smf_t *smf, const smf_event_t *target)
 {
-	smf_event_t *event;
+	int i;
+	smf_track_t *track;
 
-	smf_rewind(smf);
+	/* "target" has to be in this smf. */
+	assert(target->track != NULL);
+	assert(target->track->smf == smf);
 
 #if 0
 	g_debug("Seeking to event %d, track %d.", target->event_number, target->track->track_number);
 #endif
 
-	for (;;) {
-		event = smf_peek_next_event(smf);
-
-		/* There can't be NULL here, unless "target" is not in this smf. */
-		assert(event);
+	/*
+	 * Events that smf_get_next_event() returns before the target are these that happen earlier
+	 * and, of the ones that happen at the same time, these from tracks with lower numbers.
+	 */
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
 
-		if (event != target)
-			smf_skip_next_event(smf);
+		if (track == target->track)
+			set_next_event_number(track, target->event_number);
 		else
-			break;
-	}	
+			set_next_event_number(track, smf_track_find_event_by_pulses(track, target->time_pulses, i < target->track->track_number));
+	}
 
-	smf->last_seek_position = event->time_seconds;
+	smf->next_event_heap_is_valid = 0;
+	smf->last_seek_position = target->time_seconds;
 
 	return (0);
 }
@@ -969,12 +2197,14 @@ smf_seek_to_event(smf_t *smf, const smf_event_t *target)
 /**
   * Seeks the SMF to the given position.  For example, after seeking to 1.0 seconds,
   * smf_get_next_event will return first event that happens after the first second of song.
+  * Every track is searched using binary search, so this takes O(log(number of events)) per track.
   * \return 0 if everything went ok, nonzero otherwise.
   */
 int
 smf_seek_to_seconds(smf_t *smf, double seconds)
 {
-	smf_event_t *event;
+	int i;
+	smf_track_t *track;
 
 	assert(seconds >= 0.0);
 
@@ -985,24 +2215,23 @@ smf_seek_to_seconds(smf_t *smf, double seconds)
 		return (0);
 	}
 
-	smf_rewind(smf);
+	smf_update_tempo_map_if_stale(smf);
 
 #if 0
 	g_debug("Seeking to %f seconds.", seconds);
 #endif
 
-	for (;;) {
-		event = smf_peek_next_event(smf);
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
+		set_next_event_number(track, smf_track_find_event_by_seconds(track, seconds));
+	}
 
-		if (event == NULL) {
-			g_critical("Trying to seek past the end of song.");
-			return (-1);
-		}
+	smf->next_event_heap_is_valid = 0;
 
-		if (event->time_seconds < seconds)
-			smf_skip_next_event(smf);
-		else
-			break;
+	if (smf_peek_next_event(smf) == NULL) {
+		g_critical("Trying to seek past the end of song.");
+		smf->last_seek_position = -1.0;
+		return (-1);
 	}
 
 	smf->last_seek_position = seconds;
@@ -1013,33 +2242,34 @@ smf_seek_to_seconds(smf_t *smf, double seconds)
 /**
   * Seeks the SMF to the given position.  For example, after seeking to 10 pulses,
   * smf_get_next_event will return first event that happens after the first ten pulses.
+  * Like smf_seek_to_seconds(), this uses binary search.
   * \return 0 if everything went ok, nonzero otherwise.
   */
 int
 smf_seek_to_pulses(smf_t *smf, int pulses)
 {
+	int i;
+	smf_track_t *track;
 	smf_event_t *event;
 
 	assert(pulses >= 0);
 
-	smf_rewind(smf);
-
 #if 0
 	g_debug("Seeking to %d pulses.", pulses);
 #endif
 
-	for (;;) {
-		event = smf_peek_next_event(smf);
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
+		set_next_event_number(track, smf_track_find_event_by_pulses(track, pulses, 0));
+	}
 
-		if (event == NULL) {
-			g_critical("Trying to seek past the end of song.");
-			return (-1);
-		}
+	smf->next_event_heap_is_valid = 0;
 
-		if (event->time_pulses < pulses)
-			smf_skip_next_event(smf);
-		else
-			break;
+	event = smf_peek_next_event(smf);
+	if (event == NULL) {
+		g_critical("Trying to seek past the end of song.");
+		smf->last_seek_position = -1.0;
+		return (-1);
 	}
 
 	smf->last_seek_position = event->time_seconds;
@@ -1051,7 +2281,7 @@ smf_seek_to_pulses(smf_t *smf, int pulses)
   * \return Length of SMF, in pulses.
   */
 int
-smf_get_length_pulses(const smf_t *smf)
+smf_get_length_pulses(smf_t *smf)
 {
 	int pulses = 0, i;
 
@@ -1078,7 +2308,7 @@ smf_get_length_pulses(const smf_t *smf)
   * \return Length of SMF, in seconds.
   */
 double
-smf_get_length_seconds(const smf_t *smf)
+smf_get_length_seconds(smf_t *smf)
 {
 	int i;
 	double seconds = 0.0;
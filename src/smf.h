@@ -121,6 +121,66 @@
  * do smf_get_next_event() in loop, until it returns NULL.  Calling smf_load() causes the smf to be rewound
  * to the start of the song.
  *
+ * If you load lots of files, use smf_load_mmap() instead of smf_load().  It works the same way, but parses
+ * the file directly from memory-mapped pages, without copying it into a temporary buffer first.
+ *
+ * Files that cannot be opened by name, such as standard input, pipes or already opened descriptors, can be loaded
+ * using smf_load_from_stream() or smf_load_from_fd().  These read until end of file and do not need to seek.
+ *
+ * If you only need some of the tracks, use smf_load_lazy() or smf_load_from_memory_lazy().  These only find
+ * where the tracks are and build the tempo map; events of a track are parsed the first time the track is
+ * accessed, by smf_get_track_by_number() or by smf_get_next_event() and friends.  Fields of the track,
+ * such as track->number_of_events, are valid only after it was returned by smf_get_track_by_number().
+ * Parsing changes the song, so before sharing it between threads, parse the rest using smf_parse_all_tracks().
+ *
+ * Files with lots of tracks can be loaded faster using smf_load_parallel() or smf_load_from_memory_parallel(),
+ * which parse the tracks using several threads at once.
+ *
+ * Deleting a big smf takes time, as every event is freed separately.  If that matters, load it using
+ * smf_load_with_arena() or smf_load_from_memory_with_arena(), or create it using smf_new_with_arena().
+ * Events of such smf are allocated in big blocks, all freed at once by smf_delete(); they must not be
+ * used after that, even if they were removed from their tracks.
+ *
+ * To load lots of files at once, use smf_load_many().  It loads them using a pool of threads and passes each
+ * smf, as soon as it is loaded, to the callback function you provide.
+ *
+ * If the file arrives in pieces, e.g. from a pipe or a network connection, there is no need to wait for all
+ * of it.  Create a parser using smf_parser_new(), pass the data to smf_parser_feed() as it arrives, and get
+ * the events parsed so far using smf_parser_get_next_event().  At the end of data, smf_parser_finish()
+ * returns the smf, just like smf_load() would.
+ *
+ * If you only need to look at the events, e.g. to gather some statistics about lots of files, use smf_reader_new()
+ * instead of loading the file.  smf_reader_get_next_event() returns events found directly in the file buffer, either
+ * track by track or in time order, without allocating anything.  Time in seconds is not computed.
+ *
+ * To scan a loaded track many times, e.g. looking for all the Note On events on a given channel,
+ * make its columnar copy using smf_track_columns_new().  It keeps times, status bytes and data bytes
+ * of all the events in separate contiguous arrays, which are much faster to go through than the events.
+ * smf_track_columns_select() finds events by status, and smf_track_columns_get_event_view() describes
+ * a single event the same way smf_reader_get_next_event() does.
+ *
+ * To go through the whole song many times, e.g. when playing it in a loop, use smf_build_timeline().
+ * It returns all the events of all the tracks, merged in time order, as a single array; going through
+ * it is much faster than smf_get_next_event(), and n-th event of the song is simply timeline->entries[n].
+ * The timeline stays valid until the song is changed; then call smf_build_timeline() again.
+ *
+ * Playback starting in the middle of the song usually has to restore programs, controllers and pitch bend
+ * set by the earlier events.  smf_chase_new() remembers state of all the channels every few seconds;
+ * smf_chase_seek_to_seconds() and smf_chase_seek_to_pulses() seek, then compute state of the channels
+ * at that point, starting from the nearest remembered one.  smf_chase_get_messages() turns that state
+ * into MIDI messages that can be sent before the playback starts.
+ *
+ * Position used by smf_get_next_event() and smf_seek_to_seconds() is stored in the smf_t, so only one
+ * piece of code at a time can go through the song that way.  smf_cursor_new() creates a separate position,
+ * with its own smf_cursor_get_next_event(), smf_cursor_seek_to_seconds() etc.; these never modify the song,
+ * so any number of cursors can be used at the same time, also from different threads, as long as nobody
+ * changes the song meanwhile.
+ *
+ * smf_player_new() plays the song in real time.  Its scheduler thread sleeps until each event is due
+ * and passes it, without locks, to smf_player_drain(), which is meant to be called from the audio
+ * or MIDI output thread; smf_player_get_stats() tells how precise the timing was.  Just like with cursors,
+ * nobody may change the song while the player is running.
+ *
  * Getting events by number works like this:
  *
  * \code
@@ -134,7 +194,11 @@
  * First one creates an empty event - you need to manually allocate (using malloc(3)) buffer for
  * MIDI data, write MIDI data into it, put the address of that buffer into event->midi_buffer,
  * and the length of MIDI data into event->midi_buffer_length.  Note that deleting the event
- * (using smf_event_delete()) will free the buffer.
+ * (using smf_event_delete()) will free the buffer.  Do this only with events just returned
+ * by smf_event_new(), whose event->midi_buffer is still NULL.  To replace the message of any other event,
+ * use smf_event_set_midi_buffer(); short messages, like Note On, are stored inside smf_event_t itself
+ * and songs that use an arena (see smf_new_with_arena()) keep messages there, so event->midi_buffer
+ * is not always allocated using malloc(3) - never free(3), realloc(3) or overwrite the pointer yourself.
  *
  * Second form does most of this for you: it takes an address of the buffer containing MIDI data,
  * allocates storage and copies MIDI data into it.
@@ -188,7 +252,15 @@
  * Tempo Change event that is in the middle of the song, the rest of the events will have their
  * event->time_seconds recomputed from event->time_pulses before smf_event_remove_from_track() function returns.
  * Adding Tempo Change in the middle of the song works in a similar way.
- * 	
+ * Recomputing is done for all the events in the song, so if you are going to add or remove many
+ * tempo-related events, put these changes between smf_begin_edit() and smf_commit_edit(); the tempo
+ * map and event->time_seconds will then be recomputed only once, at commit.
+ *
+ * Editors can call smf_enable_undo() and then use smf_undo() and smf_redo().  Changes between
+ * smf_begin_edit() and smf_commit_edit() are undone together.  To change MIDI message of an event
+ * that is already in a track, use smf_event_set_midi_buffer(); changes made by writing directly
+ * into event->midi_buffer cannot be undone.
+ *
  * MIDI data (event->midi_buffer) is always kept in normalized form - it always begins with status byte
  * (no running status), there are no System Realtime events embedded in them etc.  Events like SysExes
  * are in "on the wire" form, without embedded length that is used in SMF file format.  Obviously
@@ -247,10 +319,38 @@ struct smf_struct {
 	/** Private, used by smf.c. */
 	GPtrArray	*tracks_array;
 	double		last_seek_position;
+	/** Tracks with events left, as a binary heap ordered by time of their next event; see smf_get_next_event(). */
+	struct smf_heap_entry_struct	*next_event_heap;
+	int		next_event_heap_length;
+	int		next_event_heap_allocated;
+	/** Zero if tracks were changed, or moved to another position, since the heap was built. */
+	int		next_event_heap_is_valid;
+	/** Incremented whenever events or tracks are added or removed, or times of the events change. */
+	int		generation;
+	/** Built by smf_build_timeline(), or NULL. */
+	struct smf_timeline_struct	*timeline;
+	/** Arena the events and tempo map are allocated from, or NULL; see smf_new_with_arena(). */
+	struct smf_arena_struct	*arena;
 
 	/** Private, used by smf_tempo.c. */
 	/** Array of pointers to smf_tempo_struct. */
 	GPtrArray	*tempo_array;
+	/** Nesting level of smf_begin_edit() and whether the tempo map needs recomputing at commit. */
+	int		edit_depth;
+	int		tempo_map_is_stale;
+	/** Incremented by every outermost smf_begin_edit(). */
+	int		edit_number;
+
+	/** Private, used by smf_journal.c; NULL unless smf_enable_undo() was called. */
+	struct smf_journal_struct	*journal;
+
+	/** Private, used by smf_load.c for lazily loaded songs. */
+	/** Buffer the unparsed tracks point into and number of tracks that were not parsed yet. */
+	const void	*lazy_buffer;
+	int		lazy_buffer_length;
+	int		number_of_unparsed_tracks;
+	/** Routine releasing lazy_buffer, or NULL, if the buffer belongs to the caller. */
+	void		(*lazy_buffer_release)(void *buffer, int buffer_length);
 };
 
 typedef struct smf_struct smf_t;
@@ -280,6 +380,8 @@ struct smf_track_struct {
 	void		*file_buffer;
 	int		file_buffer_length;
 	int		last_status; /* Used for "running status". */
+	/** Nonzero, if the track was loaded lazily and its events were not parsed yet. */
+	int		parse_pending;
 
 	/** Private, used by smf.c. */
 	/** Offset into buffer, used in parse_next_event(). */
@@ -299,6 +401,9 @@ struct smf_track_struct {
 
 typedef struct smf_track_struct smf_track_t;
 
+/** Messages up to this long are stored inside smf_event_t, without separate allocation. */
+#define SMF_EVENT_INLINE_BUFFER_LENGTH 8
+
 /** Represents a single MIDI event or metaevent. */
 struct smf_event_struct {
 	/** Pointer to the track, or NULL if event is not attached. */
@@ -314,6 +419,9 @@ struct smf_event_struct {
 	/** Time, in pulses, since the start of the song. */
 	int		time_pulses;
 
+	/** Length of the MIDI message in the buffer, in bytes. */
+	int		midi_buffer_length; 
+
 	/** Time, in seconds, since the start of the song. */
 	double		time_seconds;
 	int64_t	time_microseconds;
@@ -321,23 +429,281 @@ struct smf_event_struct {
 	/** Tracks are numbered consecutively, starting from 1. */
 	int		track_number;
 
-	/** Pointer to the buffer containing MIDI message.  This is freed by smf_event_delete. */
+	/** Pointer to the buffer containing MIDI message.  This is freed by smf_event_delete.  For short
+	    messages, it points to midi_buffer_inline; never free(3) or realloc(3) it yourself.  To replace
+	    the message, use smf_event_set_midi_buffer(). */
 	unsigned char	*midi_buffer;
 
-	/** Length of the MIDI message in the buffer, in bytes. */
-	int		midi_buffer_length; 
-
 	/** API consumer is free to use this for whatever purpose.  NULL in freshly allocated event.
 	    Note that events might be deallocated not only explicitly, by calling smf_event_delete(),
 	    but also implicitly, e.g. when calling smf_track_delete() with events still added to
 	    the track; there is no mechanism for libsmf to notify you about removal of the event. */
 	void		*user_pointer;
+
+	/** Private, used by smf.c.  Arena the event and its MIDI buffer were allocated from, or NULL. */
+	struct smf_arena_struct	*arena;
+
+	/** Private, storage for messages up to SMF_EVENT_INLINE_BUFFER_LENGTH bytes long. */
+	unsigned char	midi_buffer_inline[SMF_EVENT_INLINE_BUFFER_LENGTH];
 };
 
 typedef struct smf_event_struct smf_event_t;
 
+/** Represents SMF being loaded in pieces, as the data arrives; see smf_parser_new(). */
+struct smf_parser_struct {
+	/** SMF being loaded.  Do not modify it before calling smf_parser_finish(). */
+	smf_t		*smf;
+
+	/** Private, used by smf_load.c. */
+	int		state;
+	smf_track_t	*track;
+	int		number_of_chunks;
+	int		chunk_bytes_left;
+	unsigned char	*pending_buffer;
+	int		pending_length;
+	int		pending_allocated;
+	int		next_track_number;
+	int		next_event_number;
+};
+
+typedef struct smf_parser_struct smf_parser_t;
+
+/** Error codes passed to smf_load_many() callback. */
+#define SMF_LOAD_ERROR_READ	-1
+#define SMF_LOAD_ERROR_PARSE	-2
+
+/** Summary of smf_load_many() run. */
+struct smf_load_stats_struct {
+	int		number_of_files_loaded;
+	int		number_of_files_failed;
+
+	/** Size of all the files that were read, successfully parsed or not. */
+	int64_t		number_of_bytes;
+
+	/** Number of events in all the loaded files. */
+	int64_t		number_of_events;
+
+	/** Wall clock time of the whole run and resulting throughput. */
+	double		time_seconds;
+	double		files_per_second;
+	double		bytes_per_second;
+};
+
+typedef struct smf_load_stats_struct smf_load_stats_t;
+
+/** Describes event found by smf_reader_get_next_event().  Unlike smf_event_t, it is not allocated; it points into the file buffer,
+    except for End Of Track made up for a truncated track. */
+struct smf_event_view_struct {
+	/** Number of the track.  Tracks are numbered consecutively, starting from one, just like in smf_t. */
+	int			track_number;
+
+	/** Number of this event in the track.  Events are numbered consecutively, starting from one. */
+	int			event_number;
+
+	/** Time, in pulses, since the previous event on this track. */
+	int			delta_time_pulses;
+
+	/** Time, in pulses, since the start of the song. */
+	int			time_pulses;
+
+	/** Status byte of the MIDI message.  In case of running status, it is not present in the file. */
+	int			status;
+
+	/** Bytes following the status byte, and their number.  For SysEx, length of the message is skipped.
+	    For escaped events (status 0xF7), this is the complete message. */
+	const unsigned char	*data;
+	int			data_length;
+
+	/** Private, used by smf_columns.c to hold data bytes of short messages. */
+	unsigned char		short_data[2];
+};
+
+typedef struct smf_event_view_struct smf_event_view_t;
+
+/** Copy of the track stored column by column; see smf_track_columns_new(). */
+struct smf_track_columns_struct {
+	/** Number of the track the copy was made from. */
+	int			track_number;
+
+	/** Number of events; all the columns below have that many elements, indexed from zero. */
+	int			number_of_events;
+	int			*time_pulses;
+	double			*time_seconds;
+	unsigned char		*status;
+	/** Second and third byte of the message, or zero if the message is shorter. */
+	unsigned char		*data1;
+	unsigned char		*data2;
+
+	/** Events that do not fit in three columns above (SysEx, metaevents etc): their indices,
+	    in ascending order, offsets of their messages in long_event_data, plus one final offset
+	    equal to the total length, and complete messages, including the status byte. */
+	int			number_of_long_events;
+	int			*long_events;
+	int			*long_event_offsets;
+	unsigned char		*long_event_data;
+};
+
+typedef struct smf_track_columns_struct smf_track_columns_t;
+
+/** Single event of the timeline. */
+struct smf_timeline_entry_struct {
+	int			time_pulses;
+	int64_t			time_microseconds;
+	smf_track_t		*track;
+	smf_event_t		*event;
+};
+
+typedef struct smf_timeline_entry_struct smf_timeline_entry_t;
+
+/** Events of all the tracks merged in time order; see smf_build_timeline(). */
+struct smf_timeline_struct {
+	/** Events in the order smf_get_next_event() would return them after smf_rewind(). */
+	int			number_of_entries;
+	smf_timeline_entry_t	*entries;
+
+	/** Private, used by smf_timeline.c.  Value of smf->generation the timeline was built for. */
+	int			generation;
+	int			allocated;
+};
+
+typedef struct smf_timeline_struct smf_timeline_t;
+
+/** Value of controllers that were not set yet. */
+#define SMF_CHASE_UNSET 0xFF
+
+/** Number of RPNs and NRPNs remembered for every channel. */
+#define SMF_CHASE_MAX_PARAMETERS 8
+
+/** Upper limit of the length of messages returned by smf_chase_get_messages(). */
+#define SMF_CHASE_MAX_MESSAGES_LENGTH (16 * (128 * 3 + 2 + SMF_CHASE_MAX_PARAMETERS * 4 * 3 + 2 + 3))
+
+/** Registered or Non-Registered Parameter set using Data Entry controllers. */
+struct smf_parameter_state_struct {
+	/** Controller used to select it: 0x65 for RPN, 0x63 for NRPN. */
+	unsigned char		type;
+	unsigned char		number_msb;
+	unsigned char		number_lsb;
+	unsigned char		value_msb;
+	/** SMF_CHASE_UNSET, if Data Entry LSB was not sent. */
+	unsigned char		value_lsb;
+};
+
+typedef struct smf_parameter_state_struct smf_parameter_state_t;
+
+/** State of a single MIDI channel, as left by the events played so far. */
+struct smf_channel_state_struct {
+	/** -1 if there was no such message yet.  Pitch Bend is 0..16383. */
+	short			program;
+	short			channel_pressure;
+	short			pitch_bend;
+
+	/** Values of controllers or SMF_CHASE_UNSET.  Data Entry, Data Increment and Data Decrement,
+	    and Channel Mode Messages (120 and up) are never set. */
+	unsigned char		controllers[128];
+
+	/** Parameters, in the order they were first set.  If there are more than SMF_CHASE_MAX_PARAMETERS,
+	    the earliest ones are forgotten. */
+	int			number_of_parameters;
+	smf_parameter_state_t	parameters[SMF_CHASE_MAX_PARAMETERS];
+	/** 0x65 or 0x63, if RPN or NRPN was selected last, zero otherwise. */
+	unsigned char		selected_parameter_type;
+};
+
+typedef struct smf_channel_state_struct smf_channel_state_t;
+
+/** Keeps track of the channel state while seeking; see smf_chase_new(). */
+struct smf_chase_struct {
+	smf_t			*smf;
+
+	/** State of all the channels after the last seek done using smf_chase_seek_to_seconds()
+	    or smf_chase_seek_to_pulses(). */
+	smf_channel_state_t	channels[16];
+
+	/** Private, used by smf_chase.c. */
+	double			checkpoint_interval;
+	/** Value of smf->generation the checkpoints were made for. */
+	int			generation;
+	int			number_of_checkpoints;
+	int			allocated_checkpoints;
+	struct smf_chase_checkpoint_struct	*checkpoints;
+};
+
+typedef struct smf_chase_struct smf_chase_t;
+
+/** How the playback went so far; see smf_player_get_stats(). */
+struct smf_player_stats_struct {
+	/** Events passed to the callback of smf_player_drain(). */
+	int64_t		number_of_events;
+
+	/** Number of times the scheduler found the ring full and had to wait for smf_player_drain(). */
+	int64_t		number_of_overruns;
+
+	/** How late the scheduler thread woke up for the events, i.e. timer jitter. */
+	double		min_jitter_seconds;
+	double		max_jitter_seconds;
+	double		mean_jitter_seconds;
+
+	/** Time between the moment the event was due and the moment it was passed to the callback. */
+	double		min_latency_seconds;
+	double		max_latency_seconds;
+	double		mean_latency_seconds;
+};
+
+typedef struct smf_player_stats_struct smf_player_stats_t;
+
+/** Plays the song in real time; see smf_player_new(). */
+struct smf_player_struct {
+	/** Song being played.  Do not modify it while the player is running. */
+	smf_t		*smf;
+
+	/** Private, used by smf_player.c. */
+	int		is_running;
+	/** Ring, statistics and everything else the scheduler thread shares with other threads; NULL on platforms
+	    without real time playback. */
+	struct smf_player_state_struct		*state;
+};
+
+typedef struct smf_player_struct smf_player_t;
+
+/** Position in the song, independent of the one used by smf_get_next_event(); see smf_cursor_new(). */
+struct smf_cursor_struct {
+	/** Song the cursor goes through.  The cursor never modifies it. */
+	smf_t		*smf;
+
+	/** Private, used by smf_cursor.c. */
+	int		number_of_tracks;
+	struct smf_cursor_track_struct	*tracks;
+	/** Tracks that have events left, ordered by time of their next event. */
+	struct smf_heap_entry_struct	*heap;
+	int		heap_length;
+	/** Value of smf->generation the cursor was positioned for. */
+	int		generation;
+	double		last_seek_position;
+};
+
+typedef struct smf_cursor_struct smf_cursor_t;
+
+/** Read-only cursor over the file buffer; see smf_reader_new(). */
+struct smf_reader_struct {
+	/** These are taken from the MThd chunk. */
+	int			format;
+	int			ppqn;
+	int			number_of_tracks;
+
+	/** Private, used by smf_load.c. */
+	const unsigned char	*file_buffer;
+	int			file_buffer_length;
+	int			merge_tracks;
+	int			last_track_index;
+	struct smf_reader_track_struct	*tracks;
+};
+
+typedef struct smf_reader_struct smf_reader_t;
+
 /* Routines for manipulating smf_t. */
 smf_t *smf_new(void) WARN_UNUSED_RESULT;
+smf_t *smf_new_with_arena(void) WARN_UNUSED_RESULT;
+smf_t *smf_clone(smf_t *smf) WARN_UNUSED_RESULT;
 void smf_delete(smf_t *smf);
 
 int smf_set_format(smf_t *smf, int format) WARN_UNUSED_RESULT;
@@ -345,19 +711,30 @@ int smf_set_ppqn(smf_t *smf, int format) WARN_UNUSED_RESULT;
 
 char *smf_decode(const smf_t *smf) WARN_UNUSED_RESULT;
 
-smf_track_t *smf_get_track_by_number(const smf_t *smf, int track_number) WARN_UNUSED_RESULT;
+smf_track_t *smf_get_track_by_number(smf_t *smf, int track_number) WARN_UNUSED_RESULT;
+void smf_parse_all_tracks(smf_t *smf);
 
 smf_event_t *smf_peek_next_event(smf_t *smf) WARN_UNUSED_RESULT;
 smf_event_t *smf_get_next_event(smf_t *smf) WARN_UNUSED_RESULT;
 void smf_skip_next_event(smf_t *smf);
 
+void smf_begin_edit(smf_t *smf);
+void smf_commit_edit(smf_t *smf);
+
+int smf_enable_undo(smf_t *smf) WARN_UNUSED_RESULT;
+void smf_disable_undo(smf_t *smf);
+int smf_undo(smf_t *smf);
+int smf_redo(smf_t *smf);
+int smf_can_undo(const smf_t *smf) WARN_UNUSED_RESULT;
+int smf_can_redo(const smf_t *smf) WARN_UNUSED_RESULT;
+
 void smf_rewind(smf_t *smf);
 int smf_seek_to_seconds(smf_t *smf, double seconds) WARN_UNUSED_RESULT;
 int smf_seek_to_pulses(smf_t *smf, int pulses) WARN_UNUSED_RESULT;
 int smf_seek_to_event(smf_t *smf, const smf_event_t *event) WARN_UNUSED_RESULT;
 
-int smf_get_length_pulses(const smf_t *smf) WARN_UNUSED_RESULT;
-double smf_get_length_seconds(const smf_t *smf) WARN_UNUSED_RESULT;
+int smf_get_length_pulses(smf_t *smf) WARN_UNUSED_RESULT;
+double smf_get_length_seconds(smf_t *smf) WARN_UNUSED_RESULT;
 int smf_event_is_last(const smf_event_t *event) WARN_UNUSED_RESULT;
 
 void smf_add_track(smf_t *smf, smf_track_t *track);
@@ -366,6 +743,7 @@ void smf_track_remove_from_smf(smf_track_t *track);
 /* Routines for manipulating smf_track_t. */
 smf_track_t *smf_track_new(void) WARN_UNUSED_RESULT;
 void smf_track_delete(smf_track_t *track);
+void smf_track_reserve_events(smf_track_t *track, int number_of_events);
 
 smf_event_t *smf_track_get_next_event(smf_track_t *track) WARN_UNUSED_RESULT;
 smf_event_t *smf_track_get_event_by_number(const smf_track_t *track, int event_number) WARN_UNUSED_RESULT;
@@ -374,10 +752,14 @@ smf_event_t *smf_track_get_last_event(const smf_track_t *track) WARN_UNUSED_RESU
 void smf_track_add_event_delta_pulses(smf_track_t *track, smf_event_t *event, int pulses);
 void smf_track_add_event_pulses(smf_track_t *track, smf_event_t *event, int pulses);
 void smf_track_add_event_seconds(smf_track_t *track, smf_event_t *event, double seconds);
+int smf_track_add_events_packed(smf_track_t *track, int number_of_events, const int *pulses, const uint32_t *messages,
+	int number_of_long_messages, const unsigned char * const *long_messages, const int *long_message_lengths) WARN_UNUSED_RESULT;
 int smf_track_add_eot_delta_pulses(smf_track_t *track, int delta) WARN_UNUSED_RESULT;
 int smf_track_add_eot_pulses(smf_track_t *track, int pulses) WARN_UNUSED_RESULT;
 int smf_track_add_eot_seconds(smf_track_t *track, double seconds) WARN_UNUSED_RESULT;
 void smf_event_remove_from_track(smf_event_t *event);
+int smf_track_remove_events_if(smf_track_t *track, int (*predicate)(const smf_event_t *event, void *ctx), void *ctx) WARN_UNUSED_RESULT;
+int smf_track_remove_range(smf_track_t *track, int first_event_number, int last_event_number) WARN_UNUSED_RESULT;
 
 /* Routines for manipulating smf_event_t. */
 smf_event_t *smf_event_new(void) WARN_UNUSED_RESULT;
@@ -385,6 +767,7 @@ smf_event_t *smf_event_new_from_pointer(void *midi_data, int len) WARN_UNUSED_RE
 smf_event_t *smf_event_new_from_bytes(int first_byte, int second_byte, int third_byte) WARN_UNUSED_RESULT;
 smf_event_t *smf_event_new_textual(int type, const char *text) WARN_UNUSED_RESULT;
 void smf_event_delete(smf_event_t *event);
+int smf_event_set_midi_buffer(smf_event_t *event, const void *midi_data, int len) WARN_UNUSED_RESULT;
 
 int smf_event_is_valid(const smf_event_t *event) WARN_UNUSED_RESULT;
 int smf_event_is_metadata(const smf_event_t *event) WARN_UNUSED_RESULT;
@@ -398,7 +781,66 @@ char *smf_event_extract_text(const smf_event_t *event) WARN_UNUSED_RESULT;
 
 /* Routines for loading SMF files. */
 smf_t *smf_load(const char *file_name) WARN_UNUSED_RESULT;
+smf_t *smf_load_mmap(const char *file_name) WARN_UNUSED_RESULT;
+smf_t *smf_load_lazy(const char *file_name) WARN_UNUSED_RESULT;
+smf_t *smf_load_parallel(const char *file_name, int number_of_threads) WARN_UNUSED_RESULT;
+smf_t *smf_load_with_arena(const char *file_name) WARN_UNUSED_RESULT;
+smf_t *smf_load_from_stream(FILE *stream) WARN_UNUSED_RESULT;
+smf_t *smf_load_from_fd(int fd) WARN_UNUSED_RESULT;
 smf_t *smf_load_from_memory(const void *buffer, const int buffer_length) WARN_UNUSED_RESULT;
+smf_t *smf_load_from_memory_lazy(const void *buffer, const int buffer_length) WARN_UNUSED_RESULT;
+smf_t *smf_load_from_memory_parallel(const void *buffer, const int buffer_length, int number_of_threads) WARN_UNUSED_RESULT;
+smf_t *smf_load_from_memory_with_arena(const void *buffer, const int buffer_length) WARN_UNUSED_RESULT;
+int smf_load_many(const char * const *file_names, int number_of_files, int number_of_threads,
+	void (*callback)(smf_t *smf, int file_index, int error, void *user_data), void *user_data, smf_load_stats_t *stats);
+
+/* Routines for loading SMF files that arrive in pieces. */
+smf_parser_t *smf_parser_new(void) WARN_UNUSED_RESULT;
+void smf_parser_delete(smf_parser_t *parser);
+int smf_parser_feed(smf_parser_t *parser, const void *buffer, int buffer_length) WARN_UNUSED_RESULT;
+smf_event_t *smf_parser_get_next_event(smf_parser_t *parser) WARN_UNUSED_RESULT;
+smf_t *smf_parser_finish(smf_parser_t *parser) WARN_UNUSED_RESULT;
+
+/* Routines for reading SMF files without loading them. */
+smf_reader_t *smf_reader_new(const void *buffer, const int buffer_length, int merge_tracks) WARN_UNUSED_RESULT;
+void smf_reader_delete(smf_reader_t *reader);
+void smf_reader_rewind(smf_reader_t *reader);
+const smf_event_view_t *smf_reader_get_next_event(smf_reader_t *reader) WARN_UNUSED_RESULT;
+
+/* Routines for columnar copies of tracks. */
+smf_track_columns_t *smf_track_columns_new(const smf_track_t *track) WARN_UNUSED_RESULT;
+void smf_track_columns_delete(smf_track_columns_t *columns);
+int smf_track_columns_select(const smf_track_columns_t *columns, unsigned char status_mask, unsigned char status, int *indices);
+int smf_track_columns_get_event_view(const smf_track_columns_t *columns, int index, smf_event_view_t *view) WARN_UNUSED_RESULT;
+
+/* Routine for merged timeline of the song. */
+const smf_timeline_t *smf_build_timeline(smf_t *smf) WARN_UNUSED_RESULT;
+
+/* Routines for seeking with channel state chase. */
+smf_chase_t *smf_chase_new(smf_t *smf, double checkpoint_interval) WARN_UNUSED_RESULT;
+void smf_chase_delete(smf_chase_t *chase);
+int smf_chase_seek_to_seconds(smf_chase_t *chase, double seconds) WARN_UNUSED_RESULT;
+int smf_chase_seek_to_pulses(smf_chase_t *chase, int pulses) WARN_UNUSED_RESULT;
+int smf_chase_get_messages(const smf_chase_t *chase, unsigned char *buffer, int buffer_length) WARN_UNUSED_RESULT;
+
+/* Routines for iterating over the song without changing it. */
+smf_cursor_t *smf_cursor_new(smf_t *smf) WARN_UNUSED_RESULT;
+void smf_cursor_delete(smf_cursor_t *cursor);
+void smf_cursor_rewind(smf_cursor_t *cursor);
+smf_event_t *smf_cursor_get_next_event(smf_cursor_t *cursor) WARN_UNUSED_RESULT;
+smf_event_t *smf_cursor_peek_next_event(smf_cursor_t *cursor) WARN_UNUSED_RESULT;
+int smf_cursor_seek_to_event(smf_cursor_t *cursor, const smf_event_t *event) WARN_UNUSED_RESULT;
+int smf_cursor_seek_to_seconds(smf_cursor_t *cursor, double seconds) WARN_UNUSED_RESULT;
+int smf_cursor_seek_to_pulses(smf_cursor_t *cursor, int pulses) WARN_UNUSED_RESULT;
+
+/* Routines for real time playback. */
+smf_player_t *smf_player_new(smf_t *smf, int ring_length) WARN_UNUSED_RESULT;
+void smf_player_delete(smf_player_t *player);
+int smf_player_start(smf_player_t *player, double seconds) WARN_UNUSED_RESULT;
+void smf_player_stop(smf_player_t *player);
+int smf_player_drain(smf_player_t *player, void (*callback)(const smf_event_t *event, void *user_data), void *user_data);
+int smf_player_is_finished(const smf_player_t *player) WARN_UNUSED_RESULT;
+void smf_player_get_stats(const smf_player_t *player, smf_player_stats_t *stats);
 
 /* Routine for writing SMF files. */
 int smf_save(smf_t *smf, const char *file_name) WARN_UNUSED_RESULT;
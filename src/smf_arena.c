@@ -0,0 +1,243 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Arena allocator, used by smf_new_with_arena().
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/** Size of the regular slab.  Allocations bigger than a quarter of that get a slab of their own. */
+#define ARENA_SLAB_SIZE		65536
+
+/** Every allocation is aligned to that; enough for int64_t and double. */
+#define ARENA_ALIGNMENT		8
+
+#define ARENA_ROUND_UP(size)	(((size) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+struct smf_arena_slab_struct {
+	struct smf_arena_slab_struct	*next;
+};
+
+#define ARENA_SLAB_HEADER_SIZE	ARENA_ROUND_UP(sizeof(struct smf_arena_slab_struct))
+
+struct smf_arena_struct {
+	/** All the slabs, most recently allocated regular one first. */
+	struct smf_arena_slab_struct	*slabs;
+
+	/** Free part of the first slab. */
+	unsigned char			*next;
+	unsigned char			*end;
+
+	/** Lists of freed objects, linked through their first bytes. */
+	void				*free_events;
+	void				*free_tempos;
+};
+
+/**
+ * \internal
+ *
+ * Allocates an empty arena.
+ * \return Arena or NULL.
+ */
+struct smf_arena_struct *
+smf_arena_new(void)
+{
+	struct smf_arena_struct *arena;
+
+	arena = malloc(sizeof(struct smf_arena_struct));
+	if (arena == NULL) {
+		g_critical("Cannot allocate arena: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(arena, 0, sizeof(struct smf_arena_struct));
+
+	return (arena);
+}
+
+/**
+ * \internal
+ *
+ * Frees the arena and everything ever allocated from it, all at once.
+ */
+void
+smf_arena_delete(struct smf_arena_struct *arena)
+{
+	struct smf_arena_slab_struct *slab, *next_slab;
+
+	for (slab = arena->slabs; slab != NULL; slab = next_slab) {
+		next_slab = slab->next;
+		free(slab);
+	}
+
+	free(arena);
+}
+
+/**
+ * \internal
+ *
+ * Allocates "size" bytes from the arena.  There is no way to free them separately;
+ * they are released by smf_arena_delete().
+ * \return Pointer to the memory or NULL.
+ */
+void *
+smf_arena_alloc(struct smf_arena_struct *arena, int size)
+{
+	void *ptr;
+	struct smf_arena_slab_struct *slab;
+
+	assert(size > 0);
+
+	size = ARENA_ROUND_UP(size);
+
+	if (size <= arena->end - arena->next) {
+		ptr = arena->next;
+		arena->next += size;
+
+		return (ptr);
+	}
+
+	/* Big allocation; give it a slab of its own and keep using the current one. */
+	if (size > ARENA_SLAB_SIZE / 4) {
+		slab = malloc(ARENA_SLAB_HEADER_SIZE + size);
+		if (slab == NULL) {
+			g_critical("Cannot allocate arena slab: %s", strerror(errno));
+			return (NULL);
+		}
+
+		if (arena->slabs != NULL) {
+			slab->next = arena->slabs->next;
+			arena->slabs->next = slab;
+		} else {
+			slab->next = NULL;
+			arena->slabs = slab;
+		}
+
+		return ((unsigned char *)slab + ARENA_SLAB_HEADER_SIZE);
+	}
+
+	/* Whatever is left in the current slab is wasted. */
+	slab = malloc(ARENA_SLAB_HEADER_SIZE + ARENA_SLAB_SIZE);
+	if (slab == NULL) {
+		g_critical("Cannot allocate arena slab: %s", strerror(errno));
+		return (NULL);
+	}
+
+	slab->next = arena->slabs;
+	arena->slabs = slab;
+
+	arena->next = (unsigned char *)slab + ARENA_SLAB_HEADER_SIZE;
+	arena->end = arena->next + ARENA_SLAB_SIZE;
+
+	ptr = arena->next;
+	arena->next += size;
+
+	return (ptr);
+}
+
+/**
+ * Takes an object off the free list, or allocates new one, if the list is empty.
+ */
+static void *
+alloc_object(struct smf_arena_struct *arena, void **free_list, int size)
+{
+	void *object;
+
+	assert(size >= (int)sizeof(void *));
+
+	if (*free_list == NULL)
+		return (smf_arena_alloc(arena, size));
+
+	object = *free_list;
+	memcpy(free_list, object, sizeof(void *));
+
+	return (object);
+}
+
+/**
+ * Puts an object on the free list.
+ */
+static void
+free_object(void **free_list, void *object)
+{
+	memcpy(object, free_list, sizeof(void *));
+	*free_list = object;
+}
+
+/**
+ * \internal
+ *
+ * Allocates uninitialized smf_event_t, reusing one freed by smf_arena_free_event(), if possible.
+ */
+smf_event_t *
+smf_arena_alloc_event(struct smf_arena_struct *arena)
+{
+	return (alloc_object(arena, &arena->free_events, sizeof(smf_event_t)));
+}
+
+/**
+ * \internal
+ *
+ * Returns the event to the arena, for reuse by smf_arena_alloc_event().
+ */
+void
+smf_arena_free_event(struct smf_arena_struct *arena, smf_event_t *event)
+{
+	free_object(&arena->free_events, event);
+}
+
+/**
+ * \internal
+ *
+ * Allocates uninitialized smf_tempo_t, reusing one freed by smf_arena_free_tempo(), if possible.
+ */
+smf_tempo_t *
+smf_arena_alloc_tempo(struct smf_arena_struct *arena)
+{
+	return (alloc_object(arena, &arena->free_tempos, sizeof(smf_tempo_t)));
+}
+
+/**
+ * \internal
+ *
+ * Returns the tempo to the arena, for reuse by smf_arena_alloc_tempo().
+ */
+void
+smf_arena_free_tempo(struct smf_arena_struct *arena, smf_tempo_t *tempo)
+{
+	free_object(&arena->free_tempos, tempo);
+}
+
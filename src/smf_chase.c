@@ -0,0 +1,549 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Restoring channel state (programs, controllers, pitch bend) when seeking.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/* Controllers that need special treatment. */
+#define BANK_SELECT_MSB		0x00
+#define DATA_ENTRY_MSB		0x06
+#define BANK_SELECT_LSB		0x20
+#define DATA_ENTRY_LSB		0x26
+#define DATA_INCREMENT		0x60
+#define DATA_DECREMENT		0x61
+#define NRPN_LSB		0x62
+#define NRPN_MSB		0x63
+#define RPN_LSB			0x64
+#define RPN_MSB			0x65
+#define RESET_ALL_CONTROLLERS	0x79
+#define FIRST_CHANNEL_MODE_MESSAGE	0x78
+
+/** State of all the channels after the first "entry" events of the timeline. */
+struct smf_chase_checkpoint_struct {
+	int			entry;
+	smf_channel_state_t	channels[16];
+};
+
+static void
+reset_channels(smf_channel_state_t *channels)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		memset(channels + i, 0, sizeof(smf_channel_state_t));
+		memset(channels[i].controllers, SMF_CHASE_UNSET, sizeof(channels[i].controllers));
+		channels[i].program = -1;
+		channels[i].channel_pressure = -1;
+		channels[i].pitch_bend = -1;
+	}
+}
+
+/**
+ * Handles Data Entry: stores the value of parameter that is currently selected.
+ */
+static void
+set_parameter(smf_channel_state_t *channel, int lsb, unsigned char value)
+{
+	int i;
+	unsigned char type = channel->selected_parameter_type, number_msb, number_lsb;
+	smf_parameter_state_t *parameter;
+
+	if (type == 0)
+		return;
+
+	number_msb = channel->controllers[type];
+	number_lsb = channel->controllers[type - 1];
+
+	/* Parameter number not sent, or RPN Null. */
+	if (number_msb == SMF_CHASE_UNSET || number_lsb == SMF_CHASE_UNSET || (number_msb == 0x7F && number_lsb == 0x7F))
+		return;
+
+	for (i = 0; i < channel->number_of_parameters; i++) {
+		parameter = channel->parameters + i;
+
+		if (parameter->type == type && parameter->number_msb == number_msb && parameter->number_lsb == number_lsb)
+			break;
+	}
+
+	if (i == channel->number_of_parameters) {
+		if (channel->number_of_parameters == SMF_CHASE_MAX_PARAMETERS) {
+			memmove(channel->parameters, channel->parameters + 1,
+				(SMF_CHASE_MAX_PARAMETERS - 1) * sizeof(smf_parameter_state_t));
+			channel->number_of_parameters--;
+			i--;
+		}
+
+		parameter = channel->parameters + i;
+		parameter->type = type;
+		parameter->number_msb = number_msb;
+		parameter->number_lsb = number_lsb;
+		parameter->value_msb = 0;
+		parameter->value_lsb = SMF_CHASE_UNSET;
+		channel->number_of_parameters++;
+	}
+
+	parameter = channel->parameters + i;
+
+	if (lsb)
+		parameter->value_lsb = value;
+	else
+		parameter->value_msb = value;
+}
+
+/**
+ * Handles Control Change.
+ */
+static void
+set_controller(smf_channel_state_t *channel, unsigned char controller, unsigned char value)
+{
+	switch (controller) {
+		case DATA_ENTRY_MSB:
+			set_parameter(channel, 0, value);
+			return;
+
+		case DATA_ENTRY_LSB:
+			set_parameter(channel, 1, value);
+			return;
+
+		case DATA_INCREMENT:
+		case DATA_DECREMENT:
+			/* Meaning depends on the parameter; not chased. */
+			return;
+
+		case NRPN_MSB:
+		case NRPN_LSB:
+			channel->selected_parameter_type = NRPN_MSB;
+			break;
+
+		case RPN_MSB:
+		case RPN_LSB:
+			channel->selected_parameter_type = RPN_MSB;
+			break;
+
+		case RESET_ALL_CONTROLLERS:
+			/* Values as given in MMA Recommended Practice RP-015. */
+			channel->pitch_bend = 8192;
+			channel->channel_pressure = 0;
+			channel->controllers[0x01] = 0;
+			channel->controllers[0x0B] = 127;
+			channel->controllers[0x40] = 0;
+			channel->controllers[0x41] = 0;
+			channel->controllers[0x42] = 0;
+			channel->controllers[0x43] = 0;
+			channel->controllers[NRPN_LSB] = 127;
+			channel->controllers[NRPN_MSB] = 127;
+			channel->controllers[RPN_LSB] = 127;
+			channel->controllers[RPN_MSB] = 127;
+			channel->selected_parameter_type = 0;
+			return;
+
+		default:
+			/* All Sound Off, All Notes Off, mode changes etc. do not change state worth restoring. */
+			if (controller >= FIRST_CHANNEL_MODE_MESSAGE)
+				return;
+	}
+
+	channel->controllers[controller] = value;
+}
+
+/**
+ * Updates channel state according to the event.
+ */
+static void
+apply_event(smf_channel_state_t *channels, const smf_event_t *event)
+{
+	smf_channel_state_t *channel;
+	const unsigned char *buffer = event->midi_buffer;
+
+	if (event->midi_buffer_length < 2 || buffer[0] < 0xB0 || buffer[0] >= 0xF0)
+		return;
+
+	channel = channels + (buffer[0] & 0x0F);
+
+	switch (buffer[0] & 0xF0) {
+		case 0xB0:
+			if (event->midi_buffer_length >= 3)
+				set_controller(channel, buffer[1], buffer[2]);
+			break;
+
+		case 0xC0:
+			channel->program = buffer[1];
+			break;
+
+		case 0xD0:
+			channel->channel_pressure = buffer[1];
+			break;
+
+		case 0xE0:
+			if (event->midi_buffer_length >= 3)
+				channel->pitch_bend = buffer[1] | (buffer[2] << 7);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**
+ * Walks the whole song, remembering the state of the channels every checkpoint_interval seconds.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+make_checkpoints(smf_chase_t *chase, const smf_timeline_t *timeline)
+{
+	int i, allocated;
+	int64_t next_checkpoint = 0, interval;
+	smf_channel_state_t channels[16];
+	struct smf_chase_checkpoint_struct *checkpoints;
+
+	interval = (int64_t)(chase->checkpoint_interval * 1000000.0);
+	if (interval < 1)
+		interval = 1;
+
+	chase->number_of_checkpoints = 0;
+	reset_channels(channels);
+
+	for (i = 0; i <= timeline->number_of_entries; i++) {
+		/* First checkpoint is at the very start, before any event. */
+		if (i == 0 || (i < timeline->number_of_entries && timeline->entries[i].time_microseconds >= next_checkpoint)) {
+			if (chase->number_of_checkpoints == chase->allocated_checkpoints) {
+				allocated = chase->allocated_checkpoints > 0 ? chase->allocated_checkpoints * 2 : 16;
+
+				checkpoints = realloc(chase->checkpoints, allocated * sizeof(struct smf_chase_checkpoint_struct));
+				if (checkpoints == NULL) {
+					g_critical("Cannot allocate memory for chase checkpoints: %s", strerror(errno));
+					return (-1);
+				}
+
+				chase->checkpoints = checkpoints;
+				chase->allocated_checkpoints = allocated;
+			}
+
+			chase->checkpoints[chase->number_of_checkpoints].entry = i;
+			memcpy(chase->checkpoints[chase->number_of_checkpoints].channels, channels, sizeof(channels));
+			chase->number_of_checkpoints++;
+
+			if (i < timeline->number_of_entries)
+				next_checkpoint = (timeline->entries[i].time_microseconds / interval + 1) * interval;
+		}
+
+		if (i < timeline->number_of_entries)
+			apply_event(channels, timeline->entries[i].event);
+	}
+
+	chase->generation = timeline->generation;
+
+	return (0);
+}
+
+/**
+ * Makes chase->channels the state after the first "number_of_entries" events of the timeline,
+ * starting from the last checkpoint before that.
+ */
+static void
+chase_to_entry(smf_chase_t *chase, const smf_timeline_t *timeline, int number_of_entries)
+{
+	int i, low = 0, high = chase->number_of_checkpoints - 1, middle;
+
+	assert(chase->number_of_checkpoints > 0);
+	assert(chase->checkpoints[0].entry == 0);
+
+	/* Find the last checkpoint that is not after the entry. */
+	while (low < high) {
+		middle = low + (high - low + 1) / 2;
+
+		if (chase->checkpoints[middle].entry <= number_of_entries)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	memcpy(chase->channels, chase->checkpoints[low].channels, sizeof(chase->channels));
+
+	for (i = chase->checkpoints[low].entry; i < number_of_entries; i++)
+		apply_event(chase->channels, timeline->entries[i].event);
+}
+
+/**
+ * Gets timeline of the smf, making the checkpoints again, if the smf has changed since they were made.
+ * \return Timeline or NULL, if there was an error.
+ */
+static const smf_timeline_t *
+get_timeline(smf_chase_t *chase)
+{
+	const smf_timeline_t *timeline;
+
+	timeline = smf_build_timeline(chase->smf);
+	if (timeline == NULL)
+		return (NULL);
+
+	if (chase->number_of_checkpoints == 0 || chase->generation != timeline->generation) {
+		if (make_checkpoints(chase, timeline)) {
+			chase->number_of_checkpoints = 0;
+			return (NULL);
+		}
+	}
+
+	return (timeline);
+}
+
+/**
+ * Creates chaser for the smf.  It walks the whole song, remembering state of all the channels every
+ * "checkpoint_interval" seconds.  Seeking using smf_chase_seek_to_seconds() or smf_chase_seek_to_pulses()
+ * then only needs to go through the events since the nearest checkpoint to find the state of the channels.
+ * Shorter interval means faster seeking and more memory; a few seconds is a good choice.  If the smf
+ * is changed, checkpoints are made again during the next seek.
+ *
+ * \return Chaser or NULL, if there was an error.
+ */
+smf_chase_t *
+smf_chase_new(smf_t *smf, double checkpoint_interval)
+{
+	smf_chase_t *chase;
+
+	if (checkpoint_interval <= 0.0) {
+		g_critical("smf_chase_new: checkpoint interval must be positive.");
+		return (NULL);
+	}
+
+	chase = malloc(sizeof(smf_chase_t));
+	if (chase == NULL) {
+		g_critical("Cannot allocate smf_chase_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(chase, 0, sizeof(smf_chase_t));
+	chase->smf = smf;
+	chase->checkpoint_interval = checkpoint_interval;
+	reset_channels(chase->channels);
+
+	if (get_timeline(chase) == NULL) {
+		smf_chase_delete(chase);
+		return (NULL);
+	}
+
+	return (chase);
+}
+
+/**
+ * Frees the chaser.  Does not touch the smf.
+ */
+void
+smf_chase_delete(smf_chase_t *chase)
+{
+	free(chase->checkpoints);
+	memset(chase, 0, sizeof(smf_chase_t));
+	free(chase);
+}
+
+/**
+ * Seeks the smf, just like smf_seek_to_seconds(), and sets chase->channels to the state of the channels
+ * after all the events that happen before "seconds".
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_chase_seek_to_seconds(smf_chase_t *chase, double seconds)
+{
+	int low, high, middle;
+	const smf_timeline_t *timeline;
+
+	timeline = get_timeline(chase);
+	if (timeline == NULL)
+		return (-1);
+
+	if (smf_seek_to_seconds(chase->smf, seconds))
+		return (-2);
+
+	/* Events before the position, i.e. the ones that happen before "seconds", are at the start of the timeline. */
+	low = 0;
+	high = timeline->number_of_entries;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (timeline->entries[middle].event->time_seconds < seconds)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	chase_to_entry(chase, timeline, low);
+
+	return (0);
+}
+
+/**
+ * Seeks the smf, just like smf_seek_to_pulses(), and sets chase->channels to the state of the channels
+ * after all the events that happen before "pulses".
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_chase_seek_to_pulses(smf_chase_t *chase, int pulses)
+{
+	int low, high, middle;
+	const smf_timeline_t *timeline;
+
+	timeline = get_timeline(chase);
+	if (timeline == NULL)
+		return (-1);
+
+	if (smf_seek_to_pulses(chase->smf, pulses))
+		return (-2);
+
+	low = 0;
+	high = timeline->number_of_entries;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (timeline->entries[middle].time_pulses < pulses)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	chase_to_entry(chase, timeline, low);
+
+	return (0);
+}
+
+static unsigned char *
+put_message(unsigned char *p, unsigned char status, unsigned char first, unsigned char second, int length)
+{
+	*p++ = status;
+	*p++ = first;
+	if (length == 3)
+		*p++ = second;
+
+	return (p);
+}
+
+/**
+ * Stores Control Change message for the controller, if it was set.
+ */
+static unsigned char *
+put_controller(unsigned char *p, int channel_number, const smf_channel_state_t *channel, unsigned char controller)
+{
+	if (channel->controllers[controller] == SMF_CHASE_UNSET)
+		return (p);
+
+	return (put_message(p, 0xB0 | channel_number, controller, channel->controllers[controller], 3));
+}
+
+/**
+ * Stores parameter selection for RPN, if "type" is RPN_MSB, or for NRPN.
+ */
+static unsigned char *
+put_parameter_selection(unsigned char *p, int channel_number, const smf_channel_state_t *channel, unsigned char type)
+{
+	p = put_controller(p, channel_number, channel, type);
+
+	return (put_controller(p, channel_number, channel, type - 1));
+}
+
+/**
+ * Converts state of the channels, as found by the last smf_chase_seek_to_seconds() or smf_chase_seek_to_pulses(),
+ * into MIDI messages that restore it.  These are Control Change, Program Change, Channel Pressure and Pitch Bend
+ * messages, without running status, one after another; for every channel, Bank Select goes before Program Change,
+ * parameters are set using RPN or NRPN and Data Entry, and the parameter that was selected last is selected again
+ * at the end.  Only the things that were set by the earlier events are included.  Notes are not.
+ *
+ * \return Length of the messages or -1 if the buffer is too short.  SMF_CHASE_MAX_MESSAGES_LENGTH is always enough.
+ */
+int
+smf_chase_get_messages(const smf_chase_t *chase, unsigned char *buffer, int buffer_length)
+{
+	int i, j;
+	unsigned char messages[SMF_CHASE_MAX_MESSAGES_LENGTH], *p = messages, controller;
+	const smf_channel_state_t *channel;
+	const smf_parameter_state_t *parameter;
+
+	for (i = 0; i < 16; i++) {
+		channel = chase->channels + i;
+
+		p = put_controller(p, i, channel, BANK_SELECT_MSB);
+		p = put_controller(p, i, channel, BANK_SELECT_LSB);
+
+		if (channel->program != -1)
+			p = put_message(p, 0xC0 | i, channel->program, 0, 2);
+
+		for (j = 0; j < FIRST_CHANNEL_MODE_MESSAGE; j++) {
+			controller = j;
+
+			if (controller == BANK_SELECT_MSB || controller == BANK_SELECT_LSB ||
+			    (controller >= NRPN_LSB && controller <= RPN_MSB))
+				continue;
+
+			p = put_controller(p, i, channel, controller);
+		}
+
+		for (j = 0; j < channel->number_of_parameters; j++) {
+			parameter = channel->parameters + j;
+
+			p = put_message(p, 0xB0 | i, parameter->type, parameter->number_msb, 3);
+			p = put_message(p, 0xB0 | i, parameter->type - 1, parameter->number_lsb, 3);
+			p = put_message(p, 0xB0 | i, DATA_ENTRY_MSB, parameter->value_msb, 3);
+			if (parameter->value_lsb != SMF_CHASE_UNSET)
+				p = put_message(p, 0xB0 | i, DATA_ENTRY_LSB, parameter->value_lsb, 3);
+		}
+
+		/* Selection that was made last goes last. */
+		if (channel->selected_parameter_type == RPN_MSB) {
+			p = put_parameter_selection(p, i, channel, NRPN_MSB);
+			p = put_parameter_selection(p, i, channel, RPN_MSB);
+		} else {
+			p = put_parameter_selection(p, i, channel, RPN_MSB);
+			p = put_parameter_selection(p, i, channel, NRPN_MSB);
+		}
+
+		if (channel->channel_pressure != -1)
+			p = put_message(p, 0xD0 | i, channel->channel_pressure, 0, 2);
+
+		if (channel->pitch_bend != -1)
+			p = put_message(p, 0xE0 | i, channel->pitch_bend & 0x7F, channel->pitch_bend >> 7, 3);
+	}
+
+	assert(p - messages <= SMF_CHASE_MAX_MESSAGES_LENGTH);
+
+	if (p - messages > buffer_length)
+		return (-1);
+
+	memcpy(buffer, messages, p - messages);
+
+	return (p - messages);
+}
@@ -0,0 +1,252 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Columnar ("struct of arrays") copy of a track, for fast scanning.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/**
+ * \return Nonzero if the event is a valid message of at most three bytes, not counting SysEx
+ * and metaevents, i.e. if it can be represented by status, data1 and data2 alone.
+ */
+static int
+event_is_short(const smf_event_t *event)
+{
+	unsigned char status;
+
+	if (event->midi_buffer_length < 1 || event->midi_buffer_length > 3)
+		return (0);
+
+	status = event->midi_buffer[0];
+
+	if (!is_status_byte(status))
+		return (0);
+
+	/* Undefined System Common and System Realtime messages; expected_message_length() would complain. */
+	if (status == 0xF0 || status == 0xF4 || status == 0xF5 || status == 0xF7 || status == 0xFD || status == 0xFF)
+		return (0);
+
+	return (event->midi_buffer_length == expected_message_length(status, NULL, 0));
+}
+
+/**
+ * Frees the columns.
+ */
+void
+smf_track_columns_delete(smf_track_columns_t *columns)
+{
+	free(columns->time_pulses);
+	free(columns->time_seconds);
+	free(columns->status);
+	free(columns->data1);
+	free(columns->data2);
+	free(columns->long_events);
+	free(columns->long_event_offsets);
+	free(columns->long_event_data);
+
+	memset(columns, 0, sizeof(smf_track_columns_t));
+	free(columns);
+}
+
+/**
+ * Makes a copy of the events in the track, stored column by column: times and status bytes
+ * of all the events are in contiguous arrays, so scanning them does not have to follow pointers
+ * to every event and then to its MIDI buffer.  For example, to find all the Note On events
+ * on channel 10, use smf_track_columns_select(columns, 0xFF, 0x99, indices).
+ *
+ * Events are indexed from zero; event number i in the track is at index i - 1.  Messages
+ * up to three bytes long are stored only in status, data1 and data2 columns; missing data bytes
+ * are zero.  Longer messages, SysEx and metaevents are also copied, complete, into long_event_data;
+ * their data1 and data2 columns still contain the second and third byte, e.g. type of metaevent.
+ *
+ * This is a snapshot; later changes to the track are not reflected in it.
+ *
+ * \return Columns or NULL, if allocation failed.  Free them using smf_track_columns_delete().
+ */
+smf_track_columns_t *
+smf_track_columns_new(const smf_track_t *track)
+{
+	int i, n, number_of_long_events = 0, long_event_data_length = 0;
+	smf_event_t *event;
+	smf_track_columns_t *columns;
+
+	columns = malloc(sizeof(smf_track_columns_t));
+	if (columns == NULL) {
+		g_critical("Cannot allocate smf_track_columns_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(columns, 0, sizeof(smf_track_columns_t));
+
+	n = track->number_of_events;
+
+	/* First pass: find out how much space is needed for long messages. */
+	for (i = 0; i < n; i++) {
+		event = g_ptr_array_index(track->events_array, i);
+
+		if (event_is_short(event))
+			continue;
+
+		number_of_long_events++;
+		long_event_data_length += event->midi_buffer_length;
+	}
+
+	columns->track_number = track->track_number;
+	columns->number_of_events = n;
+	columns->number_of_long_events = number_of_long_events;
+
+	/* Allocate at least one element, so that NULL always means failure. */
+	columns->time_pulses = malloc((n + 1) * sizeof(int));
+	columns->time_seconds = malloc((n + 1) * sizeof(double));
+	columns->status = malloc(n + 1);
+	columns->data1 = malloc(n + 1);
+	columns->data2 = malloc(n + 1);
+	columns->long_events = malloc((number_of_long_events + 1) * sizeof(int));
+	columns->long_event_offsets = malloc((number_of_long_events + 1) * sizeof(int));
+	columns->long_event_data = malloc(long_event_data_length + 1);
+
+	if (columns->time_pulses == NULL || columns->time_seconds == NULL || columns->status == NULL ||
+	    columns->data1 == NULL || columns->data2 == NULL || columns->long_events == NULL ||
+	    columns->long_event_offsets == NULL || columns->long_event_data == NULL) {
+		g_critical("Cannot allocate memory for track columns: %s", strerror(errno));
+		smf_track_columns_delete(columns);
+		return (NULL);
+	}
+
+	/* Second pass: fill the columns. */
+	number_of_long_events = 0;
+	long_event_data_length = 0;
+
+	for (i = 0; i < n; i++) {
+		event = g_ptr_array_index(track->events_array, i);
+
+		columns->time_pulses[i] = event->time_pulses;
+		columns->time_seconds[i] = event->time_seconds;
+		columns->status[i] = event->midi_buffer_length > 0 ? event->midi_buffer[0] : 0;
+		columns->data1[i] = event->midi_buffer_length > 1 ? event->midi_buffer[1] : 0;
+		columns->data2[i] = event->midi_buffer_length > 2 ? event->midi_buffer[2] : 0;
+
+		if (event_is_short(event))
+			continue;
+
+		columns->long_events[number_of_long_events] = i;
+		columns->long_event_offsets[number_of_long_events] = long_event_data_length;
+		memcpy(columns->long_event_data + long_event_data_length, event->midi_buffer, event->midi_buffer_length);
+
+		number_of_long_events++;
+		long_event_data_length += event->midi_buffer_length;
+	}
+
+	columns->long_event_offsets[number_of_long_events] = long_event_data_length;
+
+	return (columns);
+}
+
+/**
+ * Finds indices of all the events whose status byte, ANDed with "status_mask", equals "status".
+ * For example, mask 0xF0 and status 0x90 selects Note On events on all the channels.
+ * "indices" must have room for columns->number_of_events elements.
+ *
+ * \return Number of indices stored.
+ */
+int
+smf_track_columns_select(const smf_track_columns_t *columns, unsigned char status_mask, unsigned char status, int *indices)
+{
+	int i, number_of_selected = 0;
+
+	/* No branches in the loop body; compilers can vectorize this. */
+	for (i = 0; i < columns->number_of_events; i++) {
+		indices[number_of_selected] = i;
+		number_of_selected += ((columns->status[i] & status_mask) == status);
+	}
+
+	return (number_of_selected);
+}
+
+/**
+ * Fills "view" with the event at "index", without creating smf_event_t.  The view points
+ * into "columns" and "view" itself, so it is valid as long as both of them are.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_track_columns_get_event_view(const smf_track_columns_t *columns, int index, smf_event_view_t *view)
+{
+	int low, high, middle, length;
+
+	if (index < 0 || index >= columns->number_of_events) {
+		g_critical("smf_track_columns_get_event_view: invalid index %d, there are %d events.",
+			index, columns->number_of_events);
+		return (-1);
+	}
+
+	view->track_number = columns->track_number;
+	view->event_number = index + 1;
+	view->time_pulses = columns->time_pulses[index];
+	view->delta_time_pulses = columns->time_pulses[index] - (index > 0 ? columns->time_pulses[index - 1] : 0);
+	view->status = columns->status[index];
+
+	/* Long events are listed in ascending order, so binary search finds out whether this is one of them. */
+	low = 0;
+	high = columns->number_of_long_events;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (columns->long_events[middle] < index)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low < columns->number_of_long_events && columns->long_events[low] == index) {
+		length = columns->long_event_offsets[low + 1] - columns->long_event_offsets[low];
+		view->data = columns->long_event_data + columns->long_event_offsets[low] + 1;
+		view->data_length = length > 0 ? length - 1 : 0;
+
+		return (0);
+	}
+
+	/* Data bytes of short messages are not contiguous in the columns. */
+	view->short_data[0] = columns->data1[index];
+	view->short_data[1] = columns->data2[index];
+	view->data = view->short_data;
+	view->data_length = expected_message_length(view->status, NULL, 0) - 1;
+
+	return (0);
+}
+
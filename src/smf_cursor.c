@@ -0,0 +1,364 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Cursors: positions in the song kept outside of it, so that many readers can go through it at once.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/** Position of the cursor in a single track; same meaning as the fields of smf_track_t. */
+struct smf_cursor_track_struct {
+	smf_track_t	*track;
+	/** -1 if there are no more events in the track. */
+	int		next_event_number;
+	int		time_of_next_event;
+};
+
+typedef struct smf_cursor_track_struct smf_cursor_track_t;
+
+/**
+ * Puts the tracks that have events left into the heap, ordered by time of their next event.
+ */
+static void
+build_heap(smf_cursor_t *cursor)
+{
+	int i;
+	smf_heap_entry_t *entry;
+
+	cursor->heap_length = 0;
+
+	for (i = 0; i < cursor->number_of_tracks; i++) {
+		if (cursor->tracks[i].next_event_number == -1)
+			continue;
+
+		entry = cursor->heap + cursor->heap_length++;
+		entry->time_of_next_event = cursor->tracks[i].time_of_next_event;
+		entry->track_number = i + 1;
+		entry->position = cursor->tracks + i;
+	}
+
+	smf_heap_build(cursor->heap, cursor->heap_length);
+}
+
+static smf_event_t *
+get_event(const smf_cursor_track_t *track, int event_number)
+{
+	return ((smf_event_t *)track->track->events_array->pdata[event_number - 1]);
+}
+
+/**
+ * Makes event number "event_number" the next one returned from the track, or, if there is
+ * no such event, moves the track to its end.
+ */
+static void
+set_next_event_number(smf_cursor_track_t *track, int event_number)
+{
+	smf_track_set_position(track->track, event_number, &track->next_event_number, &track->time_of_next_event);
+}
+
+/**
+ * Looks up the tracks again, if the song was changed since the cursor was positioned.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+update_tracks(smf_cursor_t *cursor)
+{
+	int i;
+	smf_t *smf = cursor->smf;
+	smf_cursor_track_t *tracks;
+	smf_heap_entry_t *heap;
+
+	if (cursor->tracks != NULL && cursor->generation == smf->generation)
+		return (0);
+
+	if (cursor->tracks == NULL || cursor->number_of_tracks != smf->number_of_tracks) {
+		tracks = malloc((smf->number_of_tracks + 1) * sizeof(smf_cursor_track_t));
+		heap = malloc((smf->number_of_tracks + 1) * sizeof(smf_heap_entry_t));
+		if (tracks == NULL || heap == NULL) {
+			g_critical("Cannot allocate memory for cursor: %s", strerror(errno));
+			free(tracks);
+			free(heap);
+			return (-1);
+		}
+
+		free(cursor->tracks);
+		free(cursor->heap);
+		cursor->tracks = tracks;
+		cursor->heap = heap;
+		cursor->number_of_tracks = smf->number_of_tracks;
+	}
+
+	/*
+	 * Not smf_get_track_by_number(); this may run in several threads at once.  Lazily loaded
+	 * tracks were already parsed by smf_cursor_new().
+	 */
+	for (i = 0; i < cursor->number_of_tracks; i++) {
+		cursor->tracks[i].track = smf_peek_track_by_number(smf, i + 1);
+		assert(cursor->tracks[i].track);
+		assert(!cursor->tracks[i].track->parse_pending);
+	}
+
+	cursor->generation = smf->generation;
+
+	return (0);
+}
+
+/**
+ * Allocates new cursor, positioned at the beginning of the song.  Cursor has its own position,
+ * so it can be moved around using smf_cursor_get_next_event(), smf_cursor_seek_to_seconds() etc.
+ * without affecting smf_get_next_event() or other cursors.  None of the smf_cursor_* routines
+ * modify the song, so several cursors can be used at the same time from different threads,
+ * without locking, as long as the song itself does not change.
+ *
+ * For lazily loaded songs, this parses all the tracks, using smf_parse_all_tracks(), so call it
+ * before starting the threads.
+ * After the song was changed, cursor has to be rewound or seeked before it can be used again.
+ *
+ * \return Cursor or NULL, if there was an error.
+ */
+smf_cursor_t *
+smf_cursor_new(smf_t *smf)
+{
+	smf_cursor_t *cursor;
+
+	cursor = malloc(sizeof(smf_cursor_t));
+	if (cursor == NULL) {
+		g_critical("Cannot allocate smf_cursor_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(cursor, 0, sizeof(smf_cursor_t));
+	cursor->smf = smf;
+
+	smf_parse_all_tracks(smf);
+	smf_update_tempo_map_if_stale(smf);
+
+	if (update_tracks(cursor)) {
+		smf_cursor_delete(cursor);
+		return (NULL);
+	}
+
+	smf_cursor_rewind(cursor);
+
+	return (cursor);
+}
+
+/**
+ * Frees the cursor.  Does not touch the smf.
+ */
+void
+smf_cursor_delete(smf_cursor_t *cursor)
+{
+	free(cursor->tracks);
+	free(cursor->heap);
+	memset(cursor, 0, sizeof(smf_cursor_t));
+	free(cursor);
+}
+
+/**
+ * Rewinds the cursor.  After calling this routine, smf_cursor_get_next_event() will return
+ * the first event in the song.
+ */
+void
+smf_cursor_rewind(smf_cursor_t *cursor)
+{
+	int i;
+
+	if (update_tracks(cursor)) {
+		cursor->heap_length = 0;
+		return;
+	}
+
+	for (i = 0; i < cursor->number_of_tracks; i++)
+		set_next_event_number(cursor->tracks + i, 1);
+
+	build_heap(cursor);
+	cursor->last_seek_position = 0.0;
+}
+
+/**
+ * \return Nonzero, if the song was changed after the cursor was positioned, so that it cannot be used.
+ */
+static int
+cursor_is_stale(const smf_cursor_t *cursor)
+{
+	if (cursor->generation == cursor->smf->generation)
+		return (0);
+
+	g_critical("smf_cursor: the song was changed; rewind or seek the cursor before using it.");
+
+	return (1);
+}
+
+/**
+ * \return Next event, in time order, or NULL, if there are none left.  Events are returned
+ * in the same order as smf_get_next_event() would return them.
+ */
+smf_event_t *
+smf_cursor_get_next_event(smf_cursor_t *cursor)
+{
+	smf_event_t *event;
+	smf_cursor_track_t *track;
+
+	if (cursor_is_stale(cursor) || cursor->heap_length == 0)
+		return (NULL);
+
+	track = cursor->heap[0].position;
+	event = get_event(track, track->next_event_number);
+
+	set_next_event_number(track, track->next_event_number + 1);
+
+	cursor->heap_length = smf_heap_update_first(cursor->heap, cursor->heap_length, track->next_event_number,
+		track->time_of_next_event);
+
+	cursor->last_seek_position = -1.0;
+
+	return (event);
+}
+
+/**
+ * \return Next event, in time order, or NULL, if there are none left.  Does not move the cursor.
+ */
+smf_event_t *
+smf_cursor_peek_next_event(smf_cursor_t *cursor)
+{
+	smf_cursor_track_t *track;
+
+	if (cursor_is_stale(cursor) || cursor->heap_length == 0)
+		return (NULL);
+
+	track = cursor->heap[0].position;
+
+	return (get_event(track, track->next_event_number));
+}
+
+/**
+ * Seeks the cursor to the given event.  After calling this routine, smf_cursor_get_next_event()
+ * will return the event that was the second argument of this call.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_cursor_seek_to_event(smf_cursor_t *cursor, const smf_event_t *target)
+{
+	int i;
+	smf_cursor_track_t *track;
+
+	/* "target" has to be in this smf. */
+	assert(target->track != NULL);
+	assert(target->track->smf == cursor->smf);
+
+	if (update_tracks(cursor))
+		return (-1);
+
+	/* See smf_seek_to_event(). */
+	for (i = 0; i < cursor->number_of_tracks; i++) {
+		track = cursor->tracks + i;
+
+		if (track->track == target->track)
+			set_next_event_number(track, target->event_number);
+		else
+			set_next_event_number(track, smf_track_find_event_by_pulses(track->track, target->time_pulses,
+				track->track->track_number < target->track->track_number));
+	}
+
+	build_heap(cursor);
+	cursor->last_seek_position = target->time_seconds;
+
+	return (0);
+}
+
+/**
+ * Seeks the cursor to the given position, just like smf_seek_to_seconds() does with the song.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_cursor_seek_to_seconds(smf_cursor_t *cursor, double seconds)
+{
+	int i;
+
+	assert(seconds >= 0.0);
+
+	if (seconds == cursor->last_seek_position && cursor->generation == cursor->smf->generation)
+		return (0);
+
+	if (update_tracks(cursor))
+		return (-1);
+
+	for (i = 0; i < cursor->number_of_tracks; i++)
+		set_next_event_number(cursor->tracks + i, smf_track_find_event_by_seconds(cursor->tracks[i].track, seconds));
+
+	build_heap(cursor);
+
+	if (cursor->heap_length == 0) {
+		g_critical("Trying to seek past the end of song.");
+		cursor->last_seek_position = -1.0;
+		return (-2);
+	}
+
+	cursor->last_seek_position = seconds;
+
+	return (0);
+}
+
+/**
+ * Seeks the cursor to the given position, just like smf_seek_to_pulses() does with the song.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_cursor_seek_to_pulses(smf_cursor_t *cursor, int pulses)
+{
+	int i;
+
+	assert(pulses >= 0);
+
+	if (update_tracks(cursor))
+		return (-1);
+
+	for (i = 0; i < cursor->number_of_tracks; i++)
+		set_next_event_number(cursor->tracks + i, smf_track_find_event_by_pulses(cursor->tracks[i].track, pulses, 0));
+
+	build_heap(cursor);
+
+	if (cursor->heap_length == 0) {
+		g_critical("Trying to seek past the end of song.");
+		cursor->last_seek_position = -1.0;
+		return (-2);
+	}
+
+	cursor->last_seek_position = smf_cursor_peek_next_event(cursor)->time_seconds;
+
+	return (0);
+}
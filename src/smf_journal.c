@@ -0,0 +1,572 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Undo and redo.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/**
+ * Single recorded change.  Changes are identified by position (number of the track and of the event),
+ * not by pointers; undoing them in reverse order, or redoing them in the original order, always finds
+ * the smf in the same state as when they were recorded.
+ */
+struct smf_journal_entry_struct {
+	int		type;
+
+	/** Changes with the same step number are undone and redone together. */
+	int		step;
+
+	int		track_number;
+	int		event_number;
+
+	/** For event changes: the event, or, for SMF_JOURNAL_EVENT_CHANGED, the other version of its MIDI message. */
+	int		time_pulses;
+	int		midi_buffer_length;
+	/** Messages longer than SMF_EVENT_INLINE_BUFFER_LENGTH are allocated; NULL otherwise. */
+	unsigned char	*long_midi_buffer;
+	unsigned char	midi_buffer_inline[SMF_EVENT_INLINE_BUFFER_LENGTH];
+
+	/** For SMF_JOURNAL_TRACK_ADDED: format of the smf before the track was added. */
+	int		format;
+};
+
+struct smf_journal_struct {
+	struct smf_journal_entry_struct	*entries;
+	int				number_of_entries;
+	int				allocated;
+
+	/** Entries past this one were undone and can be redone. */
+	int				number_of_applied_entries;
+
+	int				last_step;
+	/** smf->edit_number of the edit the last step was recorded in, or -1 if it was not part of any edit. */
+	int				last_edit_number;
+
+	/** Nonzero while undoing or redoing; changes made then are not recorded. */
+	int				replaying;
+};
+
+static unsigned char *
+entry_midi_buffer(struct smf_journal_entry_struct *entry)
+{
+	if (entry->long_midi_buffer != NULL)
+		return (entry->long_midi_buffer);
+
+	return (entry->midi_buffer_inline);
+}
+
+/**
+ * Stores a copy of the MIDI message in the entry.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+entry_set_midi_buffer(struct smf_journal_entry_struct *entry, const unsigned char *midi_buffer, int len)
+{
+	unsigned char *long_midi_buffer = NULL;
+
+	if (len > SMF_EVENT_INLINE_BUFFER_LENGTH) {
+		long_midi_buffer = malloc(len);
+		if (long_midi_buffer == NULL) {
+			g_critical("Cannot allocate memory for undo: %s", strerror(errno));
+			return (-1);
+		}
+
+		memcpy(long_midi_buffer, midi_buffer, len);
+	} else {
+		memcpy(entry->midi_buffer_inline, midi_buffer, len);
+	}
+
+	free(entry->long_midi_buffer);
+	entry->long_midi_buffer = long_midi_buffer;
+	entry->midi_buffer_length = len;
+
+	return (0);
+}
+
+/**
+ * Frees entries starting with "first_entry".
+ */
+static void
+truncate_journal(struct smf_journal_struct *journal, int first_entry)
+{
+	int i;
+
+	for (i = first_entry; i < journal->number_of_entries; i++)
+		free(journal->entries[i].long_midi_buffer);
+
+	journal->number_of_entries = first_entry;
+
+	if (journal->number_of_applied_entries > first_entry)
+		journal->number_of_applied_entries = first_entry;
+}
+
+/**
+ * Forgets all the recorded changes.  Used when the journal cannot be kept consistent, e.g. when
+ * allocation fails; it is better to lose history than to undo something else than what was done.
+ */
+static void
+forget_journal(struct smf_journal_struct *journal)
+{
+	g_critical("Undo history lost.");
+
+	truncate_journal(journal, 0);
+}
+
+/**
+ * Appends new entry to the journal, dropping the changes that were undone, and assigns it to a step.
+ * \return Pointer to the entry or NULL.
+ */
+static struct smf_journal_entry_struct *
+new_entry(smf_t *smf, int type, int track_number, int event_number)
+{
+	int allocated;
+	struct smf_journal_struct *journal = smf->journal;
+	struct smf_journal_entry_struct *entry, *entries;
+
+	truncate_journal(journal, journal->number_of_applied_entries);
+
+	if (journal->number_of_entries == journal->allocated) {
+		allocated = journal->allocated > 0 ? journal->allocated * 2 : 64;
+
+		entries = realloc(journal->entries, allocated * sizeof(struct smf_journal_entry_struct));
+		if (entries == NULL) {
+			g_critical("Cannot allocate memory for undo: %s", strerror(errno));
+			forget_journal(journal);
+			return (NULL);
+		}
+
+		journal->entries = entries;
+		journal->allocated = allocated;
+	}
+
+	entry = journal->entries + journal->number_of_entries;
+	memset(entry, 0, sizeof(struct smf_journal_entry_struct));
+
+	entry->type = type;
+	entry->track_number = track_number;
+	entry->event_number = event_number;
+
+	/* Everything done between smf_begin_edit() and smf_commit_edit() makes one step. */
+	if (smf->edit_depth == 0 || journal->last_edit_number != smf->edit_number || journal->number_of_entries == 0) {
+		journal->last_step++;
+		journal->last_edit_number = smf->edit_depth > 0 ? smf->edit_number : -1;
+	}
+
+	entry->step = journal->last_step;
+
+	journal->number_of_entries++;
+	journal->number_of_applied_entries = journal->number_of_entries;
+
+	return (entry);
+}
+
+/**
+ * \internal
+ *
+ * Records addition, removal or change of the event that is, or was, number "event_number"
+ * in track number "track_number".  For removals and changes, this must be called before
+ * the event is modified.  Does nothing unless undo is enabled.
+ */
+void
+smf_journal_record_event(smf_t *smf, int type, int track_number, int event_number, const smf_event_t *event)
+{
+	struct smf_journal_entry_struct *entry;
+
+	if (smf->journal == NULL || smf->journal->replaying)
+		return;
+
+	entry = new_entry(smf, type, track_number, event_number);
+	if (entry == NULL)
+		return;
+
+	entry->time_pulses = event->time_pulses;
+
+	if (entry_set_midi_buffer(entry, event->midi_buffer, event->midi_buffer_length)) {
+		smf->journal->number_of_entries--;
+		forget_journal(smf->journal);
+	}
+}
+
+/**
+ * \internal
+ *
+ * Records addition or removal of the track that is, or was, number "track_number".
+ * Must be called before the change.  Does nothing unless undo is enabled.
+ */
+void
+smf_journal_record_track(smf_t *smf, int type, int track_number)
+{
+	struct smf_journal_entry_struct *entry;
+
+	if (smf->journal == NULL || smf->journal->replaying)
+		return;
+
+	entry = new_entry(smf, type, track_number, 0);
+	if (entry == NULL)
+		return;
+
+	entry->format = smf->format;
+}
+
+/**
+ * Creates event described by the entry and inserts it where it was.
+ */
+static int
+insert_event(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	smf_track_t *track;
+	smf_event_t *event;
+
+	track = smf_get_track_by_number(smf, entry->track_number);
+	assert(track);
+
+	event = smf_event_new_from_arena(smf->arena);
+	if (event == NULL)
+		return (-1);
+
+	if (smf_event_allocate_midi_buffer(event, entry->midi_buffer_length)) {
+		smf_event_delete(event);
+		return (-2);
+	}
+
+	memcpy(event->midi_buffer, entry_midi_buffer(entry), entry->midi_buffer_length);
+
+	event->time_pulses = entry->time_pulses;
+
+	/* Same as when the event was added originally; if the tempo map is stale, it gets recomputed at commit. */
+	smf_compute_seconds_of_events(smf, &event, 1);
+
+	smf_track_insert_event(track, event, entry->event_number);
+
+	return (0);
+}
+
+/**
+ * Removes and frees event described by the entry.
+ */
+static int
+delete_event(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	smf_track_t *track;
+	smf_event_t *event;
+
+	track = smf_get_track_by_number(smf, entry->track_number);
+	assert(track);
+
+	event = smf_track_get_event_by_number(track, entry->event_number);
+	assert(event);
+	assert(event->time_pulses == entry->time_pulses);
+
+	smf_event_delete(event);
+
+	return (0);
+}
+
+/**
+ * Exchanges MIDI message of the event with the one stored in the entry.
+ */
+static int
+swap_midi_buffer(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	smf_track_t *track;
+	smf_event_t *event;
+	struct smf_journal_entry_struct current;
+
+	track = smf_get_track_by_number(smf, entry->track_number);
+	assert(track);
+
+	event = smf_track_get_event_by_number(track, entry->event_number);
+	assert(event);
+
+	memset(&current, 0, sizeof(current));
+	if (entry_set_midi_buffer(&current, event->midi_buffer, event->midi_buffer_length))
+		return (-1);
+
+	if (smf_event_set_midi_buffer(event, entry_midi_buffer(entry), entry->midi_buffer_length)) {
+		free(current.long_midi_buffer);
+		return (-2);
+	}
+
+	free(entry->long_midi_buffer);
+	entry->long_midi_buffer = current.long_midi_buffer;
+	memcpy(entry->midi_buffer_inline, current.midi_buffer_inline, SMF_EVENT_INLINE_BUFFER_LENGTH);
+	entry->midi_buffer_length = current.midi_buffer_length;
+
+	return (0);
+}
+
+static int
+insert_track(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	smf_track_t *track;
+
+	track = smf_track_new();
+	if (track == NULL)
+		return (-1);
+
+	smf_insert_track(smf, track, entry->track_number);
+
+	return (0);
+}
+
+static int
+delete_track(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	smf_track_t *track;
+
+	track = smf_get_track_by_number(smf, entry->track_number);
+	assert(track);
+	assert(track->number_of_events == 0);
+
+	smf_track_delete(track);
+
+	return (0);
+}
+
+/**
+ * Undoes the change.
+ */
+static int
+revert_entry(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	int cantfail;
+
+	switch (entry->type) {
+		case SMF_JOURNAL_EVENT_ADDED:
+			return (delete_event(smf, entry));
+
+		case SMF_JOURNAL_EVENT_REMOVED:
+			return (insert_event(smf, entry));
+
+		case SMF_JOURNAL_EVENT_CHANGED:
+			return (swap_midi_buffer(smf, entry));
+
+		case SMF_JOURNAL_TRACK_ADDED:
+			cantfail = delete_track(smf, entry);
+			assert(!cantfail);
+
+			/* Adding a track might have changed the format. */
+			smf->format = entry->format;
+			return (0);
+
+		case SMF_JOURNAL_TRACK_REMOVED:
+			return (insert_track(smf, entry));
+
+		default:
+			assert(!"Unknown journal entry type.");
+			return (-1);
+	}
+}
+
+/**
+ * Does the change again.
+ */
+static int
+apply_entry(smf_t *smf, struct smf_journal_entry_struct *entry)
+{
+	switch (entry->type) {
+		case SMF_JOURNAL_EVENT_ADDED:
+			return (insert_event(smf, entry));
+
+		case SMF_JOURNAL_EVENT_REMOVED:
+			return (delete_event(smf, entry));
+
+		case SMF_JOURNAL_EVENT_CHANGED:
+			return (swap_midi_buffer(smf, entry));
+
+		case SMF_JOURNAL_TRACK_ADDED:
+			return (insert_track(smf, entry));
+
+		case SMF_JOURNAL_TRACK_REMOVED:
+			return (delete_track(smf, entry));
+
+		default:
+			assert(!"Unknown journal entry type.");
+			return (-1);
+	}
+}
+
+/**
+ * Starts recording changes made to the smf, so that they can be undone using smf_undo().
+ * Recorded are additions, removals and changes (using smf_event_set_midi_buffer()) of events,
+ * and additions and removals of tracks.  Memory used is proportional to the size of the changes,
+ * not of the song.  Every call, e.g. smf_track_add_event() or smf_track_remove_events_if(), is a separate
+ * undo step, unless it is made between smf_begin_edit() and smf_commit_edit(); then all the changes
+ * up to the outermost commit make one step.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_enable_undo(smf_t *smf)
+{
+	if (smf->journal != NULL)
+		return (0);
+
+	smf->journal = malloc(sizeof(struct smf_journal_struct));
+	if (smf->journal == NULL) {
+		g_critical("Cannot allocate memory for undo: %s", strerror(errno));
+		return (-1);
+	}
+
+	memset(smf->journal, 0, sizeof(struct smf_journal_struct));
+	smf->journal->last_edit_number = -1;
+
+	return (0);
+}
+
+/**
+ * Stops recording changes and forgets the ones recorded so far.
+ */
+void
+smf_disable_undo(smf_t *smf)
+{
+	if (smf->journal == NULL)
+		return;
+
+	truncate_journal(smf->journal, 0);
+	free(smf->journal->entries);
+	free(smf->journal);
+	smf->journal = NULL;
+}
+
+/**
+ * \return Nonzero if there is something to undo.
+ */
+int
+smf_can_undo(const smf_t *smf)
+{
+	return (smf->journal != NULL && smf->journal->number_of_applied_entries > 0);
+}
+
+/**
+ * \return Nonzero if there is something to redo.
+ */
+int
+smf_can_redo(const smf_t *smf)
+{
+	return (smf->journal != NULL && smf->journal->number_of_applied_entries < smf->journal->number_of_entries);
+}
+
+/**
+ * Undoes or redoes one step.  Tempo map is recomputed, if needed, only once.
+ */
+static int
+replay_step(smf_t *smf, int undo)
+{
+	int step, failed = 0;
+	struct smf_journal_struct *journal = smf->journal;
+	struct smf_journal_entry_struct *entry;
+
+	if (undo ? !smf_can_undo(smf) : !smf_can_redo(smf))
+		return (-1);
+
+	if (smf->edit_depth > 0) {
+		g_critical("Cannot undo or redo between smf_begin_edit() and smf_commit_edit().");
+		return (-2);
+	}
+
+	journal->replaying = 1;
+	smf_begin_edit(smf);
+
+	if (undo) {
+		step = journal->entries[journal->number_of_applied_entries - 1].step;
+
+		while (journal->number_of_applied_entries > 0) {
+			entry = journal->entries + journal->number_of_applied_entries - 1;
+			if (entry->step != step)
+				break;
+
+			if (revert_entry(smf, entry)) {
+				failed = 1;
+				break;
+			}
+
+			journal->number_of_applied_entries--;
+		}
+	} else {
+		step = journal->entries[journal->number_of_applied_entries].step;
+
+		while (journal->number_of_applied_entries < journal->number_of_entries) {
+			entry = journal->entries + journal->number_of_applied_entries;
+			if (entry->step != step)
+				break;
+
+			if (apply_entry(smf, entry)) {
+				failed = 1;
+				break;
+			}
+
+			journal->number_of_applied_entries++;
+		}
+	}
+
+	smf_commit_edit(smf);
+	journal->replaying = 0;
+
+	/* Step was replayed only partially; the rest of the history does not match the song anymore. */
+	if (failed) {
+		forget_journal(journal);
+		return (-3);
+	}
+
+	return (0);
+}
+
+/**
+ * Undoes the last step recorded since smf_enable_undo().  Note that events and tracks restored
+ * by undo or redo are new structures; pointers to the ones that were removed are not valid anymore.
+ * Cannot be called between smf_begin_edit() and smf_commit_edit().
+ *
+ * \return 0 if something was undone, nonzero otherwise.
+ */
+int
+smf_undo(smf_t *smf)
+{
+	return (replay_step(smf, 1));
+}
+
+/**
+ * Redoes the last step undone using smf_undo().  Making any other change forgets the undone steps.
+ *
+ * \return 0 if something was redone, nonzero otherwise.
+ */
+int
+smf_redo(smf_t *smf)
+{
+	return (replay_step(smf, 0));
+}
+
@@ -40,10 +40,18 @@
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #ifdef __MINGW32__
 #include <windows.h>
+#include <io.h>
 #else /* ! __MINGW32__ */
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
 #endif /* ! __MINGW32__ */
 #include "smf.h"
 #include "smf_private.h"
@@ -57,6 +65,7 @@ next_chunk(smf_t *smf)
 {
 	struct chunk_header_struct *chunk;
 	void *next_chunk_ptr;
+	size_t chunk_length, bytes_left;
 
 	assert(smf->file_buffer != NULL);
 	assert(smf->file_buffer_length > 0);
@@ -80,13 +89,17 @@ next_chunk(smf_t *smf)
 	 * XXX: On SPARC, after compiling with "-fast" option there will be SIGBUS here.
 	 * Please compile with -xmemalign=8i".
 	 */
-	smf->next_chunk_offset += sizeof(struct chunk_header_struct) + ntohl(chunk->length);
+	chunk_length = ntohl(chunk->length);
+	bytes_left = smf->file_buffer_length - smf->next_chunk_offset - sizeof(struct chunk_header_struct);
 
-	if (smf->next_chunk_offset > smf->file_buffer_length) {
+	/* Compared unsigned, so that lengths of 0x80000000 and more do not make offsets negative. */
+	if (chunk_length > bytes_left) {
 		g_critical("SMF warning: malformed chunk; truncated file?");
-		smf->next_chunk_offset = smf->file_buffer_length;
+		chunk_length = bytes_left;
 	}
 
+	smf->next_chunk_offset += sizeof(struct chunk_header_struct) + chunk_length;
+
 	return (chunk);
 }
 
@@ -211,14 +224,12 @@ parse_mthd_chunk(smf_t *smf)
  * Explanation of Variable Length Quantities is here: http://www.borg.com/~jglatt/tech/midifile/vari.htm
  * Returns 0 iff everything went OK, different value in case of error.
  */
-static int
+int
 extract_vlq(const unsigned char *buf, const int buffer_length, int *value, int *len)
 {
 	int val = 0;
 	const unsigned char *c = buf;
 
-	assert(buffer_length > 0);
-
 	for (;;) {
 		if (c >= buf + buffer_length) {
 			g_critical("End of buffer in extract_vlq().");
@@ -308,11 +319,13 @@ expected_escaped_length(const unsigned char status, const unsigned char *second_
 }
 
 /**
+ * \internal
+ *
  * Returns expected length of the midi message (including the status byte), in bytes, for the given status byte.
  * The "second_byte" points to the expected second byte of the MIDI message.  "buffer_length" is the buffer
  * length limit, counting from "second_byte".  Returns value < 0 iff there was an error.
  */
-static int
+int
 expected_message_length(unsigned char status, const unsigned char *second_byte, const int buffer_length)
 {
 	/* Make sure this really is a valid status byte. */
@@ -386,12 +399,14 @@ expected_message_length(unsigned char status, const unsigned char *second_byte,
 	}
 }
 
+/**
+ * Finds SysEx message pointed at by "buf", without copying it.  See locate_midi_event().
+ */
 static int
-extract_sysex_event(const unsigned char *buf, const int buffer_length, smf_event_t *event, int *len, int last_status)
+locate_sysex_event(const unsigned char *buf, const int buffer_length, const unsigned char **data, int *data_length, int *len)
 {
 	int status, message_length, vlq_length;
 	const unsigned char *c = buf;
-	(void) last_status;
 
 	status = *buf;
 
@@ -407,31 +422,26 @@ extract_sysex_event(const unsigned char *buf, const int buffer_length, smf_event
 	c += vlq_length;
 
 	if (vlq_length + message_length >= buffer_length) {
-		g_critical("End of buffer in extract_sysex_event().");
+		g_critical("End of buffer in locate_sysex_event().");
 		return (-5);
 	}
 
-	event->midi_buffer_length = message_length;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate memory in extract_sysex_event(): %s", strerror(errno));
-		return (-4);
-	}
-
-	event->midi_buffer[0] = status;
-	memcpy(event->midi_buffer + 1, c, message_length - 1);
-
+	*data = c;
+	*data_length = message_length - 1;
 	*len = vlq_length + message_length;
 
 	return (0);
 }
 
+/**
+ * Finds escaped message pointed at by "buf", without copying it.  See locate_midi_event().
+ */
 static int
-extract_escaped_event(const unsigned char *buf, const int buffer_length, smf_event_t *event, int *len, int last_status)
+locate_escaped_event(const unsigned char *buf, const int buffer_length, const unsigned char **data, int *data_length, int *len)
 {
 	int status, message_length, vlq_length;
 	const unsigned char *c = buf;
-	(void) last_status;
+	smf_event_t escaped;
 
 	status = *buf;
 
@@ -447,147 +457,190 @@ extract_escaped_event(const unsigned char *buf, const int buffer_length, smf_eve
 	c += vlq_length;
 
 	if (vlq_length + message_length >= buffer_length) {
-		g_critical("End of buffer in extract_escaped_event().");
+		g_critical("End of buffer in locate_escaped_event().");
 		return (-5);
 	}
 
-	event->midi_buffer_length = message_length;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate memory in extract_escaped_event(): %s", strerror(errno));
-		return (-4);
-	}
+	memset(&escaped, 0, sizeof(escaped));
+	escaped.midi_buffer = (unsigned char *)c;
+	escaped.midi_buffer_length = message_length;
 
-	memcpy(event->midi_buffer, c, message_length);
-
-	if (smf_event_is_valid(event)) {
+	if (smf_event_is_valid(&escaped)) {
 		g_critical("Escaped event is invalid.");
 		return (-1);
 	}
 
-	if (smf_event_is_system_realtime(event) || smf_event_is_system_common(event)) {
+	if (smf_event_is_system_realtime(&escaped) || smf_event_is_system_common(&escaped)) {
 		g_warning("Escaped event is not System Realtime nor System Common.");
 	}
 
+	*data = c;
+	*data_length = message_length;
 	*len = vlq_length + message_length;
 
 	return (0);
 }
 
-
 /**
- * Puts MIDI data extracted from from "buf" into "event" and number of consumed bytes into "len".
- * In case valid status is not found, it uses "last_status" (so called "running status").
+ * Finds MIDI message pointed at by "buf", without copying it anywhere.  Puts its status byte into
+ * "status" (in case valid status is not found, it uses "last_status", so called "running status"),
+ * pointer to the bytes following the status byte into "data", number of these bytes into "data_length"
+ * and number of consumed bytes into "len".  For SysEx, "data" points past the embedded length.  For escaped
+ * events (status 0xF7), "data" is the complete message.
  * Returns 0 iff everything went OK, value < 0 in case of error.
  */
 static int
-extract_midi_event(const unsigned char *buf, const int buffer_length, smf_event_t *event, int *len, int last_status)
+locate_midi_event(const unsigned char *buf, const int buffer_length, int last_status,
+	int *status, const unsigned char **data, int *data_length, int *len)
 {
-	int status, message_length;
+	int message_length;
 	const unsigned char *c = buf;
 
 	assert(buffer_length > 0);
 
 	/* Is the first byte the status byte? */
 	if (is_status_byte(*c)) {
-		status = *c;
+		*status = *c;
 		c++;
 
 	} else {
 		/* No, we use running status then. */
-		status = last_status;
+		*status = last_status;
 	}
 
-	if (!is_status_byte(status)) {
+	if (!is_status_byte(*status)) {
 		g_critical("SMF error: bad status byte (MSB is zero).");
 		return (-1);
 	}
 
-	if (is_sysex_byte(status))
-		return (extract_sysex_event(buf, buffer_length, event, len, last_status));
+	if (is_sysex_byte(*status))
+		return (locate_sysex_event(buf, buffer_length, data, data_length, len));
 
-	if (is_escape_byte(status))
-		return (extract_escaped_event(buf, buffer_length, event, len, last_status));
+	if (is_escape_byte(*status))
+		return (locate_escaped_event(buf, buffer_length, data, data_length, len));
 
 	/* At this point, "c" points to first byte following the status byte. */
-	message_length = expected_message_length(status, c, buffer_length - (c - buf));
+	message_length = expected_message_length(*status, c, buffer_length - (c - buf));
 
 	if (message_length < 0)
 		return (-3);
 
 	if (message_length - 1 > buffer_length - (c - buf)) {
-		g_critical("End of buffer in extract_midi_event().");
+		g_critical("End of buffer in locate_midi_event().");
 		return (-5);
 	}
 
-	event->midi_buffer_length = message_length;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate memory in extract_midi_event(): %s", strerror(errno));
+	*data = c;
+	*data_length = message_length - 1;
+	*len = c + message_length - 1 - buf;
+
+	return (0);
+}
+
+/**
+ * Puts MIDI data extracted from from "buf" into "event" and number of consumed bytes into "len".
+ * In case valid status is not found, it uses "last_status" (so called "running status").
+ * Returns 0 iff everything went OK, value < 0 in case of error.
+ */
+static int
+extract_midi_event(const unsigned char *buf, const int buffer_length, smf_event_t *event, int *len, int last_status)
+{
+	int status, data_length;
+	const unsigned char *data;
+
+	if (locate_midi_event(buf, buffer_length, last_status, &status, &data, &data_length, len))
+		return (-1);
+
+	/* Escaped events are stored without the 0xF7. */
+	if (is_escape_byte(status))
+		event->midi_buffer_length = data_length;
+	else
+		event->midi_buffer_length = data_length + 1;
+
+	if (smf_event_allocate_midi_buffer(event, event->midi_buffer_length))
 		return (-4);
+
+	if (is_escape_byte(status)) {
+		memcpy(event->midi_buffer, data, data_length);
+	} else {
+		event->midi_buffer[0] = status;
+		memcpy(event->midi_buffer + 1, data, data_length);
 	}
 
-	event->midi_buffer[0] = status;
-	memcpy(event->midi_buffer + 1, c, message_length - 1);
+	return (0);
+}
 
-	*len = c + message_length - 1 - buf;
+/**
+ * Interprets event (delta time followed by MIDI message) pointed at by "buf", allocates smf_event_t
+ * (from the arena of "smf", if it has one) and fills it properly.  Puts delta time into "delta" and number of consumed bytes into "len".
+ * Returns smf_event_t, not attached to any track, or NULL, if there was an error.
+ */
+static smf_event_t *
+parse_event(smf_t *smf, const unsigned char *buf, const int buffer_length, int last_status, int *delta, int *len)
+{
+	int vlq_length, message_length;
+	smf_event_t *event;
 
-	return (0);
+	assert(buffer_length > 0);
+
+	event = smf_event_new_from_arena(smf->arena);
+	if (event == NULL)
+		return (NULL);
+
+	/* First, extract time offset from previous event. */
+	if (extract_vlq(buf, buffer_length, delta, &vlq_length))
+		goto error;
+
+	if (buffer_length - vlq_length <= 0)
+		goto error;
+
+	/* Now, extract the actual event. */
+	if (extract_midi_event(buf + vlq_length, buffer_length - vlq_length, event, &message_length, last_status))
+		goto error;
+
+	*len = vlq_length + message_length;
+
+	return (event);
+
+error:
+	smf_event_delete(event);
+
+	return (NULL);
 }
 
 /**
  * Locates, basing on track->next_event_offset, the next event data in track->buffer,
  * interprets it, allocates smf_event_t and fills it properly.  Returns smf_event_t
  * or NULL, if there was an error.  Allocating event means adding it to the track;
- * see smf_event_new().
+ * see smf_event_new().  Only ->time_pulses is computed; ->time_seconds and the tempo
+ * map are taken care of after all the tracks are parsed, see smf_track_append_event_delta_pulses().
  */
 static smf_event_t *
 parse_next_event(smf_track_t *track)
 {
 	int time = 0, len, buffer_length;
-	unsigned char *c, *start;
-
-	smf_event_t *event = smf_event_new();
-	if (event == NULL)
-		goto error;
-
-	c = start = (unsigned char *)track->file_buffer + track->next_event_offset;
+	smf_event_t *event;
 
 	assert(track->file_buffer != NULL);
 	assert(track->file_buffer_length > 0);
 	assert(track->next_event_offset > 0);
 
+	/* Chunk ended without End Of Track; caller will truncate the track. */
 	buffer_length = track->file_buffer_length - track->next_event_offset;
-	assert(buffer_length > 0);
-
-	/* First, extract time offset from previous event. */
-	if (extract_vlq(c, buffer_length, &time, &len))
-		goto error;
-
-	c += len;
-	buffer_length -= len;
-
 	if (buffer_length <= 0)
-		goto error;
+		return (NULL);
 
-	/* Now, extract the actual event. */
-	if (extract_midi_event(c, buffer_length, event, &len, track->last_status))
-		goto error;
+	event = parse_event(track->smf, (unsigned char *)track->file_buffer + track->next_event_offset, buffer_length,
+		track->last_status, &time, &len);
+	if (event == NULL)
+		return (NULL);
 
-	c += len;
-	buffer_length -= len;
 	track->last_status = event->midi_buffer[0];
-	track->next_event_offset += c - start;
+	track->next_event_offset += len;
 
-	smf_track_add_event_delta_pulses(track, event, time);
+	smf_track_append_event_delta_pulses(track, event, time);
 
 	return (event);
-
-error:
-	if (event != NULL)
-		smf_event_delete(event);
-
-	return (NULL);
 }
 
 /**
@@ -676,6 +729,7 @@ static int
 parse_mtrk_header(smf_track_t *track)
 {
 	struct chunk_header_struct *mtrk;
+	size_t chunk_length, bytes_left;
 
 	/* Make sure compiler didn't do anything stupid. */
 	assert(sizeof(struct chunk_header_struct) == 8);
@@ -693,8 +747,16 @@ parse_mtrk_header(smf_track_t *track)
 		return (-2);
 	}
 
+	chunk_length = ntohl(mtrk->length);
+	bytes_left = (unsigned char *)track->smf->file_buffer + track->smf->file_buffer_length -
+		((unsigned char *)mtrk + sizeof(struct chunk_header_struct));
+
+	/* Truncated file; next_chunk() already complained.  Do not read past the end of it. */
+	if (chunk_length > bytes_left)
+		chunk_length = bytes_left;
+
 	track->file_buffer = mtrk;
-	track->file_buffer_length = sizeof(struct chunk_header_struct) + ntohl(mtrk->length);
+	track->file_buffer_length = sizeof(struct chunk_header_struct) + chunk_length;
 	track->next_event_offset = sizeof(struct chunk_header_struct);
 
 	return (0);
@@ -763,15 +825,17 @@ smf_event_is_valid(const smf_event_t *event)
 }
 
 /**
- * Parse events and put it on the track.
+ * Parse events, starting at track->next_event_offset, and put them on the track.
  */
 static int
-parse_mtrk_chunk(smf_track_t *track)
+parse_mtrk_events(smf_track_t *track)
 {
 	smf_event_t *event;
+	int bytes_left = track->file_buffer_length - track->next_event_offset;
 
-	if (parse_mtrk_header(track))
-		return (-1);
+	/* Typical event, with running status, takes three bytes; this avoids most of reallocations. */
+	if (bytes_left > 0)
+		smf_track_reserve_events(track, bytes_left / 3);
 
 	for (;;) {
 		event = parse_next_event(track);
@@ -779,10 +843,18 @@ parse_mtrk_chunk(smf_track_t *track)
 		/* Couldn't parse an event? */
 		if (event == NULL) {
 			g_critical("Unable to parse MIDI event; truncating track.");
-			if (smf_track_add_eot_delta_pulses(track, 0) != 0) {
-				g_critical("smf_track_add_eot_delta_pulses failed.");
+
+			/*
+			 * Not smf_track_add_eot_delta_pulses(); that one starts an edit, and this
+			 * may run in several threads at once, see smf_load_from_memory_parallel().
+			 */
+			event = smf_event_new_from_bytes(0xFF, 0x2F, 0x00);
+			if (event == NULL) {
+				g_critical("Cannot create End Of Track event.");
 				return (-2);
 			}
+
+			smf_track_append_event_delta_pulses(track, event, 0);
 			break;
 		}
 
@@ -800,136 +872,1906 @@ parse_mtrk_chunk(smf_track_t *track)
 }
 
 /**
- * Allocate buffer of proper size and read file contents into it.  Close file afterwards.
+ * Parse events and put it on the track.
  */
 static int
-load_file_into_buffer(void **file_buffer, int *file_buffer_length, const char *file_name)
+parse_mtrk_chunk(smf_track_t *track)
 {
-	FILE *stream = fopen(file_name, "rb");
+	if (parse_mtrk_header(track))
+		return (-1);
 
-	if (stream == NULL) {
-		g_critical("Cannot open input file: %s", strerror(errno));
+	return (parse_mtrk_events(track));
+}
 
-		return (-1);
-	}
+/**
+ * \internal
+ *
+ * Parses events of the track loaded by smf_load_lazy() or smf_load_from_memory_lazy(),
+ * computes their time in seconds using the tempo map built during loading and rewinds
+ * the track.  When there are no more tracks left to parse, releases the buffer.
+ */
+void
+smf_track_parse_pending_events(smf_track_t *track)
+{
+	smf_t *smf = track->smf;
+	smf_event_t *event;
 
-	if (fseek(stream, 0, SEEK_END)) {
-		g_critical("fseek(3) failed: %s", strerror(errno));
+	assert(track->parse_pending);
+	assert(smf != NULL);
+	assert(smf->lazy_buffer != NULL);
+	assert(smf->number_of_unparsed_tracks > 0);
 
-		return (-2);
-	}
+	track->parse_pending = 0;
 
-	*file_buffer_length = ftell(stream);
-	if (*file_buffer_length == -1) {
-		g_critical("ftell(3) failed: %s", strerror(errno));
+	/* This cannot fail, parsing errors just truncate the track. */
+	if (parse_mtrk_events(track))
+		g_critical("SMF warning: Cannot load track.");
 
-		return (-3);
+	smf_track_compute_seconds(track);
+
+	event = smf_track_get_event_by_number(track, 1);
+	if (event != NULL) {
+		track->next_event_number = 1;
+		track->time_of_next_event = event->time_pulses;
 	}
 
-	if (fseek(stream, 0, SEEK_SET)) {
-		g_critical("fseek(3) failed: %s", strerror(errno));
+	smf->next_event_heap_is_valid = 0;
+	smf->generation++;
 
-		return (-4);
-	}
+	smf->number_of_unparsed_tracks--;
+	if (smf->number_of_unparsed_tracks == 0)
+		smf_release_lazy_buffer(smf);
+}
+
+/**
+ * \internal
+ *
+ * Releases the buffer lazily loaded song was parsed from, if it belongs to the smf.
+ */
+void
+smf_release_lazy_buffer(smf_t *smf)
+{
+	if (smf->lazy_buffer == NULL)
+		return;
 
-	*file_buffer = malloc(*file_buffer_length);
-	if (*file_buffer == NULL) {
-		g_critical("malloc(3) failed: %s", strerror(errno));
+	if (smf->lazy_buffer_release != NULL)
+		smf->lazy_buffer_release((void *)smf->lazy_buffer, smf->lazy_buffer_length);
 
-		return (-5);
-	}
+	smf->lazy_buffer = NULL;
+	smf->lazy_buffer_length = 0;
+	smf->lazy_buffer_release = NULL;
+}
 
-	if (fread(*file_buffer, 1, *file_buffer_length, stream) != *file_buffer_length) {
-		g_critical("fread(3) failed: %s", strerror(errno));
+/** Tempo-related event found in the file buffer by find_tempo_events(). */
+struct tempo_event_struct {
+	int			time_pulses;
+	int			track_number;
+	int			offset;
+	const unsigned char	*midi_buffer;
+	int			midi_buffer_length;
+};
 
-		return (-6);
-	}
-	
-	if (fclose(stream)) {
-		g_critical("fclose(3) failed: %s", strerror(errno));
+/**
+ * Used for sorting tempo events into the order smf_get_next_event() would return them.
+ */
+static int
+tempo_events_compare_function(const void *aa, const void *bb)
+{
+	const struct tempo_event_struct *a = aa, *b = bb;
 
-		return (-7);
-	}
+	if (a->time_pulses != b->time_pulses)
+		return (a->time_pulses < b->time_pulses ? -1 : 1);
 
-	return (0);
+	if (a->track_number != b->track_number)
+		return (a->track_number < b->track_number ? -1 : 1);
+
+	return (a->offset < b->offset ? -1 : (a->offset > b->offset));
 }
 
 /**
-  * Creates new SMF and fills it with data loaded from the given buffer.
- * \return SMF or NULL, if loading failed.
-  */
-smf_t *
-smf_load_from_memory(const void *buffer, const int buffer_length)
+ * Walks the events of unparsed track, without allocating them, and appends Tempo Change
+ * and Time Signature metaevents to "tempo_events".  Stops where parse_mtrk_events() would.
+ * Returns 0 iff everything went OK.
+ */
+static int
+find_tempo_events(const smf_track_t *track, struct tempo_event_struct **tempo_events, int *number_of_tempo_events, int *allocated)
 {
-	int i;
+	int offset, pulses = 0, last_status = 0, delta, len, status, data_length;
+	const unsigned char *buf = track->file_buffer, *data;
+	struct tempo_event_struct *tmp;
 
-	smf_t *smf = smf_new();
+	for (offset = track->next_event_offset; offset < track->file_buffer_length; offset += len) {
+		if (extract_vlq(buf + offset, track->file_buffer_length - offset, &delta, &len))
+			break;
 
-	smf->file_buffer = (void *)buffer;
-	smf->file_buffer_length = buffer_length;
-	smf->next_chunk_offset = 0;
+		offset += len;
+		pulses += delta;
 
-	if (parse_mthd_chunk(smf))
-		return (NULL);
+		if (offset >= track->file_buffer_length)
+			break;
 
-	for (i = 1; i <= smf->expected_number_of_tracks; i++) {
-		smf_track_t *track = smf_track_new();
-		if (track == NULL)
-			return (NULL);
+		if (locate_midi_event(buf + offset, track->file_buffer_length - offset, last_status, &status, &data, &data_length, &len))
+			break;
 
-		smf_add_track(smf, track);
+		/* Running status continues from the first byte of the message, as in parse_next_event(). */
+		last_status = is_escape_byte(status) ? data[0] : status;
 
-		/* Skip unparseable chunks. */
-		if (parse_mtrk_chunk(track)) {
-			g_warning("SMF warning: Cannot load track.");
-			smf_track_delete(track);
+		if (status != 0xFF)
+			continue;
+
+		/* End Of Track? */
+		if (data[0] == 0x2F)
+			break;
+
+		if (data[0] != 0x51 && data[0] != 0x58)
+			continue;
+
+		if (*number_of_tempo_events == *allocated) {
+			*allocated = *allocated > 0 ? *allocated * 2 : 16;
+			tmp = realloc(*tempo_events, *allocated * sizeof(struct tempo_event_struct));
+			if (tmp == NULL) {
+				g_critical("Cannot allocate memory in find_tempo_events(): %s", strerror(errno));
+				return (-1);
+			}
+			*tempo_events = tmp;
 		}
 
-		track->file_buffer = NULL;
-		track->file_buffer_length = 0;
-		track->next_event_offset = -1;
+		tmp = *tempo_events + *number_of_tempo_events;
+		tmp->time_pulses = pulses;
+		tmp->track_number = track->track_number;
+		tmp->offset = offset;
+		/* Metaevents are stored in memory just like in the file, status byte included. */
+		tmp->midi_buffer = data - 1;
+		tmp->midi_buffer_length = data_length + 1;
+		(*number_of_tempo_events)++;
 	}
 
-	if (smf->expected_number_of_tracks != smf->number_of_tracks) {
-		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
-				smf->expected_number_of_tracks, smf->number_of_tracks);
+	return (0);
+}
 
-		smf->expected_number_of_tracks = smf->number_of_tracks;
+/**
+ * Builds tempo map of the lazily loaded song straight from the file buffer, without parsing
+ * the tracks.  Tempo-related events from all the tracks are applied in time order, the same
+ * way smf_create_tempo_map_and_compute_seconds() does it.
+ */
+static int
+create_tempo_map_from_unparsed_tracks(smf_t *smf)
+{
+	int i, number_of_tempo_events = 0, allocated = 0;
+	struct tempo_event_struct *tempo_events = NULL;
+	smf_track_t *track;
+
+	for (i = 0; i < smf->tracks_array->len; i++) {
+		track = g_ptr_array_index(smf->tracks_array, i);
+
+		if (find_tempo_events(track, &tempo_events, &number_of_tempo_events, &allocated)) {
+			free(tempo_events);
+			return (-1);
+		}
 	}
 
-	smf->file_buffer = NULL;
-	smf->file_buffer_length = 0;
-	smf->next_chunk_offset = -1;
+	/* No tempo events means no array at all; qsort(3) must not get NULL, even with zero elements. */
+	if (number_of_tempo_events > 0)
+		qsort(tempo_events, number_of_tempo_events, sizeof(struct tempo_event_struct), tempo_events_compare_function);
 
-	return (smf);
+	smf_init_tempo(smf);
+
+	for (i = 0; i < number_of_tempo_events; i++)
+		maybe_add_buffer_to_tempo_map(smf, tempo_events[i].time_pulses, tempo_events[i].midi_buffer, tempo_events[i].midi_buffer_length);
+
+	free(tempo_events);
+
+	return (0);
 }
 
+/* Buffer size used for reading data of unknown length, e.g. from a pipe. */
+#define READ_BLOCK_SIZE 65536
+
 /**
- * Loads SMF file.
- *
- * \param file_name Path to the file.
- * \return SMF or NULL, if loading failed.
+ * Makes sure there is room for at least one more byte after the first "used" bytes of "*buffer",
+ * doubling its size if needed.  "size_hint", if greater than zero, is the expected total size.
+ * Returns 0 iff everything went OK.
  */
-smf_t *
-smf_load(const char *file_name)
+static int
+grow_read_buffer(unsigned char **buffer, int *allocated, int used, int size_hint)
 {
-	int file_buffer_length;
-	void *file_buffer;
-	smf_t *smf;
+	int new_allocated;
+	unsigned char *tmp;
 
-	if (load_file_into_buffer(&file_buffer, &file_buffer_length, file_name))
-		return (NULL);
+	if (used < *allocated)
+		return (0);
 
-	smf = smf_load_from_memory(file_buffer, file_buffer_length);
+	if (*allocated == 0) {
+		/* One byte more than expected, so that end of file is seen without reallocating. */
+		new_allocated = size_hint > 0 && size_hint < INT_MAX ? size_hint + 1 : READ_BLOCK_SIZE;
+	} else {
+		if (*allocated > INT_MAX / 2) {
+			g_critical("SMF error: file is too large.");
+			return (-1);
+		}
 
-	memset(file_buffer, 0, file_buffer_length);
-	free(file_buffer);
+		new_allocated = *allocated * 2;
+	}
 
-	if (smf == NULL)
-		return (NULL);
+	tmp = realloc(*buffer, new_allocated);
+	if (tmp == NULL) {
+		g_critical("Cannot allocate memory for file contents: %s", strerror(errno));
+		return (-2);
+	}
 
-	smf_rewind(smf);
+	*buffer = tmp;
+	*allocated = new_allocated;
 
-	return (smf);
+	return (0);
+}
+
+/**
+ * Returns the size of the file behind "fd", if it is a regular file, or 0 if it is not known.
+ */
+static int
+file_size_hint(int fd)
+{
+#ifndef __MINGW32__
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < INT_MAX)
+		return (st.st_size);
+#endif /* ! __MINGW32__ */
+
+	return (0);
 }
 
+/**
+ * Allocates buffer and reads contents of the "stream", starting at current position, into it,
+ * until end of file.  Works for pipes and other non-seekable streams.  Does not close the stream.
+ * Returns 0 iff everything went OK; in that case, free the buffer with free_buffer().
+ */
+static int
+read_stream_into_buffer(void **file_buffer, int *file_buffer_length, FILE *stream)
+{
+	int used = 0, allocated = 0, size_hint;
+	size_t n;
+	unsigned char *buffer = NULL;
+
+	size_hint = file_size_hint(fileno(stream));
+
+	for (;;) {
+		if (grow_read_buffer(&buffer, &allocated, used, size_hint))
+			goto error;
+
+		n = fread(buffer + used, 1, allocated - used, stream);
+		used += n;
+
+		if (n > 0)
+			continue;
+
+		if (ferror(stream)) {
+			g_critical("fread(3) failed: %s", strerror(errno));
+			goto error;
+		}
+
+		break;
+	}
+
+	*file_buffer = buffer;
+	*file_buffer_length = used;
+
+	return (0);
+
+error:
+	free(buffer);
+
+	return (-1);
+}
+
+/**
+ * Same as read_stream_into_buffer(), but reads from file descriptor, using read(2).
+ */
+static int
+read_fd_into_buffer(void **file_buffer, int *file_buffer_length, int fd)
+{
+	int used = 0, allocated = 0, size_hint;
+	ssize_t n;
+	unsigned char *buffer = NULL;
+
+	size_hint = file_size_hint(fd);
+
+	for (;;) {
+		if (grow_read_buffer(&buffer, &allocated, used, size_hint))
+			goto error;
+
+		n = read(fd, buffer + used, allocated - used);
+
+		if (n > 0) {
+			used += n;
+			continue;
+		}
+
+		if (n == 0)
+			break;
+
+		if (errno == EINTR)
+			continue;
+
+		g_critical("read(2) failed: %s", strerror(errno));
+		goto error;
+	}
+
+	*file_buffer = buffer;
+	*file_buffer_length = used;
+
+	return (0);
+
+error:
+	free(buffer);
+
+	return (-1);
+}
+
+/**
+ * Allocate buffer of proper size and read file contents into it.  Close file afterwards.
+ */
+static int
+load_file_into_buffer(void **file_buffer, int *file_buffer_length, const char *file_name)
+{
+	FILE *stream = fopen(file_name, "rb");
+
+	if (stream == NULL) {
+		g_critical("Cannot open input file: %s", strerror(errno));
+
+		return (-1);
+	}
+
+	if (read_stream_into_buffer(file_buffer, file_buffer_length, stream)) {
+		fclose(stream);
+
+		return (-2);
+	}
+
+	if (fclose(stream)) {
+		g_critical("fclose(3) failed: %s", strerror(errno));
+		free(*file_buffer);
+
+		return (-3);
+	}
+
+	return (0);
+}
+
+/**
+ * Frees buffer allocated by load_file_into_buffer().
+ */
+static void
+free_buffer(void *file_buffer, int file_buffer_length)
+{
+	memset(file_buffer, 0, file_buffer_length);
+	free(file_buffer);
+}
+
+#ifndef __MINGW32__
+
+/**
+ * Map file contents into memory, read-only, and hint the kernel that it is going to be read
+ * sequentially.  Close file afterwards; the mapping stays valid until unmap_buffer().
+ */
+static int
+map_file_into_buffer(void **file_buffer, int *file_buffer_length, const char *file_name)
+{
+	struct stat st;
+	int fd = open(file_name, O_RDONLY);
+
+	if (fd == -1) {
+		g_critical("Cannot open input file: %s", strerror(errno));
+
+		return (-1);
+	}
+
+	if (fstat(fd, &st)) {
+		g_critical("fstat(2) failed: %s", strerror(errno));
+		close(fd);
+
+		return (-2);
+	}
+
+	/* Check this here, mmap(2) refuses zero-length mappings. */
+	if (st.st_size < 6) {
+		g_critical("SMF error: file is too short, it cannot be a MIDI file.");
+		close(fd);
+
+		return (-3);
+	}
+
+	if (st.st_size > INT_MAX) {
+		g_critical("SMF error: file is too large.");
+		close(fd);
+
+		return (-4);
+	}
+
+	*file_buffer_length = st.st_size;
+	*file_buffer = mmap(NULL, *file_buffer_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*file_buffer == MAP_FAILED) {
+		g_critical("mmap(2) failed: %s", strerror(errno));
+		close(fd);
+
+		return (-5);
+	}
+
+#ifdef MADV_SEQUENTIAL
+	/* This is only a hint; failure is harmless. */
+	(void) madvise(*file_buffer, *file_buffer_length, MADV_SEQUENTIAL);
+#endif
+
+	if (close(fd)) {
+		g_critical("close(2) failed: %s", strerror(errno));
+		munmap(*file_buffer, *file_buffer_length);
+
+		return (-6);
+	}
+
+	return (0);
+}
+
+/**
+ * Release mapping created by map_file_into_buffer().
+ */
+static void
+unmap_buffer(void *file_buffer, int file_buffer_length)
+{
+	if (munmap(file_buffer, file_buffer_length))
+		g_critical("munmap(2) failed: %s", strerror(errno));
+}
+
+#endif /* ! __MINGW32__ */
+
+/**
+ * Get file contents into memory: map it, where possible, or read it into allocated buffer otherwise.
+ * Puts routine that releases the buffer into "release".
+ */
+static int
+map_or_load_file_into_buffer(void **file_buffer, int *file_buffer_length, void (**release)(void *, int), const char *file_name)
+{
+#ifdef __MINGW32__
+	*release = free_buffer;
+
+	return (load_file_into_buffer(file_buffer, file_buffer_length, file_name));
+#else /* ! __MINGW32__ */
+	*release = unmap_buffer;
+
+	return (map_file_into_buffer(file_buffer, file_buffer_length, file_name));
+#endif /* ! __MINGW32__ */
+}
+
+/**
+ * Fills empty "smf" with data loaded from the given buffer.  If loading fails, "smf" is deleted.
+ * \return SMF or NULL, if loading failed.
+ */
+static smf_t *
+load_from_memory(smf_t *smf, const void *buffer, const int buffer_length)
+{
+	int i;
+
+	if (smf == NULL)
+		return (NULL);
+
+	smf->file_buffer = (void *)buffer;
+	smf->file_buffer_length = buffer_length;
+	smf->next_chunk_offset = 0;
+
+	if (parse_mthd_chunk(smf)) {
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	for (i = 1; i <= smf->expected_number_of_tracks; i++) {
+		smf_track_t *track = smf_track_new();
+		if (track == NULL) {
+			smf_delete(smf);
+			return (NULL);
+		}
+
+		smf_add_track(smf, track);
+
+		/* Skip unparseable chunks. */
+		if (parse_mtrk_chunk(track)) {
+			g_warning("SMF warning: Cannot load track.");
+			smf_track_delete(track);
+			continue;
+		}
+
+		track->file_buffer = NULL;
+		track->file_buffer_length = 0;
+		track->next_event_offset = -1;
+	}
+
+	if (smf->expected_number_of_tracks != smf->number_of_tracks) {
+		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
+				smf->expected_number_of_tracks, smf->number_of_tracks);
+
+		smf->expected_number_of_tracks = smf->number_of_tracks;
+	}
+
+	smf->file_buffer = NULL;
+	smf->file_buffer_length = 0;
+	smf->next_chunk_offset = -1;
+
+	/* smf_track_append_event_delta_pulses() leaves these alone. */
+	smf->next_event_heap_is_valid = 0;
+	smf->generation++;
+
+	/* Tracks were parsed in pulses only; now that all the tempo changes are known, compute time in seconds. */
+	smf_create_tempo_map_and_compute_seconds(smf);
+	smf_rewind(smf);
+
+	return (smf);
+}
+
+/**
+  * Creates new SMF and fills it with data loaded from the given buffer.
+ * \return SMF or NULL, if loading failed.
+  */
+smf_t *
+smf_load_from_memory(const void *buffer, const int buffer_length)
+{
+	return (load_from_memory(smf_new(), buffer, buffer_length));
+}
+
+/**
+ * Same as smf_load_from_memory(), but the smf is created using smf_new_with_arena().
+ * Deleting it is much faster; see smf_new_with_arena() for the limitations.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_from_memory_with_arena(const void *buffer, const int buffer_length)
+{
+	return (load_from_memory(smf_new_with_arena(), buffer, buffer_length));
+}
+
+/** State shared by the threads parsing tracks in smf_load_from_memory_parallel(). */
+struct parallel_load_struct {
+	smf_t		*smf;
+	int		next_track_index;
+	int		*parse_failed;
+#ifndef __MINGW32__
+	pthread_mutex_t	mutex;
+#endif
+};
+
+/**
+ * Takes tracks, one by one, and parses them, until there are none left.  Runs in several threads at once;
+ * each track is parsed by exactly one of them.  Events are parsed in pulses only, as ->time_seconds
+ * depends on tempo changes in the other tracks.
+ */
+static void *
+parse_tracks_in_parallel(void *arg)
+{
+	int i;
+	smf_track_t *track;
+	struct parallel_load_struct *load = arg;
+
+	for (;;) {
+#ifndef __MINGW32__
+		pthread_mutex_lock(&load->mutex);
+#endif
+		i = load->next_track_index++;
+#ifndef __MINGW32__
+		pthread_mutex_unlock(&load->mutex);
+#endif
+
+		if (i >= load->smf->tracks_array->len)
+			break;
+
+		track = g_ptr_array_index(load->smf->tracks_array, i);
+		load->parse_failed[i] = parse_mtrk_events(track);
+	}
+
+	return (NULL);
+}
+
+/**
+ * \return Number of processors available, or 1, if it cannot be determined.
+ */
+static int
+number_of_processors(void)
+{
+#if !defined(__MINGW32__) && defined(_SC_NPROCESSORS_ONLN)
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (processors > 0)
+		return (processors);
+#endif
+
+	return (1);
+}
+
+/**
+ * Creates new SMF and fills it with data loaded from the given buffer, just like
+ * smf_load_from_memory(), but parses tracks using several threads at once.  Tempo map
+ * is built and ->time_seconds of events is computed afterwards, in a single pass.
+ * Result is exactly the same as from smf_load_from_memory(), except that the smf is rewound.
+ * This only makes sense for format 1 files with lots of tracks.  On systems without
+ * POSIX threads, tracks are parsed one after another.
+ *
+ * \param buffer Buffer containing SMF file.
+ * \param buffer_length Length of the buffer.
+ * \param number_of_threads Maximum number of threads to use, or 0 to use one thread for each processor.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_from_memory_parallel(const void *buffer, const int buffer_length, int number_of_threads)
+{
+	int i;
+	smf_track_t *track;
+	struct parallel_load_struct load;
+#ifndef __MINGW32__
+	pthread_t *threads;
+	int error, number_of_started_threads = 0;
+#endif
+
+	smf_t *smf = smf_new();
+	if (smf == NULL)
+		return (NULL);
+
+	smf->file_buffer = (void *)buffer;
+	smf->file_buffer_length = buffer_length;
+	smf->next_chunk_offset = 0;
+
+	if (parse_mthd_chunk(smf)) {
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	/* Finding the chunks is cheap; do it first, so that the threads do not have to share next_chunk(). */
+	for (i = 1; i <= smf->expected_number_of_tracks; i++) {
+		track = smf_track_new();
+		if (track == NULL) {
+			smf_delete(smf);
+			return (NULL);
+		}
+
+		smf_add_track(smf, track);
+
+		/* Skip unparseable chunks. */
+		if (parse_mtrk_header(track)) {
+			g_warning("SMF warning: Cannot load track.");
+			smf_track_delete(track);
+		}
+	}
+
+	load.smf = smf;
+	load.next_track_index = 0;
+	load.parse_failed = calloc(smf->number_of_tracks + 1, sizeof(int));
+	if (load.parse_failed == NULL) {
+		g_critical("Cannot allocate memory in smf_load_from_memory_parallel(): %s", strerror(errno));
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	if (number_of_threads <= 0)
+		number_of_threads = number_of_processors();
+
+	if (number_of_threads > smf->number_of_tracks)
+		number_of_threads = smf->number_of_tracks;
+
+	if (number_of_threads < 1)
+		number_of_threads = 1;
+
+#ifndef __MINGW32__
+	pthread_mutex_init(&load.mutex, NULL);
+
+	/* The calling thread is one of the workers, too. */
+	threads = malloc(number_of_threads * sizeof(pthread_t));
+	if (threads != NULL) {
+		for (i = 0; i < number_of_threads - 1; i++) {
+			error = pthread_create(&threads[i], NULL, parse_tracks_in_parallel, &load);
+			if (error) {
+				g_warning("pthread_create(3) failed: %s; continuing with fewer threads.", strerror(error));
+				break;
+			}
+
+			number_of_started_threads++;
+		}
+	}
+
+	parse_tracks_in_parallel(&load);
+
+	for (i = 0; i < number_of_started_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&load.mutex);
+#else /* __MINGW32__ */
+	parse_tracks_in_parallel(&load);
+#endif /* __MINGW32__ */
+
+	/* Remove tracks that failed, from last to first, so that the indices stay valid. */
+	for (i = smf->number_of_tracks; i >= 1; i--) {
+		if (load.parse_failed[i - 1]) {
+			g_warning("SMF warning: Cannot load track.");
+			smf_track_delete(smf_get_track_by_number(smf, i));
+		}
+	}
+
+	free(load.parse_failed);
+
+	if (smf->expected_number_of_tracks != smf->number_of_tracks) {
+		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
+				smf->expected_number_of_tracks, smf->number_of_tracks);
+
+		smf->expected_number_of_tracks = smf->number_of_tracks;
+	}
+
+	smf->file_buffer = NULL;
+	smf->file_buffer_length = 0;
+	smf->next_chunk_offset = -1;
+
+	/* The threads are joined; smf_track_append_event_delta_pulses() left these to us. */
+	smf->next_event_heap_is_valid = 0;
+	smf->generation++;
+
+	/* Now that all the tempo changes are known, compute time in seconds, for all the tracks at once. */
+	smf_create_tempo_map_and_compute_seconds(smf);
+	smf_rewind(smf);
+
+	return (smf);
+}
+
+/**
+ * Creates new SMF and finds tracks in the given buffer, but does not parse them yet.  Only
+ * the tempo map is built; events of a track are parsed the first time the track is accessed.
+ * The buffer must remain valid until the smf is deleted using smf_delete().
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_from_memory_lazy(const void *buffer, const int buffer_length)
+{
+	int i;
+	smf_track_t *track;
+
+	smf_t *smf = smf_new();
+	if (smf == NULL)
+		return (NULL);
+
+	smf->file_buffer = (void *)buffer;
+	smf->file_buffer_length = buffer_length;
+	smf->next_chunk_offset = 0;
+
+	if (parse_mthd_chunk(smf)) {
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	for (i = 1; i <= smf->expected_number_of_tracks; i++) {
+		track = smf_track_new();
+		if (track == NULL) {
+			smf_delete(smf);
+			return (NULL);
+		}
+
+		smf_add_track(smf, track);
+
+		/* Skip unparseable chunks. */
+		if (parse_mtrk_header(track)) {
+			g_warning("SMF warning: Cannot load track.");
+			smf_track_delete(track);
+			continue;
+		}
+
+		/* Leave file_buffer and next_event_offset for smf_track_parse_pending_events(). */
+		track->parse_pending = 1;
+		smf->number_of_unparsed_tracks++;
+	}
+
+	if (smf->expected_number_of_tracks != smf->number_of_tracks) {
+		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
+				smf->expected_number_of_tracks, smf->number_of_tracks);
+
+		smf->expected_number_of_tracks = smf->number_of_tracks;
+	}
+
+	smf->file_buffer = NULL;
+	smf->file_buffer_length = 0;
+	smf->next_chunk_offset = -1;
+
+	smf->lazy_buffer = buffer;
+	smf->lazy_buffer_length = buffer_length;
+
+	if (create_tempo_map_from_unparsed_tracks(smf)) {
+		smf_delete(smf);
+		return (NULL);
+	}
+
+	if (smf->number_of_unparsed_tracks == 0)
+		smf_release_lazy_buffer(smf);
+
+	return (smf);
+}
+
+/**
+ * Loads SMF file.
+ *
+ * \param file_name Path to the file.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load(const char *file_name)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	smf_t *smf;
+
+	if (load_file_into_buffer(&file_buffer, &file_buffer_length, file_name))
+		return (NULL);
+
+	smf = smf_load_from_memory(file_buffer, file_buffer_length);
+
+	free_buffer(file_buffer, file_buffer_length);
+
+	if (smf == NULL)
+		return (NULL);
+
+	smf_rewind(smf);
+
+	return (smf);
+}
+
+/**
+ * Loads SMF file into smf created using smf_new_with_arena(); see smf_load_from_memory_with_arena().
+ *
+ * \param file_name Path to the file.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_with_arena(const char *file_name)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	void (*release)(void *, int);
+	smf_t *smf;
+
+	if (map_or_load_file_into_buffer(&file_buffer, &file_buffer_length, &release, file_name))
+		return (NULL);
+
+	smf = smf_load_from_memory_with_arena(file_buffer, file_buffer_length);
+
+	release(file_buffer, file_buffer_length);
+
+	return (smf);
+}
+
+
+/** Shared state of smf_load_many() worker threads. */
+struct load_many_struct {
+	const char * const	*file_names;
+	int			number_of_files;
+	int			next_file_index;
+	void			(*callback)(smf_t *smf, int file_index, int error, void *user_data);
+	void			*user_data;
+	smf_load_stats_t	*stats;
+#ifndef __MINGW32__
+	/** Protects next_file_index. */
+	pthread_mutex_t		mutex;
+	/** Protects stats and serializes calls to callback; separate, so that slow callback does not stop workers. */
+	pthread_mutex_t		callback_mutex;
+#endif
+};
+
+/**
+ * Returns current wall clock time, in seconds, counting from some arbitrary point.
+ */
+static double
+current_time_seconds(void)
+{
+#ifdef __MINGW32__
+	return (GetTickCount() / 1000.0);
+#else /* ! __MINGW32__ */
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+#endif /* ! __MINGW32__ */
+}
+
+/**
+ * Worker thread for smf_load_many().  Takes files from the list until there are none left.
+ */
+static void *
+load_files_in_parallel(void *arg)
+{
+	int i, file_index, file_buffer_length, error;
+	int64_t number_of_events;
+	void *file_buffer;
+	void (*release)(void *, int);
+	smf_t *smf;
+	struct load_many_struct *load = arg;
+
+	for (;;) {
+#ifndef __MINGW32__
+		pthread_mutex_lock(&load->mutex);
+#endif
+		file_index = load->next_file_index++;
+#ifndef __MINGW32__
+		pthread_mutex_unlock(&load->mutex);
+#endif
+
+		if (file_index >= load->number_of_files)
+			break;
+
+		smf = NULL;
+		error = SMF_LOAD_ERROR_READ;
+		file_buffer_length = 0;
+		number_of_events = 0;
+
+		if (!map_or_load_file_into_buffer(&file_buffer, &file_buffer_length, &release, load->file_names[file_index])) {
+			smf = smf_load_from_memory(file_buffer, file_buffer_length);
+			release(file_buffer, file_buffer_length);
+
+			error = smf == NULL ? SMF_LOAD_ERROR_PARSE : 0;
+		}
+
+		if (smf != NULL) {
+			for (i = 1; i <= smf->number_of_tracks; i++)
+				number_of_events += smf_get_track_by_number(smf, i)->number_of_events;
+		}
+
+		/* Callbacks are called one at a time, so that they do not need any locking of their own. */
+#ifndef __MINGW32__
+		pthread_mutex_lock(&load->callback_mutex);
+#endif
+		if (error == 0) {
+			load->stats->number_of_files_loaded++;
+			load->stats->number_of_events += number_of_events;
+		} else {
+			load->stats->number_of_files_failed++;
+		}
+
+		load->stats->number_of_bytes += file_buffer_length;
+
+		if (load->callback != NULL)
+			load->callback(smf, file_index, error, load->user_data);
+		else if (smf != NULL)
+			smf_delete(smf);
+#ifndef __MINGW32__
+		pthread_mutex_unlock(&load->callback_mutex);
+#endif
+	}
+
+	return (NULL);
+}
+
+/**
+ * Loads lots of SMF files using several threads at once.  Each file is loaded just like smf_load_mmap()
+ * would do it and then passed to "callback", together with the index of the file in "file_names",
+ * error code - 0, SMF_LOAD_ERROR_READ or SMF_LOAD_ERROR_PARSE - and "user_data".  smf is NULL
+ * in case of error; otherwise callback is responsible for freeing it using smf_delete().  Files are
+ * passed to the callback in the order they finish loading, which is not necessarily the order
+ * of "file_names".  Callback is called from the worker threads, but never from two threads at once.
+ *
+ * \param file_names Paths to the files.
+ * \param number_of_files Number of elements in "file_names".
+ * \param number_of_threads Maximum number of threads to use, or 0 to use one thread for each processor.
+ * \param callback Function called for every file, or NULL to discard loaded files.
+ * \param user_data Passed to callback.
+ * \param stats If not NULL, filled with summary of the run.
+ * \return Number of files that failed to load, 0 if all of them were loaded.
+ */
+int
+smf_load_many(const char * const *file_names, int number_of_files, int number_of_threads,
+	void (*callback)(smf_t *smf, int file_index, int error, void *user_data), void *user_data, smf_load_stats_t *stats)
+{
+	double start_time, time_seconds;
+	smf_load_stats_t local_stats;
+	struct load_many_struct load;
+#ifndef __MINGW32__
+	int i, error, number_of_started_threads = 0;
+	pthread_t *threads;
+#endif
+
+	assert(number_of_files >= 0);
+
+	if (stats == NULL)
+		stats = &local_stats;
+
+	memset(stats, 0, sizeof(smf_load_stats_t));
+
+	load.file_names = file_names;
+	load.number_of_files = number_of_files;
+	load.next_file_index = 0;
+	load.callback = callback;
+	load.user_data = user_data;
+	load.stats = stats;
+
+	if (number_of_threads <= 0)
+		number_of_threads = number_of_processors();
+
+	if (number_of_threads > number_of_files)
+		number_of_threads = number_of_files;
+
+	if (number_of_threads < 1)
+		number_of_threads = 1;
+
+	start_time = current_time_seconds();
+
+#ifndef __MINGW32__
+	pthread_mutex_init(&load.mutex, NULL);
+	pthread_mutex_init(&load.callback_mutex, NULL);
+
+	/* The calling thread is one of the workers, too. */
+	threads = malloc(number_of_threads * sizeof(pthread_t));
+	if (threads != NULL) {
+		for (i = 0; i < number_of_threads - 1; i++) {
+			error = pthread_create(&threads[i], NULL, load_files_in_parallel, &load);
+			if (error) {
+				g_warning("pthread_create(3) failed: %s; continuing with fewer threads.", strerror(error));
+				break;
+			}
+
+			number_of_started_threads++;
+		}
+	}
+
+	load_files_in_parallel(&load);
+
+	for (i = 0; i < number_of_started_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&load.mutex);
+	pthread_mutex_destroy(&load.callback_mutex);
+#else /* __MINGW32__ */
+	load_files_in_parallel(&load);
+#endif /* __MINGW32__ */
+
+	time_seconds = current_time_seconds() - start_time;
+
+	stats->time_seconds = time_seconds;
+	if (time_seconds > 0.0) {
+		stats->files_per_second = (stats->number_of_files_loaded + stats->number_of_files_failed) / time_seconds;
+		stats->bytes_per_second = stats->number_of_bytes / time_seconds;
+	}
+
+	return (stats->number_of_files_failed);
+}
+
+/**
+ * Loads SMF from "stream", starting at its current position and reading until end of file.
+ * Unlike smf_load(), this does not need to seek, so it works with pipes and standard input.
+ * The stream is not closed.
+ *
+ * \param stream Stream opened for reading, preferably in binary mode.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_from_stream(FILE *stream)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	smf_t *smf;
+
+	if (read_stream_into_buffer(&file_buffer, &file_buffer_length, stream))
+		return (NULL);
+
+	smf = smf_load_from_memory(file_buffer, file_buffer_length);
+
+	free_buffer(file_buffer, file_buffer_length);
+
+	return (smf);
+}
+
+/**
+ * Loads SMF from file descriptor, just like smf_load_from_stream().  The descriptor is not closed.
+ *
+ * \param fd File descriptor opened for reading.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_from_fd(int fd)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	smf_t *smf;
+
+	if (read_fd_into_buffer(&file_buffer, &file_buffer_length, fd))
+		return (NULL);
+
+	smf = smf_load_from_memory(file_buffer, file_buffer_length);
+
+	free_buffer(file_buffer, file_buffer_length);
+
+	return (smf);
+}
+
+/**
+ * Loads SMF file, just like smf_load(), but parses it directly from the pages
+ * mapped with mmap(2) instead of reading it into a temporary heap buffer.
+ * This avoids a copy of the whole file and is faster when loading lots of files.
+ * On systems without mmap(2) this is the same as smf_load().
+ *
+ * \param file_name Path to the file.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_mmap(const char *file_name)
+{
+#ifdef __MINGW32__
+	return (smf_load(file_name));
+#else /* ! __MINGW32__ */
+	int file_buffer_length;
+	void *file_buffer;
+	smf_t *smf;
+
+	if (map_file_into_buffer(&file_buffer, &file_buffer_length, file_name))
+		return (NULL);
+
+	smf = smf_load_from_memory(file_buffer, file_buffer_length);
+
+	unmap_buffer(file_buffer, file_buffer_length);
+
+	if (smf == NULL)
+		return (NULL);
+
+	smf_rewind(smf);
+
+	return (smf);
+#endif /* ! __MINGW32__ */
+}
+
+/**
+ * Loads SMF file lazily; see smf_load_from_memory_lazy().  File contents are kept
+ * (memory-mapped, where possible) until all the tracks are parsed or the smf is deleted.
+ *
+ * \param file_name Path to the file.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_lazy(const char *file_name)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	void (*release)(void *, int);
+	smf_t *smf;
+
+	if (map_or_load_file_into_buffer(&file_buffer, &file_buffer_length, &release, file_name))
+		return (NULL);
+
+	smf = smf_load_from_memory_lazy(file_buffer, file_buffer_length);
+	if (smf == NULL) {
+		release(file_buffer, file_buffer_length);
+		return (NULL);
+	}
+
+	/* Parsing may be already finished, if there were no tracks. */
+	if (smf->lazy_buffer != NULL)
+		smf->lazy_buffer_release = release;
+	else
+		release(file_buffer, file_buffer_length);
+
+	return (smf);
+}
+
+/**
+ * Loads SMF file, parsing tracks using several threads at once; see smf_load_from_memory_parallel().
+ *
+ * \param file_name Path to the file.
+ * \param number_of_threads Maximum number of threads to use, or 0 to use one thread for each processor.
+ * \return SMF or NULL, if loading failed.
+ */
+smf_t *
+smf_load_parallel(const char *file_name, int number_of_threads)
+{
+	int file_buffer_length;
+	void *file_buffer;
+	void (*release)(void *, int);
+	smf_t *smf;
+
+	if (map_or_load_file_into_buffer(&file_buffer, &file_buffer_length, &release, file_name))
+		return (NULL);
+
+	smf = smf_load_from_memory_parallel(file_buffer, file_buffer_length, number_of_threads);
+
+	release(file_buffer, file_buffer_length);
+
+	return (smf);
+}
+
+/* States of smf_parser_t. */
+#define PARSER_EXPECTS_MTHD		0
+#define PARSER_EXPECTS_CHUNK_HEADER	1
+#define PARSER_EXPECTS_EVENT		2
+#define PARSER_SKIPS_CHUNK		3
+#define PARSER_IS_DONE			4
+#define PARSER_FAILED			5
+
+/**
+ * Returns 1, if "buf" contains the whole event, i.e. delta time and complete MIDI message, 0 if more
+ * data is needed.  Malformed events are reported as complete, so that parse_event() can complain about
+ * them.  Unlike parse_event(), this never complains about reaching the end of the buffer.
+ */
+static int
+event_is_complete(const unsigned char *buf, const int buffer_length, int last_status)
+{
+	int i, status, message_length, vlq_length;
+
+	/* Delta time. */
+	for (i = 0; ; i++) {
+		if (i >= buffer_length)
+			return (0);
+
+		if (i >= 4 || !(buf[i] & 0x80))
+			break;
+	}
+
+	i++;
+
+	if (i >= buffer_length)
+		return (0);
+
+	if (is_status_byte(buf[i])) {
+		status = buf[i];
+		i++;
+	} else {
+		status = last_status;
+
+		if (!is_status_byte(status) || is_sysex_byte(status) || is_escape_byte(status))
+			return (1);
+	}
+
+	if (is_sysex_byte(status) || is_escape_byte(status)) {
+		for (vlq_length = 0; ; vlq_length++) {
+			if (i + vlq_length >= buffer_length)
+				return (0);
+
+			if (vlq_length >= 4 || !(buf[i + vlq_length] & 0x80))
+				break;
+		}
+
+		if (extract_vlq(buf + i, buffer_length - i, &message_length, &vlq_length))
+			return (1);
+
+		/* locate_sysex_event() wants one byte more than the message takes, and at least four bytes. */
+		return (i + vlq_length + message_length + 1 <= buffer_length && buffer_length - i >= 3);
+	}
+
+	/* Metaevent: type, one byte of length, then data; see expected_message_length(). */
+	if (status == 0xFF) {
+		if (i + 2 > buffer_length)
+			return (0);
+
+		return (i + 2 + buf[i + 1] <= buffer_length);
+	}
+
+	message_length = expected_message_length(status, buf + i, 0);
+	if (message_length < 0)
+		return (1);
+
+	/* Status byte is already accounted for. */
+	return (i + message_length - 1 <= buffer_length);
+}
+
+/**
+ * Finishes the track being parsed.  If "truncated" is nonzero, adds End Of Track
+ * metaevent, the same way parse_mtrk_events() does.  Returns 0 iff everything went OK.
+ */
+static int
+parser_finish_track(smf_parser_t *parser, int truncated)
+{
+	if (truncated) {
+		g_critical("Unable to parse MIDI event; truncating track.");
+		if (smf_track_add_eot_delta_pulses(parser->track, 0) != 0) {
+			g_critical("smf_track_add_eot_delta_pulses failed.");
+			return (-1);
+		}
+	}
+
+	parser->track = NULL;
+
+	return (0);
+}
+
+/**
+ * Parses as much of the "buf" as possible.  Returns number of bytes consumed, or value < 0 in case of error.
+ * Bytes that were not consumed form incomplete chunk header or event, and have to be passed again,
+ * together with the data that follows them.
+ */
+static int
+parser_parse_buffer(smf_parser_t *parser, const unsigned char *buf, const int buffer_length)
+{
+	int offset = 0, available, delta, len, chunk_length;
+	const struct chunk_header_struct *chunk;
+	smf_t *smf = parser->smf;
+	smf_event_t *event;
+
+	for (;;) {
+		available = buffer_length - offset;
+
+		switch (parser->state) {
+		case PARSER_EXPECTS_MTHD:
+			if (available < (int)sizeof(struct mthd_chunk_struct))
+				return (offset);
+
+			/* parse_mthd_chunk() looks at the beginning of smf->file_buffer. */
+			smf->file_buffer = (void *)(buf + offset);
+			smf->file_buffer_length = sizeof(struct mthd_chunk_struct);
+			smf->next_chunk_offset = 0;
+
+			if (parse_mthd_chunk(smf)) {
+				smf->file_buffer = NULL;
+				return (-1);
+			}
+
+			smf->file_buffer = NULL;
+			smf->file_buffer_length = 0;
+			smf->next_chunk_offset = -1;
+
+			offset += sizeof(struct mthd_chunk_struct);
+			parser->state = PARSER_EXPECTS_CHUNK_HEADER;
+			break;
+
+		case PARSER_EXPECTS_CHUNK_HEADER:
+			/* Anything following the last chunk is ignored, like in smf_load_from_memory(). */
+			if (parser->number_of_chunks == smf->expected_number_of_tracks) {
+				parser->state = PARSER_IS_DONE;
+				break;
+			}
+
+			if (available < (int)sizeof(struct chunk_header_struct))
+				return (offset);
+
+			chunk = (const struct chunk_header_struct *)(buf + offset);
+
+			/*
+			 * smf_load_from_memory() cannot find any more chunks after this one and returns
+			 * tracks loaded so far; do the same.
+			 */
+			if (!isalpha(chunk->id[0]) || !isalpha(chunk->id[1]) || !isalpha(chunk->id[2]) || !isalpha(chunk->id[3])) {
+				g_critical("SMF error: chunk signature contains at least one non-alphanumeric byte.");
+				parser->state = PARSER_IS_DONE;
+				break;
+			}
+
+			chunk_length = ntohl(chunk->length);
+			if (chunk_length < 0) {
+				g_critical("SMF error: chunk length %d is invalid.", chunk_length);
+				return (-3);
+			}
+
+			offset += sizeof(struct chunk_header_struct);
+			parser->number_of_chunks++;
+			parser->chunk_bytes_left = chunk_length;
+
+			if (!chunk_signature_matches(chunk, "MTrk")) {
+				g_warning("SMF warning: Expected MTrk signature, got %c%c%c%c instead; ignoring this chunk.",
+						chunk->id[0], chunk->id[1], chunk->id[2], chunk->id[3]);
+
+				parser->state = PARSER_SKIPS_CHUNK;
+				break;
+			}
+
+			parser->track = smf_track_new();
+			if (parser->track == NULL)
+				return (-4);
+
+			smf_add_track(smf, parser->track);
+			parser->state = PARSER_EXPECTS_EVENT;
+			break;
+
+		case PARSER_EXPECTS_EVENT:
+			/* Chunk ended without End Of Track? */
+			if (parser->chunk_bytes_left == 0) {
+				if (parser_finish_track(parser, 1))
+					return (-5);
+
+				parser->state = PARSER_EXPECTS_CHUNK_HEADER;
+				break;
+			}
+
+			if (available > parser->chunk_bytes_left)
+				available = parser->chunk_bytes_left;
+
+			/* Wait for the rest of the event, unless this is all that is left of the chunk. */
+			if (available < parser->chunk_bytes_left &&
+			    !event_is_complete(buf + offset, available, parser->track->last_status))
+				return (offset);
+
+			event = parse_event(parser->smf, buf + offset, available, parser->track->last_status, &delta, &len);
+
+			if (event == NULL) {
+				if (parser_finish_track(parser, 1))
+					return (-6);
+
+				parser->state = PARSER_SKIPS_CHUNK;
+				break;
+			}
+
+			parser->track->last_status = event->midi_buffer[0];
+			offset += len;
+			parser->chunk_bytes_left -= len;
+
+			/* Tempo map known so far is used; smf_parser_finish() recomputes it for the whole song. */
+			smf_track_add_event_delta_pulses(parser->track, event, delta);
+
+			if (event_is_end_of_track(event)) {
+				if (parser_finish_track(parser, 0))
+					return (-7);
+
+				parser->state = PARSER_SKIPS_CHUNK;
+			}
+			break;
+
+		case PARSER_SKIPS_CHUNK:
+			if (available > parser->chunk_bytes_left)
+				available = parser->chunk_bytes_left;
+
+			offset += available;
+			parser->chunk_bytes_left -= available;
+
+			if (parser->chunk_bytes_left > 0)
+				return (offset);
+
+			parser->state = PARSER_EXPECTS_CHUNK_HEADER;
+			break;
+
+		case PARSER_IS_DONE:
+			return (buffer_length);
+
+		default:
+			assert(!"Invalid parser state.");
+			return (-8);
+		}
+	}
+
+	/* Not reached. */
+}
+
+/**
+ * Appends "buffer_length" bytes from "buffer" to parser->pending_buffer, growing it as needed.
+ * Returns 0 iff everything went OK.
+ */
+static int
+parser_keep_pending(smf_parser_t *parser, const unsigned char *buffer, int buffer_length)
+{
+	int allocated;
+	unsigned char *tmp;
+
+	/* Nothing to keep; pending_buffer may not even be allocated yet, and memcpy(3) must not get NULL. */
+	if (buffer_length == 0)
+		return (0);
+
+	if (parser->pending_length + buffer_length > parser->pending_allocated) {
+		allocated = parser->pending_allocated > 0 ? parser->pending_allocated : 64;
+		while (allocated < parser->pending_length + buffer_length)
+			allocated *= 2;
+
+		tmp = realloc(parser->pending_buffer, allocated);
+		if (tmp == NULL) {
+			g_critical("Cannot allocate memory in smf_parser_feed(): %s", strerror(errno));
+			return (-1);
+		}
+
+		parser->pending_buffer = tmp;
+		parser->pending_allocated = allocated;
+	}
+
+	memcpy(parser->pending_buffer + parser->pending_length, buffer, buffer_length);
+	parser->pending_length += buffer_length;
+
+	return (0);
+}
+
+/**
+ * Allocates new smf_parser_t, used for loading SMF that arrives in pieces, e.g. from a pipe
+ * or a network connection.  Pass the data to smf_parser_feed() as it arrives, pick up complete
+ * events using smf_parser_get_next_event() and call smf_parser_finish() at the end of the data.
+ *
+ * \return pointer to smf_parser_t or NULL.
+ */
+smf_parser_t *
+smf_parser_new(void)
+{
+	smf_parser_t *parser = malloc(sizeof(smf_parser_t));
+	if (parser == NULL) {
+		g_critical("Cannot allocate smf_parser_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(parser, 0, sizeof(smf_parser_t));
+
+	parser->smf = smf_new();
+	if (parser->smf == NULL) {
+		free(parser);
+		return (NULL);
+	}
+
+	parser->state = PARSER_EXPECTS_MTHD;
+	parser->next_track_number = 1;
+	parser->next_event_number = 1;
+
+	return (parser);
+}
+
+/**
+ * Frees the parser, together with the smf it was building, unless it was already
+ * returned by smf_parser_finish().
+ */
+void
+smf_parser_delete(smf_parser_t *parser)
+{
+	if (parser->smf != NULL)
+		smf_delete(parser->smf);
+
+	free(parser->pending_buffer);
+
+	memset(parser, 0, sizeof(smf_parser_t));
+	free(parser);
+}
+
+/**
+ * Passes the next "buffer_length" bytes of SMF to the parser.  The data may be split at any point;
+ * incomplete chunk headers and events are kept until the rest of them arrives, so "buffer" does not
+ * need to remain valid after the call.  Complete events are added to parser->smf immediately.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.  After an error, the parser cannot be used
+ * for anything but smf_parser_delete().
+ */
+int
+smf_parser_feed(smf_parser_t *parser, const void *buffer, int buffer_length)
+{
+	int consumed;
+
+	assert(buffer_length >= 0);
+
+	if (parser->state == PARSER_FAILED) {
+		g_critical("smf_parser_feed: parser has already failed.");
+		return (-1);
+	}
+
+	/* Most of the time, there is nothing left from the previous call; parse in place. */
+	if (parser->pending_length == 0) {
+		consumed = parser_parse_buffer(parser, buffer, buffer_length);
+		if (consumed < 0)
+			goto error;
+
+		if (parser_keep_pending(parser, (const unsigned char *)buffer + consumed, buffer_length - consumed))
+			goto error;
+
+		return (0);
+	}
+
+	if (parser_keep_pending(parser, buffer, buffer_length))
+		goto error;
+
+	consumed = parser_parse_buffer(parser, parser->pending_buffer, parser->pending_length);
+	if (consumed < 0)
+		goto error;
+
+	memmove(parser->pending_buffer, parser->pending_buffer + consumed, parser->pending_length - consumed);
+	parser->pending_length -= consumed;
+
+	return (0);
+
+error:
+	parser->state = PARSER_FAILED;
+
+	return (-2);
+}
+
+/**
+ * Returns the next event parsed by smf_parser_feed(), in the order they appear in the file,
+ * that is, all the events of the first track, then of the second one and so on.  Last event
+ * of every track is End Of Track.  The event belongs to parser->smf; do not remove it or modify
+ * the smf before calling smf_parser_finish().  ->time_seconds is computed using tempo changes
+ * parsed so far.
+ *
+ * \return Event or NULL, if there are no more complete events yet.
+ */
+smf_event_t *
+smf_parser_get_next_event(smf_parser_t *parser)
+{
+	smf_track_t *track;
+	smf_event_t *event;
+
+	for (;;) {
+		track = smf_get_track_by_number(parser->smf, parser->next_track_number);
+		if (track == NULL)
+			return (NULL);
+
+		event = smf_track_get_event_by_number(track, parser->next_event_number);
+		if (event != NULL) {
+			parser->next_event_number++;
+			return (event);
+		}
+
+		/* The track is still being parsed. */
+		if (track == parser->track)
+			return (NULL);
+
+		parser->next_track_number++;
+		parser->next_event_number = 1;
+	}
+}
+
+/**
+ * Tells the parser there is no more data.  Truncated track is terminated with End Of Track,
+ * the same way smf_load_from_memory() does, tempo map and ->time_seconds of all the events are
+ * recomputed and the smf is rewound.  The parser is freed.
+ *
+ * \return SMF or NULL, if the data did not contain valid SMF.
+ */
+smf_t *
+smf_parser_finish(smf_parser_t *parser)
+{
+	smf_t *smf;
+
+	switch (parser->state) {
+	case PARSER_EXPECTS_MTHD:
+		g_critical("SMF error: file is too short, it cannot be a MIDI file.");
+		goto error;
+
+	case PARSER_FAILED:
+		goto error;
+
+	case PARSER_EXPECTS_EVENT:
+		g_critical("SMF warning: malformed chunk; truncated file?");
+		if (parser_finish_track(parser, 1))
+			goto error;
+		break;
+
+	default:
+		break;
+	}
+
+	smf = parser->smf;
+	parser->smf = NULL;
+	smf_parser_delete(parser);
+
+	if (smf->expected_number_of_tracks != smf->number_of_tracks) {
+		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
+				smf->expected_number_of_tracks, smf->number_of_tracks);
+
+		smf->expected_number_of_tracks = smf->number_of_tracks;
+	}
+
+	smf_create_tempo_map_and_compute_seconds(smf);
+	smf_rewind(smf);
+
+	return (smf);
+
+error:
+	smf_parser_delete(parser);
+
+	return (NULL);
+}
+
+/** State of a single track for smf_reader_t. */
+struct smf_reader_track_struct {
+	int			first_event_offset;
+	int			next_event_offset;
+	int			end_offset;
+	int			last_status;
+	int			finished;
+
+	/** Next event of this track, valid if has_next_event is nonzero. */
+	smf_event_view_t	next_event;
+	int			has_next_event;
+};
+
+/** Data of the End Of Track event made up for truncated tracks. */
+static const unsigned char end_of_track_data[2] = { 0x2F, 0x00 };
+
+/**
+ * Reads the next event of the reader track into track->next_event, the same way parse_next_event() would.
+ * Track ends after End Of Track.  If an event cannot be parsed, End Of Track is returned in its place,
+ * with zero delta time, like parse_mtrk_events() appends to truncated tracks.
+ */
+static void
+reader_track_read_event(const smf_reader_t *reader, struct smf_reader_track_struct *track)
+{
+	int delta, len, status, data_length;
+	const unsigned char *data;
+
+	track->has_next_event = 0;
+
+	if (track->finished)
+		return;
+
+	track->finished = 1;
+
+	if (track->next_event_offset >= track->end_offset)
+		goto truncated;
+
+	if (extract_vlq(reader->file_buffer + track->next_event_offset, track->end_offset - track->next_event_offset, &delta, &len))
+		goto truncated;
+
+	track->next_event_offset += len;
+
+	if (track->next_event_offset >= track->end_offset)
+		goto truncated;
+
+	if (locate_midi_event(reader->file_buffer + track->next_event_offset, track->end_offset - track->next_event_offset,
+		track->last_status, &status, &data, &data_length, &len))
+		goto truncated;
+
+	track->next_event_offset += len;
+	/* Running status continues from the first byte of the message, as in parse_next_event(). */
+	track->last_status = is_escape_byte(status) ? data[0] : status;
+
+	track->next_event.event_number++;
+	track->next_event.delta_time_pulses = delta;
+	track->next_event.time_pulses += delta;
+	track->next_event.status = status;
+	track->next_event.data = data;
+	track->next_event.data_length = data_length;
+	track->has_next_event = 1;
+
+	/* End Of Track? */
+	if (status != 0xFF || data_length < 1 || data[0] != 0x2F)
+		track->finished = 0;
+
+	return;
+
+truncated:
+	g_critical("Unable to parse MIDI event; truncating track.");
+
+	track->next_event.event_number++;
+	track->next_event.delta_time_pulses = 0;
+	track->next_event.status = 0xFF;
+	track->next_event.data = end_of_track_data;
+	track->next_event.data_length = sizeof(end_of_track_data);
+	track->has_next_event = 1;
+}
+
+/**
+ * Creates read-only cursor over SMF in "buffer".  Events are returned by smf_reader_get_next_event(),
+ * without parsing them into smf_event_t.  If "merge_tracks" is nonzero, events from all the tracks
+ * are returned in time order, just like smf_get_next_event() does; otherwise, all the events of the
+ * first track are returned, then of the second one and so on.  The buffer must remain valid until
+ * the reader is deleted using smf_reader_delete().
+ *
+ * \return Reader or NULL, if the buffer does not contain valid SMF.
+ */
+smf_reader_t *
+smf_reader_new(const void *buffer, const int buffer_length, int merge_tracks)
+{
+	int i;
+	smf_t smf;
+	struct chunk_header_struct *mtrk;
+	struct smf_reader_track_struct *track;
+	smf_reader_t *reader;
+
+	/* Chunk parsing routines work on smf_t; this one is never attached to anything. */
+	memset(&smf, 0, sizeof(smf_t));
+	smf.file_buffer = (void *)buffer;
+	smf.file_buffer_length = buffer_length;
+	smf.next_chunk_offset = 0;
+
+	if (parse_mthd_chunk(&smf))
+		return (NULL);
+
+	reader = malloc(sizeof(smf_reader_t));
+	if (reader == NULL) {
+		g_critical("Cannot allocate smf_reader_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(reader, 0, sizeof(smf_reader_t));
+
+	reader->tracks = calloc(smf.expected_number_of_tracks, sizeof(struct smf_reader_track_struct));
+	if (reader->tracks == NULL) {
+		g_critical("Cannot allocate memory in smf_reader_new(): %s", strerror(errno));
+		free(reader);
+		return (NULL);
+	}
+
+	reader->format = smf.format;
+	reader->ppqn = smf.ppqn;
+	reader->file_buffer = buffer;
+	reader->file_buffer_length = buffer_length;
+	reader->merge_tracks = merge_tracks;
+
+	/* Find MTrk chunks, skipping unparseable ones, the same way smf_load_from_memory() does. */
+	for (i = 1; i <= smf.expected_number_of_tracks; i++) {
+		mtrk = next_chunk(&smf);
+
+		if (mtrk == NULL || !chunk_signature_matches(mtrk, "MTrk")) {
+			g_warning("SMF warning: Cannot load track.");
+			continue;
+		}
+
+		track = reader->tracks + reader->number_of_tracks;
+		track->first_event_offset = (unsigned char *)mtrk - reader->file_buffer + sizeof(struct chunk_header_struct);
+		/* next_chunk() already complained if the chunk does not fit in the buffer. */
+		track->end_offset = smf.next_chunk_offset;
+		reader->number_of_tracks++;
+	}
+
+	if (smf.expected_number_of_tracks != reader->number_of_tracks) {
+		g_warning("SMF warning: MThd header declared %d tracks, but only %d found; continuing anyway.",
+				smf.expected_number_of_tracks, reader->number_of_tracks);
+	}
+
+	smf_reader_rewind(reader);
+
+	return (reader);
+}
+
+/**
+ * Frees the reader.  File buffer is not touched.
+ */
+void
+smf_reader_delete(smf_reader_t *reader)
+{
+	free(reader->tracks);
+
+	memset(reader, 0, sizeof(smf_reader_t));
+	free(reader);
+}
+
+/**
+ * Restarts reading from the first event of the song.
+ */
+void
+smf_reader_rewind(smf_reader_t *reader)
+{
+	int i;
+	struct smf_reader_track_struct *track;
+
+	for (i = 0; i < reader->number_of_tracks; i++) {
+		track = reader->tracks + i;
+
+		track->next_event_offset = track->first_event_offset;
+		track->last_status = 0;
+		track->finished = 0;
+
+		memset(&track->next_event, 0, sizeof(smf_event_view_t));
+		track->next_event.track_number = i + 1;
+
+		/* Every track has its first event read in advance, so that they can be merged. */
+		reader_track_read_event(reader, track);
+	}
+
+	reader->last_track_index = -1;
+}
+
+/**
+ * \return Next event or NULL, if there are none left.  Returned event is valid until the next call.
+ */
+const smf_event_view_t *
+smf_reader_get_next_event(smf_reader_t *reader)
+{
+	int i, next_track_index = -1;
+	struct smf_reader_track_struct *track;
+
+	/* Event returned the previous time is no longer needed; replace it with the next one from that track. */
+	if (reader->last_track_index >= 0)
+		reader_track_read_event(reader, reader->tracks + reader->last_track_index);
+
+	/* Tracks before the last one used are finished, unless merging. */
+	i = reader->merge_tracks || reader->last_track_index < 0 ? 0 : reader->last_track_index;
+
+	for (; i < reader->number_of_tracks; i++) {
+		track = reader->tracks + i;
+
+		if (!track->has_next_event)
+			continue;
+
+		if (!reader->merge_tracks) {
+			next_track_index = i;
+			break;
+		}
+
+		/* In case of a tie, earlier track goes first, like in smf_get_next_event(). */
+		if (next_track_index < 0 || track->next_event.time_pulses < reader->tracks[next_track_index].next_event.time_pulses)
+			next_track_index = i;
+	}
+
+	reader->last_track_index = next_track_index;
+
+	if (next_track_index < 0)
+		return (NULL);
+
+	track = reader->tracks + next_track_index;
+	track->has_next_event = 0;
+
+	return (&track->next_event);
+}
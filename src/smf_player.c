@@ -0,0 +1,549 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Real time playback: scheduler thread and lock-free handoff of events to the output thread.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/*
+ * Counters and positions shared by the scheduler thread and the other threads are accessed using these.
+ * C11 atomics, if the compiler has them; GCC and Clang builtins otherwise.  Without either, or without
+ * POSIX threads, there is no playback; smf_player_start() fails.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define SMF_ATOMIC(type)		_Atomic type
+#define load_acquire(p)			atomic_load_explicit((p), memory_order_acquire)
+#define load_relaxed(p)			atomic_load_explicit((p), memory_order_relaxed)
+#define store_release(p, value)		atomic_store_explicit((p), (value), memory_order_release)
+#define store_relaxed(p, value)		atomic_store_explicit((p), (value), memory_order_relaxed)
+#define HAVE_PLAYER_ATOMICS		1
+#elif defined(__GNUC__)
+#define SMF_ATOMIC(type)		type
+#define load_acquire(p)			__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define load_relaxed(p)			__atomic_load_n((p), __ATOMIC_RELAXED)
+#define store_release(p, value)		__atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#define store_relaxed(p, value)		__atomic_store_n((p), (value), __ATOMIC_RELAXED)
+#define HAVE_PLAYER_ATOMICS		1
+#endif
+
+#if defined(HAVE_PLAYER_ATOMICS) && !defined(__MINGW32__)
+#define PLAYER_IS_SUPPORTED		1
+#include <pthread.h>
+#endif
+
+/** Longest time the scheduler sleeps without checking whether smf_player_stop() was called, in nanoseconds. */
+#define STOP_CHECK_INTERVAL	10000000
+
+/** How long the scheduler waits for smf_player_drain() to make room in the full ring, in nanoseconds. */
+#define OVERRUN_WAIT		1000000
+
+struct smf_player_message_struct {
+	const smf_event_t	*event;
+	/** Time the event is due, in nanoseconds of CLOCK_MONOTONIC. */
+	int64_t			deadline;
+};
+
+#ifdef PLAYER_IS_SUPPORTED
+
+/** State shared by the scheduler thread, smf_player_drain() and the thread that controls the player. */
+struct smf_player_state_struct {
+	pthread_t		thread;
+	const smf_timeline_t	*timeline;
+	int			first_entry;
+	/** CLOCK_MONOTONIC time, in nanoseconds, that corresponds to the beginning of the song. */
+	int64_t			song_start;
+
+	/** Ring of events handed from the scheduler thread to smf_player_drain(). */
+	struct smf_player_message_struct	*messages;
+	unsigned int		ring_mask;
+	SMF_ATOMIC(unsigned int)	ring_head;
+	SMF_ATOMIC(unsigned int)	ring_tail;
+
+	/** Set by smf_player_stop() and by the scheduler thread, respectively. */
+	SMF_ATOMIC(int)		stop_requested;
+	SMF_ATOMIC(int)		scheduler_finished;
+
+	/** Times, in nanoseconds, summed up for smf_player_get_stats().  Scheduler statistics are written
+	    only by the scheduler thread, latency statistics only by smf_player_drain(). */
+	SMF_ATOMIC(int64_t)	number_of_scheduled_events;
+	SMF_ATOMIC(int64_t)	number_of_overruns;
+	SMF_ATOMIC(int64_t)	min_jitter;
+	SMF_ATOMIC(int64_t)	max_jitter;
+	SMF_ATOMIC(int64_t)	total_jitter;
+	SMF_ATOMIC(int64_t)	number_of_events;
+	SMF_ATOMIC(int64_t)	min_latency;
+	SMF_ATOMIC(int64_t)	max_latency;
+	SMF_ATOMIC(int64_t)	total_latency;
+
+	/** Nonzero after clock_nanosleep(3) failed; used only by the scheduler thread. */
+	int			clock_nanosleep_failed;
+};
+
+static int64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/**
+ * Sleeps until CLOCK_MONOTONIC reaches "deadline", using relative nanosleep(3).
+ */
+static void
+sleep_until_relative(int64_t deadline)
+{
+	int64_t remaining;
+	struct timespec ts;
+
+	/* Computed again after every interruption. */
+	while ((remaining = deadline - now()) > 0) {
+		ts.tv_sec = remaining / 1000000000;
+		ts.tv_nsec = remaining % 1000000000;
+
+		if (nanosleep(&ts, NULL) == 0)
+			break;
+	}
+}
+
+/**
+ * Sleeps until CLOCK_MONOTONIC reaches "deadline".  Called only by the scheduler thread.
+ */
+static void
+sleep_until(struct smf_player_state_struct *state, int64_t deadline)
+{
+#ifdef HAVE_CLOCK_NANOSLEEP
+	int error;
+	struct timespec ts;
+
+	if (!state->clock_nanosleep_failed) {
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+
+		while ((error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR)
+			;
+
+		if (error == 0)
+			return;
+
+		/* Otherwise the scheduler would spin instead of sleeping. */
+		g_warning("clock_nanosleep(3) failed: %s; using nanosleep(3) instead.", strerror(error));
+		state->clock_nanosleep_failed = 1;
+	}
+#else /* ! HAVE_CLOCK_NANOSLEEP */
+	/* E.g. on macOS. */
+	(void)state;
+#endif /* ! HAVE_CLOCK_NANOSLEEP */
+
+	sleep_until_relative(deadline);
+}
+
+/**
+ * Puts the message at the tail of the ring.  Called only by the scheduler thread.
+ * \return 0 if everything went ok, nonzero if the ring is full.
+ */
+static int
+ring_push(struct smf_player_state_struct *state, const smf_event_t *event, int64_t deadline)
+{
+	unsigned int tail = load_relaxed(&state->ring_tail), head = load_acquire(&state->ring_head);
+	struct smf_player_message_struct *message;
+
+	if (tail - head > state->ring_mask)
+		return (-1);
+
+	message = state->messages + (tail & state->ring_mask);
+	message->event = event;
+	message->deadline = deadline;
+
+	/* Make the message visible to smf_player_drain() only after it was written. */
+	store_release(&state->ring_tail, tail + 1);
+
+	return (0);
+}
+
+/** Only one thread writes each set of statistics, so plain read-modify-write is fine. */
+static void
+update_stats(SMF_ATOMIC(int64_t) *min, SMF_ATOMIC(int64_t) *max, SMF_ATOMIC(int64_t) *total,
+	SMF_ATOMIC(int64_t) *count, int64_t value)
+{
+	int64_t number = load_relaxed(count);
+
+	if (number == 0 || value < load_relaxed(min))
+		store_relaxed(min, value);
+
+	if (number == 0 || value > load_relaxed(max))
+		store_relaxed(max, value);
+
+	store_relaxed(total, load_relaxed(total) + value);
+	store_relaxed(count, number + 1);
+}
+
+static int
+stop_requested(struct smf_player_state_struct *state)
+{
+	return (load_acquire(&state->stop_requested));
+}
+
+/**
+ * Body of the scheduler thread.  Sleeps until the next event is due and puts it into the ring.
+ */
+static void *
+schedule_events(void *arg)
+{
+	struct smf_player_state_struct *state = arg;
+	const smf_timeline_t *timeline = state->timeline;
+	const smf_timeline_entry_t *entry;
+	int i;
+	int64_t deadline, woke_up;
+
+	for (i = state->first_entry; i < timeline->number_of_entries; i++) {
+		entry = timeline->entries + i;
+		deadline = state->song_start + entry->time_microseconds * 1000;
+
+		/* Sleep in slices, so that smf_player_stop() does not have to wait for the next event. */
+		for (;;) {
+			if (stop_requested(state))
+				goto out;
+
+			woke_up = now();
+			if (woke_up >= deadline)
+				break;
+
+			if (deadline - woke_up > STOP_CHECK_INTERVAL)
+				sleep_until(state, woke_up + STOP_CHECK_INTERVAL);
+			else
+				sleep_until(state, deadline);
+		}
+
+		update_stats(&state->min_jitter, &state->max_jitter, &state->total_jitter,
+			&state->number_of_scheduled_events, woke_up - deadline);
+
+		if (ring_push(state, entry->event, deadline)) {
+			store_relaxed(&state->number_of_overruns, load_relaxed(&state->number_of_overruns) + 1);
+
+			while (ring_push(state, entry->event, deadline)) {
+				if (stop_requested(state))
+					goto out;
+
+				sleep_until(state, now() + OVERRUN_WAIT);
+			}
+		}
+	}
+
+out:
+	store_release(&state->scheduler_finished, 1);
+
+	return (NULL);
+}
+
+#endif /* PLAYER_IS_SUPPORTED */
+
+/**
+ * Allocates new player for the smf.  "ring_length" is the number of events that can wait
+ * for smf_player_drain(); it gets rounded up to a power of two.  All the memory the player
+ * needs is allocated here, so that playback itself does not allocate anything.
+ *
+ * \return Player or NULL, if there was an error.
+ */
+smf_player_t *
+smf_player_new(smf_t *smf, int ring_length)
+{
+	unsigned int length = 1;
+	smf_player_t *player;
+
+	if (ring_length <= 0 || ring_length > (1 << 24)) {
+		g_critical("smf_player_new: invalid ring length %d.", ring_length);
+		return (NULL);
+	}
+
+	while (length < (unsigned int)ring_length)
+		length *= 2;
+
+	player = malloc(sizeof(smf_player_t));
+	if (player == NULL) {
+		g_critical("Cannot allocate smf_player_t structure: %s", strerror(errno));
+		return (NULL);
+	}
+
+	memset(player, 0, sizeof(smf_player_t));
+	player->smf = smf;
+
+#ifdef PLAYER_IS_SUPPORTED
+	player->state = malloc(sizeof(struct smf_player_state_struct));
+	if (player->state == NULL) {
+		g_critical("Cannot allocate memory for smf_player_t: %s", strerror(errno));
+		free(player);
+		return (NULL);
+	}
+
+	memset(player->state, 0, sizeof(struct smf_player_state_struct));
+	player->state->ring_mask = length - 1;
+	store_relaxed(&player->state->scheduler_finished, 1);
+
+	player->state->messages = malloc(length * sizeof(struct smf_player_message_struct));
+	if (player->state->messages == NULL) {
+		g_critical("Cannot allocate memory for smf_player_t: %s", strerror(errno));
+		smf_player_delete(player);
+		return (NULL);
+	}
+#endif /* PLAYER_IS_SUPPORTED */
+
+	return (player);
+}
+
+/**
+ * Stops the player, if it is running, and frees it.  Does not touch the smf.
+ */
+void
+smf_player_delete(smf_player_t *player)
+{
+	smf_player_stop(player);
+
+#ifdef PLAYER_IS_SUPPORTED
+	if (player->state != NULL)
+		free(player->state->messages);
+#endif /* PLAYER_IS_SUPPORTED */
+	free(player->state);
+
+	memset(player, 0, sizeof(smf_player_t));
+	free(player);
+}
+
+/**
+ * Starts playback from "seconds": starts the scheduler thread, which, from now on, puts the events
+ * into the ring at the time they are due.  Events, including metadata, are passed in the order
+ * smf_get_next_event() would return them.  To restore the channel state first,
+ * send the messages from smf_chase_get_messages() before calling this.
+ *
+ * The scheduler thread goes through the timeline of the smf (see smf_build_timeline()) and passes
+ * pointers to its events, so the song must not be changed, and none of its events freed, until
+ * smf_player_stop() returns and smf_player_drain() took everything from the ring: any change makes
+ * the next smf_build_timeline() - e.g. from smf_chase_seek_to_seconds() - free the entries the thread
+ * is using.  Other players, cursors and chases on the same, unchanged smf are fine.
+ *
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_player_start(smf_player_t *player, double seconds)
+{
+#ifdef PLAYER_IS_SUPPORTED
+	int error, low, high, middle;
+	const smf_timeline_t *timeline;
+	struct smf_player_state_struct *state = player->state;
+
+	if (player->is_running) {
+		g_critical("smf_player_start: player is already running.");
+		return (-1);
+	}
+
+	if (seconds < 0.0) {
+		g_critical("smf_player_start: negative time.");
+		return (-2);
+	}
+
+	timeline = smf_build_timeline(player->smf);
+	if (timeline == NULL)
+		return (-3);
+
+	/* Find the first event that happens at "seconds" or later. */
+	low = 0;
+	high = timeline->number_of_entries;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (timeline->entries[middle].event->time_seconds < seconds)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	/* The ring is left alone; smf_player_drain() may still be taking events that were put there earlier. */
+	store_relaxed(&state->stop_requested, 0);
+	store_release(&state->scheduler_finished, 0);
+
+	state->timeline = timeline;
+	state->first_entry = low;
+	state->song_start = now() - (int64_t)(seconds * 1000000000.0);
+
+	error = pthread_create(&state->thread, NULL, schedule_events, state);
+	if (error) {
+		/* There is no thread that would ever set it. */
+		store_release(&state->scheduler_finished, 1);
+		g_critical("pthread_create(3) failed: %s", strerror(error));
+		return (-4);
+	}
+
+	player->is_running = 1;
+
+	return (0);
+#else /* ! PLAYER_IS_SUPPORTED */
+	(void)player;
+	(void)seconds;
+
+	g_critical("smf_player_start: real time playback is not supported on this platform.");
+
+	return (-1);
+#endif /* ! PLAYER_IS_SUPPORTED */
+}
+
+/**
+ * Stops the scheduler thread and waits for it to exit.  Events that are already in the ring
+ * can still be taken using smf_player_drain().
+ */
+void
+smf_player_stop(smf_player_t *player)
+{
+	if (!player->is_running)
+		return;
+
+#ifdef PLAYER_IS_SUPPORTED
+	store_release(&player->state->stop_requested, 1);
+	pthread_join(player->state->thread, NULL);
+#endif /* PLAYER_IS_SUPPORTED */
+
+	player->is_running = 0;
+}
+
+/**
+ * Passes all the events that are due, in the order they are due, to "callback".  Meant to be called
+ * periodically from the real time output thread: it does not lock, allocate or make system calls other
+ * than reading the clock.  Only one thread at a time may call it.
+ *
+ * \return Number of events passed to the callback.
+ */
+int
+smf_player_drain(smf_player_t *player, void (*callback)(const smf_event_t *event, void *user_data), void *user_data)
+{
+#ifdef PLAYER_IS_SUPPORTED
+	struct smf_player_state_struct *state = player->state;
+	int number_of_events = 0;
+	unsigned int head = load_relaxed(&state->ring_head), tail = load_acquire(&state->ring_tail);
+	int64_t drained;
+	struct smf_player_message_struct *message;
+
+	if (head == tail)
+		return (0);
+
+	drained = now();
+
+	for (; head != tail; head++) {
+		message = state->messages + (head & state->ring_mask);
+
+		update_stats(&state->min_latency, &state->max_latency, &state->total_latency,
+			&state->number_of_events, drained - message->deadline);
+
+		callback(message->event, user_data);
+		number_of_events++;
+	}
+
+	/* Give the slots back to the scheduler only after the messages were read. */
+	store_release(&state->ring_head, head);
+
+	return (number_of_events);
+#else /* ! PLAYER_IS_SUPPORTED */
+	(void)player;
+	(void)callback;
+	(void)user_data;
+
+	return (0);
+#endif /* ! PLAYER_IS_SUPPORTED */
+}
+
+/**
+ * \return Nonzero if the scheduler thread got to the end of the song, or was stopped, and all the events
+ * were taken by smf_player_drain().
+ */
+int
+smf_player_is_finished(const smf_player_t *player)
+{
+#ifdef PLAYER_IS_SUPPORTED
+	struct smf_player_state_struct *state = player->state;
+
+	if (!load_acquire(&state->scheduler_finished))
+		return (0);
+
+	return (load_acquire(&state->ring_head) == load_acquire(&state->ring_tail));
+#else /* ! PLAYER_IS_SUPPORTED */
+	(void)player;
+
+	return (1);
+#endif /* ! PLAYER_IS_SUPPORTED */
+}
+
+/**
+ * Fills "stats" with timing statistics of all the playback since smf_player_new().  Can be called from any thread at any time;
+ * while the player is running, values may be off by the last event or so.
+ */
+void
+smf_player_get_stats(const smf_player_t *player, smf_player_stats_t *stats)
+{
+#ifdef PLAYER_IS_SUPPORTED
+	struct smf_player_state_struct *state = player->state;
+	int64_t number_of_scheduled_events, number_of_events;
+#endif /* PLAYER_IS_SUPPORTED */
+
+	memset(stats, 0, sizeof(smf_player_stats_t));
+
+#ifdef PLAYER_IS_SUPPORTED
+	number_of_scheduled_events = load_relaxed(&state->number_of_scheduled_events);
+	number_of_events = load_relaxed(&state->number_of_events);
+
+	stats->number_of_events = number_of_events;
+	stats->number_of_overruns = load_relaxed(&state->number_of_overruns);
+
+	if (number_of_scheduled_events > 0) {
+		stats->min_jitter_seconds = load_relaxed(&state->min_jitter) / 1000000000.0;
+		stats->max_jitter_seconds = load_relaxed(&state->max_jitter) / 1000000000.0;
+		stats->mean_jitter_seconds = load_relaxed(&state->total_jitter) /
+			(number_of_scheduled_events * 1000000000.0);
+	}
+
+	if (number_of_events > 0) {
+		stats->min_latency_seconds = load_relaxed(&state->min_latency) / 1000000000.0;
+		stats->max_latency_seconds = load_relaxed(&state->max_latency) / 1000000000.0;
+		stats->mean_latency_seconds = load_relaxed(&state->total_latency) /
+			(number_of_events * 1000000000.0);
+	}
+#else /* ! PLAYER_IS_SUPPORTED */
+	(void)player;
+#endif /* ! PLAYER_IS_SUPPORTED */
+}
@@ -70,14 +70,67 @@ struct mthd_chunk_struct {
 #endif
 
 void smf_track_add_event(smf_track_t *track, smf_event_t *event);
+int smf_event_allocate_midi_buffer(smf_event_t *event, int len) WARN_UNUSED_RESULT;
+void smf_track_append_event_delta_pulses(smf_track_t *track, smf_event_t *event, int delta);
+void smf_track_compute_seconds(smf_track_t *track);
+void smf_compute_seconds_of_events(smf_t *smf, smf_event_t **events, int number_of_events);
+void smf_update_tempo_map_if_stale(smf_t *smf);
+void smf_track_parse_pending_events(smf_track_t *track);
+smf_track_t *smf_peek_track_by_number(const smf_t *smf, int track_number) WARN_UNUSED_RESULT;
+void smf_release_lazy_buffer(smf_t *smf);
 void smf_init_tempo(smf_t *smf);
 void smf_fini_tempo(smf_t *smf);
+int smf_copy_tempo_map(smf_t *destination, const smf_t *source) WARN_UNUSED_RESULT;
 void smf_create_tempo_map_and_compute_seconds(smf_t *smf);
 void maybe_add_to_tempo_map(smf_event_t *event);
+void maybe_add_buffer_to_tempo_map(smf_t *smf, int pulses, const unsigned char *midi_buffer, int midi_buffer_length);
 void remove_last_tempo_with_pulses(smf_t *smf, int pulses);
 int smf_event_is_tempo_change_or_time_signature(const smf_event_t *event) WARN_UNUSED_RESULT;
 int smf_event_length_is_valid(const smf_event_t *event) WARN_UNUSED_RESULT;
 int is_status_byte(const unsigned char status) WARN_UNUSED_RESULT;
+int expected_message_length(unsigned char status, const unsigned char *second_byte, const int buffer_length) WARN_UNUSED_RESULT;
+int extract_vlq(const unsigned char *buf, const int buffer_length, int *value, int *len);
+int format_vlq(unsigned char *buf, int length, unsigned long value) WARN_UNUSED_RESULT;
+smf_event_t *smf_event_new_from_arena(struct smf_arena_struct *arena) WARN_UNUSED_RESULT;
+void smf_track_insert_event(smf_track_t *track, smf_event_t *event, int event_number);
+void smf_insert_track(smf_t *smf, smf_track_t *track, int track_number);
+int smf_track_find_event_by_pulses(const smf_track_t *track, int pulses, int after) WARN_UNUSED_RESULT;
+int smf_track_find_event_by_seconds(const smf_track_t *track, double seconds) WARN_UNUSED_RESULT;
+void smf_track_set_position(const smf_track_t *track, int event_number, int *next_event_number, int *time_of_next_event);
+
+/** Entry of a heap of tracks ordered by time of their next event; see smf_get_next_event() and smf_cursor_new(). */
+struct smf_heap_entry_struct {
+	int	time_of_next_event;
+	int	track_number;
+	/** smf_track_t, or, for cursors, position of the cursor in that track. */
+	void	*position;
+};
+
+typedef struct smf_heap_entry_struct smf_heap_entry_t;
+
+void smf_heap_sift_down(smf_heap_entry_t *heap, int heap_length, int i);
+void smf_heap_build(smf_heap_entry_t *heap, int heap_length);
+int smf_heap_update_first(smf_heap_entry_t *heap, int heap_length, int next_event_number, int time_of_next_event) WARN_UNUSED_RESULT;
+
+/* Kinds of changes recorded by smf_journal.c. */
+#define SMF_JOURNAL_EVENT_ADDED		1
+#define SMF_JOURNAL_EVENT_REMOVED	2
+#define SMF_JOURNAL_EVENT_CHANGED	3
+#define SMF_JOURNAL_TRACK_ADDED		4
+#define SMF_JOURNAL_TRACK_REMOVED	5
+
+void smf_journal_record_event(smf_t *smf, int type, int track_number, int event_number, const smf_event_t *event);
+void smf_journal_record_track(smf_t *smf, int type, int track_number);
+
+void smf_delete_timeline(smf_t *smf);
+
+struct smf_arena_struct *smf_arena_new(void) WARN_UNUSED_RESULT;
+void smf_arena_delete(struct smf_arena_struct *arena);
+void *smf_arena_alloc(struct smf_arena_struct *arena, int size) WARN_UNUSED_RESULT;
+smf_event_t *smf_arena_alloc_event(struct smf_arena_struct *arena) WARN_UNUSED_RESULT;
+void smf_arena_free_event(struct smf_arena_struct *arena, smf_event_t *event);
+smf_tempo_t *smf_arena_alloc_tempo(struct smf_arena_struct *arena) WARN_UNUSED_RESULT;
+void smf_arena_free_tempo(struct smf_arena_struct *arena, smf_tempo_t *tempo);
 
 #endif /* SMF_PRIVATE_H */
 
@@ -47,7 +47,9 @@
 #include "smf.h"
 #include "smf_private.h"
 
-#define MAX_VLQ_LENGTH 128
+/* SMF allows at most four bytes, which is enough for 0x0FFFFFFF. */
+#define MAX_VLQ_LENGTH 4
+#define MAX_VLQ_VALUE 0x0FFFFFFF
 
 /**
  * Extends (reallocates) smf->file_buffer and returns pointer to the newly added space,
@@ -160,54 +162,66 @@ track_append(smf_track_t *track, const void *buffer, const int buffer_length)
 	return (0);
 }
 
-static int
+/**
+ * Writes "value" as Variable Length Quantity into "buf", which has room for "length" bytes.
+ * Returns number of bytes written, or value < 0 if the value is too big.
+ */
+int
 format_vlq(unsigned char *buf, int length, unsigned long value)
 {
-	int i;
-	unsigned long buffer;
+	int i, vlq_length;
 
-	/* Taken from http://www.borg.com/~jglatt/tech/midifile/vari.htm */
-	buffer = value & 0x7F;
-
-	while ((value >>= 7)) {
-		buffer <<= 8;
-		buffer |= ((value & 0x7F) | 0x80);
+	/* Most of delta times fit in one or two bytes; handle these without looping. */
+	if (value < 0x80 && length >= 1) {
+		buf[0] = value;
+		return (1);
 	}
 
-	for (i = 0;; i++) {
-		buf[i] = buffer;
+	if (value < 0x4000 && length >= 2) {
+		buf[0] = (value >> 7) | 0x80;
+		buf[1] = value & 0x7F;
+		return (2);
+	}
 
-		if (buffer & 0x80)
-			buffer >>= 8;
-		else
-			break;
+	if (value > MAX_VLQ_VALUE) {
+		g_critical("SMF error: value %lu is too big to be stored as Variable Length Quantity.", value);
+		return (-1);
 	}
 
-	assert(i <= length);
+	vlq_length = value < 0x80 ? 1 : value < 0x4000 ? 2 : value < 0x200000 ? 3 : 4;
+
+	assert(vlq_length <= length);
+
+	/* Seven bits per byte, most significant first; all the bytes but the last one have MSB set. */
+	for (i = vlq_length - 1; i >= 0; i--) {
+		buf[i] = (value & 0x7F) | (i == vlq_length - 1 ? 0 : 0x80);
+		value >>= 7;
+	}
 
-	/* + 1, because "i" is an offset, not a count. */
-	return (i + 1);
+	return (vlq_length);
 }
 
 smf_event_t *
 smf_event_new_textual(int type, const char *text)
 {
-	int vlq_length, text_length, copied_length;
+	int vlq_length, text_length;
+	unsigned char vlq[MAX_VLQ_LENGTH];
 	smf_event_t *event;
 
 	assert(type >= 1 && type <= 9);
 
 	text_length = strlen(text);
 
+	vlq_length = format_vlq(vlq, MAX_VLQ_LENGTH, text_length);
+	if (vlq_length < 0)
+		return (NULL);
+
 	event = smf_event_new();
 	if (event == NULL)
 		return (NULL);
 
 	/* "2 +" is for leading 0xFF 0xtype. */
-	event->midi_buffer_length = 2 + text_length + MAX_VLQ_LENGTH;
-	event->midi_buffer = malloc(event->midi_buffer_length);
-	if (event->midi_buffer == NULL) {
-		g_critical("Cannot allocate MIDI buffer structure: %s", strerror(errno));
+	if (smf_event_allocate_midi_buffer(event, 2 + vlq_length + text_length)) {
 		smf_event_delete(event);
 
 		return (NULL); 
@@ -216,12 +230,8 @@ smf_event_new_textual(int type, const char *text)
 	event->midi_buffer[0] = 0xFF;
 	event->midi_buffer[1] = type;
 
-	vlq_length = format_vlq(event->midi_buffer + 2, MAX_VLQ_LENGTH - 2, text_length);
-	copied_length = snprintf((char *)event->midi_buffer + vlq_length + 2, event->midi_buffer_length - vlq_length - 2, "%s", text);
-
-	assert(copied_length == text_length);
-
-	event->midi_buffer_length = 2 + vlq_length + text_length;
+	memcpy(event->midi_buffer + 2, vlq, vlq_length);
+	memcpy(event->midi_buffer + 2 + vlq_length, text, text_length);
 
 	return event;
 }
@@ -236,6 +246,8 @@ write_vlq(smf_event_t *event, unsigned long value)
 	int vlq_length;
 
 	vlq_length = format_vlq(buf, MAX_VLQ_LENGTH, value);
+	if (vlq_length < 0)
+		return (-1);
 
 	return (track_append(event->track, buf, vlq_length));
 }
@@ -371,15 +383,15 @@ write_mtrk_length(smf_track_t *track)
 static int
 write_track(smf_track_t *track)
 {
-	int ret;
-	smf_event_t *event;
+	int ret, i;
 
 	ret = write_mtrk_header(track);
 	if (ret)
 		return (ret);
 
-	while ((event = smf_track_get_next_event(track)) != NULL) {
-		ret = write_event(event);
+	/* Events are taken by number, so that saving does not move the song position. */
+	for (i = 1; i <= track->number_of_events; i++) {
+		ret = write_event(smf_track_get_event_by_number(track, i));
 		if (ret)
 			return (ret);
 	}
@@ -561,7 +573,8 @@ assert_smf_event_is_identical(const smf_event_t *a, const smf_event_t *b)
 	assert(a->delta_time_pulses == b->delta_time_pulses);
 	assert(abs(a->time_pulses - b->time_pulses) <= 2);
 	assert(fabs(a->time_seconds - b->time_seconds) <= 0.01);
-	assert(a->track_number == b->track_number);
+	assert(llabs(a->time_microseconds - b->time_microseconds) <= 10000);
+	assert(a->track->track_number == b->track->track_number);
 	assert(a->midi_buffer_length == b->midi_buffer_length);
 	assert(memcmp(a->midi_buffer, b->midi_buffer, a->midi_buffer_length) == 0);
 }
@@ -579,7 +592,7 @@ assert_smf_track_is_identical(const smf_track_t *a, const smf_track_t *b)
 }
 
 static void
-assert_smf_is_identical(const smf_t *a, const smf_t *b)
+assert_smf_is_identical(smf_t *a, smf_t *b)
 {
 	int i;
 
@@ -596,7 +609,7 @@ assert_smf_is_identical(const smf_t *a, const smf_t *b)
 }
 
 static void
-assert_smf_saved_correctly(const smf_t *smf, const char *file_name)
+assert_smf_saved_correctly(smf_t *smf, const char *file_name)
 {
 	smf_t *saved;
 
@@ -622,8 +635,6 @@ smf_save(smf_t *smf, const char *file_name)
 	int i, error;
 	smf_track_t *track;
 
-	smf_rewind(smf);
-
 	assert(pointers_are_clear(smf));
 
 	if (smf_validate(smf))
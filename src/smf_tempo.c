@@ -42,6 +42,40 @@
 static double seconds_from_pulses(const smf_t *smf, int pulses);
 static int64_t microseconds_from_pulses(const smf_t *smf, int pulses);
 
+/**
+ * Allocates uninitialized smf_tempo_t, from the arena, if "smf" has one.
+ */
+static smf_tempo_t *
+alloc_tempo(smf_t *smf)
+{
+	smf_tempo_t *tempo;
+
+	if (smf->arena != NULL)
+		tempo = smf_arena_alloc_tempo(smf->arena);
+	else
+		tempo = malloc(sizeof(smf_tempo_t));
+
+	if (tempo == NULL)
+		g_critical("Cannot allocate smf_tempo_t.");
+
+	return (tempo);
+}
+
+/**
+ * Frees tempo allocated by alloc_tempo().
+ */
+static void
+free_tempo(smf_t *smf, smf_tempo_t *tempo)
+{
+	if (smf->arena != NULL) {
+		smf_arena_free_tempo(smf->arena, tempo);
+		return;
+	}
+
+	memset(tempo, 0, sizeof(smf_tempo_t));
+	free(tempo);
+}
+
 /**
  * If there is tempo starting at "pulses" already, return it.  Otherwise,
  * allocate new one, fill it with values from previous one (or default ones,
@@ -60,11 +94,9 @@ new_tempo(smf_t *smf, int pulses)
 			return (previous_tempo);
 	}
 
-	tempo = malloc(sizeof(smf_tempo_t));
-	if (tempo == NULL) {
-		g_critical("Cannot allocate smf_tempo_t.");
+	tempo = alloc_tempo(smf);
+	if (tempo == NULL)
 		return (NULL);
-	}
 
 	tempo->time_pulses = pulses;
 
@@ -138,32 +170,57 @@ maybe_add_to_tempo_map(smf_event_t *event)
 	assert(event->track->smf != NULL);
 	assert(event->midi_buffer_length >= 1);
 
+	maybe_add_buffer_to_tempo_map(event->track->smf, event->time_pulses, event->midi_buffer, event->midi_buffer_length);
+}
+
+/**
+ * \internal
+ *
+ * Same as maybe_add_to_tempo_map(), but takes MIDI message that happens at "pulses"
+ * instead of an event attached to a track.  Used for building tempo map straight
+ * from the file buffer.
+ */
+void
+maybe_add_buffer_to_tempo_map(smf_t *smf, int pulses, const unsigned char *midi_buffer, int midi_buffer_length)
+{
+	assert(midi_buffer_length >= 1);
+
+	if (midi_buffer[0] != 0xFF)
+		return;
+
 	/* Tempo Change? */
-	if (event->midi_buffer[1] == 0x51) {
-		int new_tempo = (event->midi_buffer[3] << 16) + (event->midi_buffer[4] << 8) + event->midi_buffer[5];
+	if (midi_buffer[1] == 0x51) {
+		int new_tempo;
+
+		if (midi_buffer_length < 6) {
+			g_critical("Tempo Change event seems truncated.");
+			return;
+		}
+
+		new_tempo = (midi_buffer[3] << 16) + (midi_buffer[4] << 8) + midi_buffer[5];
 		if (new_tempo <= 0) {
 			g_critical("Ignoring invalid tempo change.");
 			return;
 		}
 
-		add_tempo(event->track->smf, event->time_pulses, new_tempo);
+		add_tempo(smf, pulses, new_tempo);
 	}
 
 	/* Time Signature? */
-	if (event->midi_buffer[1] == 0x58) {
+	if (midi_buffer[1] == 0x58) {
 		int numerator, denominator, clocks_per_click, notes_per_note;
 
-		if (event->midi_buffer_length < 7) {
+		if (midi_buffer_length < 7) {
 			g_critical("Time Signature event seems truncated.");
 			return;
 		}
 
-		numerator = event->midi_buffer[3];
-		denominator = (int)pow(2, event->midi_buffer[4]);
-		clocks_per_click = event->midi_buffer[5];
-		notes_per_note = event->midi_buffer[6];
+		numerator = midi_buffer[3];
+		denominator = (int)pow(2, midi_buffer[4]);
+		clocks_per_click = midi_buffer[5];
+		notes_per_note = midi_buffer[6];
 
-		add_time_signature(event->track->smf, event->time_pulses, numerator, denominator, clocks_per_click, notes_per_note);
+		add_time_signature(smf, pulses, numerator, denominator, clocks_per_click, notes_per_note);
 	}
 
 	return;
@@ -194,42 +251,63 @@ remove_last_tempo_with_pulses(smf_t *smf, int pulses)
 	if (tempo->time_pulses != pulses)
 		return;
 
-	memset(tempo, 0, sizeof(smf_tempo_t));
-	free(tempo);
+	/* Tempo map must not become empty; recreate it, with the default tempo at the start. */
+	if (smf->tempo_array->len == 1) {
+		smf_create_tempo_map_and_compute_seconds(smf);
+		return;
+	}
+
+	free_tempo(smf, tempo);
 
 	g_ptr_array_remove_index(smf->tempo_array, smf->tempo_array->len - 1);
 }
 
+/**
+ * Computes ->time_seconds of something happening at "pulses", using "tempo",
+ * which has to be the tempo in effect at that time.
+ */
+static double
+seconds_from_tempo(const smf_t *smf, const smf_tempo_t *tempo, int pulses)
+{
+	assert(tempo->time_pulses <= pulses);
+
+	return (tempo->time_seconds + (double)(pulses - tempo->time_pulses) *
+		(tempo->microseconds_per_quarter_note / ((double)smf->ppqn * 1000000.0)));
+}
+
+static int64_t
+microseconds_from_tempo(const smf_t *smf, const smf_tempo_t *tempo, int pulses)
+{
+	assert(tempo->time_pulses <= pulses);
+
+	/*
+	 * Multiplied in 64 bits and rounded, so that long songs do not overflow and times do not
+	 * drift away from ->time_seconds by the truncated fraction of microseconds per pulse.
+	 */
+	return (tempo->time_microseconds + ((int64_t)(pulses - tempo->time_pulses) *
+		tempo->microseconds_per_quarter_note + smf->ppqn / 2) / smf->ppqn);
+}
+
 static double
 seconds_from_pulses(const smf_t *smf, int pulses)
 {
-	double seconds;
 	smf_tempo_t *tempo;
 
 	tempo = smf_get_tempo_by_pulses(smf, pulses);
 	assert(tempo);
-	assert(tempo->time_pulses <= pulses);
 
-	seconds = tempo->time_seconds + (double)(pulses - tempo->time_pulses) *
-		(tempo->microseconds_per_quarter_note / ((double)smf->ppqn * 1000000.0));
-
-	return (seconds);
+	return (seconds_from_tempo(smf, tempo, pulses));
 }
 
 static int64_t
 microseconds_from_pulses(const smf_t *smf, int pulses)
 {
-	int64_t microseconds;
 	smf_tempo_t *tempo;
 
 	tempo = smf_get_tempo_by_pulses(smf, pulses);
 	assert(tempo);
-	assert(tempo->time_pulses <= pulses);
 
-	microseconds = tempo->time_microseconds + (pulses - tempo->time_pulses) *
-		(tempo->microseconds_per_quarter_note / smf->ppqn);
-
-	return (microseconds);
+	return (microseconds_from_tempo(smf, tempo, pulses));
 }
 
 static int
@@ -248,33 +326,194 @@ pulses_from_seconds(const smf_t *smf, double seconds)
 	return (pulses);
 }
 
+/**
+ * Used for sorting tempo-related events into the order smf_get_next_event() would return them.
+ */
+static int
+tempo_events_compare_function(const void *aa, const void *bb)
+{
+	const smf_event_t *a = *(const smf_event_t **)aa, *b = *(const smf_event_t **)bb;
+
+	if (a->time_pulses != b->time_pulses)
+		return (a->time_pulses < b->time_pulses ? -1 : 1);
+
+	if (a->track->track_number != b->track->track_number)
+		return (a->track->track_number < b->track->track_number ? -1 : 1);
+
+	return (a->event_number < b->event_number ? -1 : (a->event_number > b->event_number));
+}
+
 /**
  * \internal
  *
- * Computes value of event->time_seconds for all events in smf.
- * Warning: rewinds the smf.
+ * Computes value of event->time_seconds for all events in smf.  Tempo-related events
+ * are collected from all the tracks and applied in time order, then every track is swept
+ * once against the resulting tempo map.  Unlike smf_get_next_event() based approach,
+ * this is linear in the number of events, and it does not change position in the smf.
+ *
+ * \bug This will abort (by calling g_error) if memory allocation fails.
  */
 void
 smf_create_tempo_map_and_compute_seconds(smf_t *smf)
 {
-	smf_event_t *event;
+	int i, j, number_of_tempo_events = 0, allocated = 0;
+	smf_track_t *track;
+	smf_event_t *event, **tempo_events = NULL, **tmp;
+
+	/* Inside smf_begin_edit()/smf_commit_edit(), just remember to do it later. */
+	if (smf->edit_depth > 0) {
+		smf->tempo_map_is_stale = 1;
+		return;
+	}
+
+	smf->tempo_map_is_stale = 0;
+	smf->generation++;
+
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
+		assert(track);
+
+		for (j = 1; j <= track->number_of_events; j++) {
+			event = smf_track_get_event_by_number(track, j);
+
+			if (!smf_event_is_tempo_change_or_time_signature(event))
+				continue;
+
+			if (number_of_tempo_events == allocated) {
+				allocated = allocated > 0 ? allocated * 2 : 16;
+				tmp = realloc(tempo_events, allocated * sizeof(smf_event_t *));
+				if (tmp == NULL) {
+					free(tempo_events);
+					g_error("Cannot allocate memory in smf_create_tempo_map_and_compute_seconds(), sorry.");
+					return;
+				}
+				tempo_events = tmp;
+			}
+
+			tempo_events[number_of_tempo_events++] = event;
+		}
+	}
+
+	/* Events on a single track are sorted already, but the tracks need merging. */
+	if (number_of_tempo_events > 1)
+		qsort(tempo_events, number_of_tempo_events, sizeof(smf_event_t *), tempo_events_compare_function);
 
-	smf_rewind(smf);
 	smf_init_tempo(smf);
 
-	for (;;) {
-		event = smf_get_next_event(smf);
-		
-		if (event == NULL)
-			return;
+	for (i = 0; i < number_of_tempo_events; i++)
+		maybe_add_to_tempo_map(tempo_events[i]);
+
+	free(tempo_events);
+
+	for (i = 1; i <= smf->number_of_tracks; i++)
+		smf_track_compute_seconds(smf_get_track_by_number(smf, i));
+}
+
+/**
+ * \internal
+ *
+ * Recomputes tempo map and ->time_seconds, if they were left out of date by edits made
+ * after smf_begin_edit().  Used by routines that cannot work without correct tempo map,
+ * e.g. the ones that convert seconds to pulses.
+ */
+void
+smf_update_tempo_map_if_stale(smf_t *smf)
+{
+	int edit_depth;
+
+	if (!smf->tempo_map_is_stale)
+		return;
+
+	edit_depth = smf->edit_depth;
+	smf->edit_depth = 0;
+	smf_create_tempo_map_and_compute_seconds(smf);
+	smf->edit_depth = edit_depth;
+}
+
+/**
+ * Starts a group of edits.  Until the matching smf_commit_edit(), adding or removing
+ * Tempo Change or Time Signature events does not recompute the tempo map and ->time_seconds
+ * of all the events; it is done once, at commit, instead of once per every such edit.
+ * Meanwhile, ->time_seconds of the events and tempo map lookups by pulses may be out of date.
+ * Routines that need seconds, such as smf_track_add_event_seconds() or smf_seek_to_seconds(),
+ * bring them up to date first.  Calls may be nested.  If undo is enabled, all the changes made
+ * until the outermost smf_commit_edit() are undone by a single smf_undo().
+ */
+void
+smf_begin_edit(smf_t *smf)
+{
+	assert(smf->edit_depth >= 0);
+
+	if (smf->edit_depth == 0)
+		smf->edit_number++;
+
+	smf->edit_depth++;
+}
+
+/**
+ * Ends a group of edits started with smf_begin_edit().  When the outermost group ends,
+ * tempo map and ->time_seconds of all the events are recomputed, if needed.
+ */
+void
+smf_commit_edit(smf_t *smf)
+{
+	if (smf->edit_depth <= 0) {
+		g_critical("smf_commit_edit: no edit in progress.");
+		return;
+	}
+
+	smf->edit_depth--;
+
+	if (smf->edit_depth == 0 && smf->tempo_map_is_stale)
+		smf_create_tempo_map_and_compute_seconds(smf);
+}
+
+/**
+ * \internal
+ *
+ * Computes ->time_seconds of "number_of_events" events, sorted by ->time_pulses, using existing
+ * tempo map.  This walks the events and the tempo map side by side, instead of looking up tempo
+ * for every event separately.  Results are the same as from seconds_from_pulses().
+ */
+void
+smf_compute_seconds_of_events(smf_t *smf, smf_event_t **events, int number_of_events)
+{
+	int i, tempo_number = 0;
+	smf_tempo_t *tempo, *next_tempo;
+	smf_event_t *event;
+
+	assert(smf->tempo_array->len > 0);
 
-		maybe_add_to_tempo_map(event);
+	smf->generation++;
 
-		event->time_seconds = seconds_from_pulses(smf, event->time_pulses);
-		event->time_microseconds = microseconds_from_pulses(smf, event->time_pulses);
+	tempo = smf_get_tempo_by_number(smf, 0);
+
+	for (i = 0; i < number_of_events; i++) {
+		event = events[i];
+
+		/* Same rule as in smf_get_tempo_by_pulses(): last tempo that starts before the event. */
+		while ((next_tempo = smf_get_tempo_by_number(smf, tempo_number + 1)) != NULL &&
+		    next_tempo->time_pulses < event->time_pulses) {
+			tempo = next_tempo;
+			tempo_number++;
+		}
+
+		event->time_seconds = seconds_from_tempo(smf, tempo, event->time_pulses);
+		event->time_microseconds = microseconds_from_tempo(smf, tempo, event->time_pulses);
 	}
+}
 
-	/* Not reached. */
+/**
+ * \internal
+ *
+ * Computes ->time_seconds of all the events in the track, using existing tempo map.
+ */
+void
+smf_track_compute_seconds(smf_track_t *track)
+{
+	assert(track->smf != NULL);
+
+	smf_compute_seconds_of_events(track->smf, (smf_event_t **)track->events_array->pdata, track->number_of_events);
 }
 
 smf_tempo_t *
@@ -290,11 +529,12 @@ smf_get_tempo_by_number(const smf_t *smf, int number)
 
 /**
  * Return last tempo (i.e. tempo with greatest time_pulses) that happens before "pulses".
+ * Tempo map is sorted by time, so this uses binary search.
  */
 smf_tempo_t *
 smf_get_tempo_by_pulses(const smf_t *smf, int pulses)
 {
-	int i;
+	int low, high, middle;
 	smf_tempo_t *tempo;
 
 	assert(pulses >= 0);
@@ -303,25 +543,36 @@ smf_get_tempo_by_pulses(const smf_t *smf, int pulses)
 		return (smf_get_tempo_by_number(smf, 0));
 
 	assert(smf->tempo_array != NULL);
-	
-	for (i = smf->tempo_array->len - 1; i >= 0; i--) {
-		tempo = smf_get_tempo_by_number(smf, i);
+
+	/* Find the first tempo that does not start before "pulses"; the one preceding it is the answer. */
+	low = 0;
+	high = smf->tempo_array->len;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		tempo = smf_get_tempo_by_number(smf, middle);
 
 		assert(tempo);
 		if (tempo->time_pulses < pulses)
-			return (tempo);
+			low = middle + 1;
+		else
+			high = middle;
 	}
 
-	return (NULL);
+	if (low == 0)
+		return (NULL);
+
+	return (smf_get_tempo_by_number(smf, low - 1));
 }
 
 /**
  * Return last tempo (i.e. tempo with greatest time_seconds) that happens before "seconds".
+ * Tempo map is sorted by time, so this uses binary search.
  */
 smf_tempo_t *
 smf_get_tempo_by_seconds(const smf_t *smf, double seconds)
 {
-	int i;
+	int low, high, middle;
 	smf_tempo_t *tempo;
 
 	assert(seconds >= 0.0);
@@ -330,16 +581,25 @@ smf_get_tempo_by_seconds(const smf_t *smf, double seconds)
 		return (smf_get_tempo_by_number(smf, 0));
 
 	assert(smf->tempo_array != NULL);
-	
-	for (i = smf->tempo_array->len - 1; i >= 0; i--) {
-		tempo = smf_get_tempo_by_number(smf, i);
+
+	low = 0;
+	high = smf->tempo_array->len;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		tempo = smf_get_tempo_by_number(smf, middle);
 
 		assert(tempo);
 		if (tempo->time_seconds < seconds)
-			return (tempo);
+			low = middle + 1;
+		else
+			high = middle;
 	}
 
-	return (NULL);
+	if (low == 0)
+		return (NULL);
+
+	return (smf_get_tempo_by_number(smf, low - 1));
 }
 
 
@@ -371,8 +631,7 @@ smf_fini_tempo(smf_t *smf)
 		tempo = g_ptr_array_index(smf->tempo_array, smf->tempo_array->len - 1);
 		assert(tempo);
 
-		memset(tempo, 0, sizeof(smf_tempo_t));
-		free(tempo);
+		free_tempo(smf, tempo);
 
 		g_ptr_array_remove_index(smf->tempo_array, smf->tempo_array->len - 1);
 	}
@@ -380,6 +639,32 @@ smf_fini_tempo(smf_t *smf)
 	assert(smf->tempo_array->len == 0);
 }
 
+/**
+ * \internal
+ *
+ * Replaces tempo map of "destination" with a copy of the one of "source", without recomputing anything.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+int
+smf_copy_tempo_map(smf_t *destination, const smf_t *source)
+{
+	int i;
+	smf_tempo_t *tempo;
+
+	smf_fini_tempo(destination);
+
+	for (i = 0; i < source->tempo_array->len; i++) {
+		tempo = alloc_tempo(destination);
+		if (tempo == NULL)
+			return (-1);
+
+		memcpy(tempo, g_ptr_array_index(source->tempo_array, i), sizeof(smf_tempo_t));
+		g_ptr_array_add(destination->tempo_array, tempo);
+	}
+
+	return (0);
+}
+
 /**
  * \internal
  *
@@ -466,6 +751,8 @@ smf_track_add_event_seconds(smf_track_t *track, smf_event_t *event, double secon
 	assert(event->time_seconds == -1.0);
 	assert(track->smf != NULL);
 
+	smf_update_tempo_map_if_stale(track->smf);
+
 	event->time_seconds = seconds;
 	event->time_microseconds = event->time_seconds * 1000000;
 	event->time_pulses = pulses_from_seconds(track->smf, seconds);
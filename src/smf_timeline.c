@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Events of the whole song merged into a single array, for fast iteration.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "smf.h"
+#include "smf_private.h"
+
+/**
+ * Merges two adjacent runs of entries, sorted by time, [first, middle) and [middle, last), from "source"
+ * into "destination".  On equal times, entries from the first run go first.
+ */
+static void
+merge_runs(const smf_timeline_entry_t *source, smf_timeline_entry_t *destination, int first, int middle, int last)
+{
+	int i = first, j = middle, k = first;
+
+	while (i < middle && j < last) {
+		if (source[j].time_pulses < source[i].time_pulses)
+			destination[k++] = source[j++];
+		else
+			destination[k++] = source[i++];
+	}
+
+	memcpy(destination + k, source + i, (middle - i) * sizeof(smf_timeline_entry_t));
+	k += middle - i;
+	memcpy(destination + k, source + j, (last - j) * sizeof(smf_timeline_entry_t));
+}
+
+/**
+ * Sorts entries, copied track after track, by time.  Every track is already sorted, so this merges
+ * neighbouring tracks, then neighbouring pairs of tracks etc.  Merging is stable, so events that happen
+ * at the same time stay in the order of tracks, just like smf_get_next_event() returns them.
+ * "run_starts" has the index of the first entry of every track and, at the end, number of entries.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+merge_tracks(smf_timeline_t *timeline, int *run_starts, int number_of_runs)
+{
+	int i, width;
+	smf_timeline_entry_t *source = timeline->entries, *destination, *tmp;
+
+	if (number_of_runs <= 1 || run_starts[number_of_runs] == 0)
+		return (0);
+
+	destination = malloc(timeline->allocated * sizeof(smf_timeline_entry_t));
+	if (destination == NULL) {
+		g_critical("Cannot allocate memory for timeline: %s", strerror(errno));
+		return (-1);
+	}
+
+	for (width = 1; width < number_of_runs; width *= 2) {
+		for (i = 0; i < number_of_runs; i += 2 * width) {
+			if (i + width >= number_of_runs) {
+				/* Nothing to merge with; just copy. */
+				memcpy(destination + run_starts[i], source + run_starts[i],
+					(run_starts[number_of_runs] - run_starts[i]) * sizeof(smf_timeline_entry_t));
+				continue;
+			}
+
+			merge_runs(source, destination, run_starts[i], run_starts[i + width],
+				run_starts[i + 2 * width < number_of_runs ? i + 2 * width : number_of_runs]);
+		}
+
+		tmp = source;
+		source = destination;
+		destination = tmp;
+	}
+
+	/* Result ends up in one of the two buffers; keep that one. */
+	free(destination);
+	timeline->entries = source;
+
+	return (0);
+}
+
+/**
+ * Builds the timeline of the smf from scratch.
+ * \return 0 if everything went ok, nonzero otherwise.
+ */
+static int
+build_timeline(smf_t *smf, smf_timeline_t *timeline)
+{
+	int i, j, number_of_entries = 0, *run_starts;
+	smf_track_t *track;
+	smf_event_t *event;
+	smf_timeline_entry_t *entries, *entry;
+
+	/* For lazily loaded songs, this parses the tracks, if it was not done yet. */
+	for (i = 1; i <= smf->number_of_tracks; i++)
+		number_of_entries += smf_get_track_by_number(smf, i)->number_of_events;
+
+	if (timeline->allocated < number_of_entries) {
+		entries = realloc(timeline->entries, number_of_entries * sizeof(smf_timeline_entry_t));
+		if (entries == NULL) {
+			g_critical("Cannot allocate memory for timeline: %s", strerror(errno));
+			return (-1);
+		}
+
+		timeline->entries = entries;
+		timeline->allocated = number_of_entries;
+	}
+
+	run_starts = malloc((smf->number_of_tracks + 1) * sizeof(int));
+	if (run_starts == NULL) {
+		g_critical("Cannot allocate memory for timeline: %s", strerror(errno));
+		return (-2);
+	}
+
+	entry = timeline->entries;
+
+	for (i = 1; i <= smf->number_of_tracks; i++) {
+		track = smf_get_track_by_number(smf, i);
+		run_starts[i - 1] = entry - timeline->entries;
+
+		for (j = 0; j < track->number_of_events; j++) {
+			event = track->events_array->pdata[j];
+
+			entry->time_pulses = event->time_pulses;
+			entry->time_microseconds = event->time_microseconds;
+			entry->track = track;
+			entry->event = event;
+			entry++;
+		}
+	}
+
+	run_starts[smf->number_of_tracks] = number_of_entries;
+
+	if (merge_tracks(timeline, run_starts, smf->number_of_tracks)) {
+		free(run_starts);
+		return (-3);
+	}
+
+	free(run_starts);
+
+	timeline->number_of_entries = number_of_entries;
+	timeline->generation = smf->generation;
+
+	return (0);
+}
+
+/**
+ * Returns all the events of the smf, merged in time order into a single array: timeline->entries[0]
+ * is the first event of the song, timeline->entries[timeline->number_of_entries - 1] is the last one.
+ * Events that happen at the same time are ordered by track number, the same way smf_get_next_event()
+ * returns them.  Building the timeline takes time; once built, it is returned again, without doing
+ * anything, until the smf is changed, i.e. events or tracks are added or removed or tempo map changes.
+ * Then the timeline is rebuilt by the next call.  Do not use the timeline after changing the smf
+ * without calling this routine again.  Timeline belongs to the smf and is freed by smf_delete().
+ *
+ * \return Timeline or NULL, if there was an error.
+ */
+const smf_timeline_t *
+smf_build_timeline(smf_t *smf)
+{
+	if (smf->timeline == NULL) {
+		smf->timeline = malloc(sizeof(smf_timeline_t));
+		if (smf->timeline == NULL) {
+			g_critical("Cannot allocate smf_timeline_t structure: %s", strerror(errno));
+			return (NULL);
+		}
+
+		memset(smf->timeline, 0, sizeof(smf_timeline_t));
+		smf->timeline->generation = smf->generation - 1;
+	}
+
+	/* Bring the times up to date, so that they are not stale in the timeline. */
+	smf_update_tempo_map_if_stale(smf);
+
+	if (smf->timeline->generation == smf->generation)
+		return (smf->timeline);
+
+	if (build_timeline(smf, smf->timeline)) {
+		smf->timeline->generation = smf->generation - 1;
+		return (NULL);
+	}
+
+	return (smf->timeline);
+}
+
+/**
+ * \internal
+ *
+ * Frees the timeline, if any.
+ */
+void
+smf_delete_timeline(smf_t *smf)
+{
+	if (smf->timeline == NULL)
+		return;
+
+	free(smf->timeline->entries);
+	free(smf->timeline);
+	smf->timeline = NULL;
+}
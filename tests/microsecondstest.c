@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Checks that ->time_microseconds agrees with ->time_seconds in a long song with tempo changes,
+ * and that both stay the same after saving the song and loading it back.  Exits with nonzero
+ * status on failure.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "smf.h"
+
+#define NUMBER_OF_NOTES		1000
+#define PULSES_BETWEEN_NOTES	1000
+
+/** Adds Tempo Change metaevent with "tempo" microseconds per quarter note. */
+static void
+add_tempo(smf_track_t *track, int pulses, int tempo)
+{
+	unsigned char buf[6] = { 0xFF, 0x51, 0x03, tempo >> 16, tempo >> 8, tempo };
+	smf_event_t *event = smf_event_new_from_pointer(buf, sizeof(buf));
+
+	smf_track_add_event_pulses(track, event, pulses);
+}
+
+/**
+ * Makes a song about an hour and a half long, with tempos whose microseconds per pulse are not
+ * whole numbers.
+ */
+static smf_t *
+make_song(void)
+{
+	int i;
+	smf_t *smf = smf_new();
+	smf_track_t *track = smf_track_new();
+
+	if (smf_set_ppqn(smf, 96))
+		return (NULL);
+
+	smf_add_track(smf, track);
+
+	add_tempo(track, 0, 500000);
+	add_tempo(track, 500, 400000);
+
+	for (i = 1; i <= NUMBER_OF_NOTES; i++) {
+		smf_track_add_event_pulses(track, smf_event_new_from_bytes(0x90, 0x3C, 0x40), i * PULSES_BETWEEN_NOTES);
+
+		if (i == NUMBER_OF_NOTES / 2)
+			add_tempo(track, i * PULSES_BETWEEN_NOTES, 600001);
+	}
+
+	return (smf);
+}
+
+/** Returns number of events whose time in microseconds is more than one off their time in seconds. */
+static int
+check_times(smf_t *smf, const char *name)
+{
+	int i, failed = 0;
+	smf_event_t *event;
+	smf_track_t *track = smf_get_track_by_number(smf, 1);
+
+	for (i = 1; i <= track->number_of_events; i++) {
+		event = smf_track_get_event_by_number(track, i);
+
+		if (fabs(event->time_microseconds - event->time_seconds * 1000000.0) > 1.0) {
+			fprintf(stderr, "%s: event %d at %d pulses: %lld microseconds, but %f seconds.\n", name, i,
+				event->time_pulses, (long long)event->time_microseconds, event->time_seconds);
+			failed++;
+		}
+	}
+
+	return (failed);
+}
+
+/** Returns number of events whose times differ between the songs. */
+static int
+compare_times(smf_t *a, smf_t *b)
+{
+	int i, failed = 0;
+	smf_event_t *event_a, *event_b;
+	smf_track_t *track_a = smf_get_track_by_number(a, 1), *track_b = smf_get_track_by_number(b, 1);
+
+	if (track_a->number_of_events != track_b->number_of_events) {
+		fprintf(stderr, "Number of events differs after loading: %d != %d.\n", track_a->number_of_events,
+			track_b->number_of_events);
+		return (1);
+	}
+
+	for (i = 1; i <= track_a->number_of_events; i++) {
+		event_a = smf_track_get_event_by_number(track_a, i);
+		event_b = smf_track_get_event_by_number(track_b, i);
+
+		if (event_a->time_pulses != event_b->time_pulses ||
+		    event_a->time_microseconds != event_b->time_microseconds ||
+		    event_a->time_seconds != event_b->time_seconds) {
+			fprintf(stderr, "Time of event %d differs after loading.\n", i);
+			failed++;
+		}
+	}
+
+	return (failed);
+}
+
+int
+main(void)
+{
+	int fd, failed = 0;
+	char file_name[] = "/tmp/smf-microsecondstest-XXXXXX";
+	smf_t *smf, *loaded;
+
+	smf = make_song();
+	if (smf == NULL) {
+		fprintf(stderr, "Cannot make the song.\n");
+		return (1);
+	}
+
+	failed += check_times(smf, "made");
+
+	fd = mkstemp(file_name);
+	if (fd < 0) {
+		perror("mkstemp");
+		return (1);
+	}
+	close(fd);
+
+	if (smf_save(smf, file_name)) {
+		fprintf(stderr, "Cannot save the song.\n");
+		unlink(file_name);
+		return (1);
+	}
+
+	loaded = smf_load(file_name);
+	unlink(file_name);
+
+	if (loaded == NULL) {
+		fprintf(stderr, "Cannot load the song back.\n");
+		return (1);
+	}
+
+	failed += check_times(loaded, "loaded");
+	failed += compare_times(smf, loaded);
+
+	smf_delete(smf);
+	smf_delete(loaded);
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed.\n", failed);
+		return (1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Loads files with MTrk chunk length of 0x80000000 and more, which does not fit in int,
+ * using every loader that takes a buffer.  Exits with nonzero status on failure.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "smf.h"
+
+/** MThd declaring two tracks, 96 PPQN. */
+static const unsigned char mthd[] = {
+	'M', 'T', 'h', 'd', 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x02, 0x00, 0x60
+};
+
+/** MTrk with Note On and Note Off, but no End Of Track; chunk length is at offset 4. */
+static const unsigned char mtrk[] = {
+	'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x08,
+	0x00, 0x90, 0x3C, 0x40,
+	0x60, 0x80, 0x3C, 0x40
+};
+
+/** Builds MThd followed by mtrk, with length set to "chunk_length". */
+static int
+make_file(unsigned char *buf, unsigned long chunk_length)
+{
+	memcpy(buf, mthd, sizeof(mthd));
+	memcpy(buf + sizeof(mthd), mtrk, sizeof(mtrk));
+
+	buf[sizeof(mthd) + 4] = chunk_length >> 24;
+	buf[sizeof(mthd) + 5] = chunk_length >> 16;
+	buf[sizeof(mthd) + 6] = chunk_length >> 8;
+	buf[sizeof(mthd) + 7] = chunk_length;
+
+	return (sizeof(mthd) + sizeof(mtrk));
+}
+
+/** Returns 0 iff the song contains the only track, with both notes and End Of Track. */
+static int
+check_song(smf_t *smf, const char *loader, unsigned long chunk_length)
+{
+	smf_track_t *track;
+
+	if (smf == NULL) {
+		fprintf(stderr, "%s failed for chunk length 0x%lx.\n", loader, chunk_length);
+		return (-1);
+	}
+
+	track = smf_get_track_by_number(smf, 1);
+
+	if (smf->number_of_tracks != 1 || track->number_of_events != 3 ||
+		!smf_event_is_eot(smf_track_get_last_event(track))) {
+		fprintf(stderr, "%s loaded wrong events for chunk length 0x%lx.\n", loader, chunk_length);
+		smf_delete(smf);
+		return (-2);
+	}
+
+	smf_delete(smf);
+
+	return (0);
+}
+
+/** Returns 0 iff smf_reader_t returns both notes and End Of Track. */
+static int
+check_reader(const unsigned char *buf, int length, unsigned long chunk_length)
+{
+	int number_of_events = 0;
+	const smf_event_view_t *view;
+	smf_reader_t *reader = smf_reader_new(buf, length, 0);
+
+	if (reader == NULL) {
+		fprintf(stderr, "smf_reader_new() failed for chunk length 0x%lx.\n", chunk_length);
+		return (-1);
+	}
+
+	while ((view = smf_reader_get_next_event(reader)) != NULL)
+		number_of_events++;
+
+	smf_reader_delete(reader);
+
+	if (number_of_events != 3) {
+		fprintf(stderr, "smf_reader_t returned %d events for chunk length 0x%lx.\n", number_of_events, chunk_length);
+		return (-2);
+	}
+
+	return (0);
+}
+
+static int
+check_chunk_length(unsigned long chunk_length)
+{
+	int length, failed = 0;
+	unsigned char buf[sizeof(mthd) + sizeof(mtrk)];
+
+	length = make_file(buf, chunk_length);
+
+	if (check_song(smf_load_from_memory(buf, length), "smf_load_from_memory()", chunk_length))
+		failed++;
+
+	if (check_song(smf_load_from_memory_parallel(buf, length, 2), "smf_load_from_memory_parallel()", chunk_length))
+		failed++;
+
+	if (check_song(smf_load_from_memory_with_arena(buf, length), "smf_load_from_memory_with_arena()", chunk_length))
+		failed++;
+
+	/* Track gets parsed by smf_get_track_by_number() in check_song(). */
+	if (check_song(smf_load_from_memory_lazy(buf, length), "smf_load_from_memory_lazy()", chunk_length))
+		failed++;
+
+	if (check_reader(buf, length, chunk_length))
+		failed++;
+
+	return (failed);
+}
+
+int
+main(void)
+{
+	int failed = 0;
+
+	failed += check_chunk_length(0x80000000UL);
+	failed += check_chunk_length(0xFFFFFFF8UL);
+	failed += check_chunk_length(0xFFFFFFFFUL);
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed.\n", failed);
+		return (1);
+	}
+
+	return (0);
+}
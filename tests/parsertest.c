@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * ALTHOUGH THIS SOFTWARE IS MADE OF WIN AND SCIENCE, IT IS PROVIDED BY THE
+ * AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Checks that smf_parser_t and smf_load_from_memory() load the same tracks and events
+ * from malformed files.  Exits with nonzero status on failure.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "smf.h"
+
+/** MThd declaring three tracks, 96 PPQN; the number of tracks is at offset 11. */
+static const unsigned char mthd[] = {
+	'M', 'T', 'h', 'd', 0x00, 0x00, 0x00, 0x06, 0x00, 0x01, 0x00, 0x03, 0x00, 0x60
+};
+
+/** MTrk with Note On, Note Off and End Of Track; signature is at offset 0. */
+static const unsigned char mtrk[] = {
+	'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x0C,
+	0x00, 0x90, 0x3C, 0x40,
+	0x60, 0x80, 0x3C, 0x40,
+	0x00, 0xFF, 0x2F, 0x00
+};
+
+/** Builds MThd followed by three copies of mtrk; signature of track "bad_track" gets a non-alphabetic byte. */
+static int
+make_file(unsigned char *buf, int bad_track)
+{
+	int i, length = 0;
+
+	memcpy(buf, mthd, sizeof(mthd));
+	length += sizeof(mthd);
+
+	for (i = 1; i <= 3; i++) {
+		memcpy(buf + length, mtrk, sizeof(mtrk));
+		if (i == bad_track)
+			buf[length + 1] = 0xA2;
+		length += sizeof(mtrk);
+	}
+
+	return (length);
+}
+
+/** Loads the file using smf_parser_t, one byte at a time. */
+static smf_t *
+load_using_parser(const unsigned char *buf, int length)
+{
+	int i;
+	smf_parser_t *parser = smf_parser_new();
+
+	if (parser == NULL)
+		return (NULL);
+
+	for (i = 0; i < length; i++) {
+		if (smf_parser_feed(parser, buf + i, 1)) {
+			smf_parser_delete(parser);
+			return (NULL);
+		}
+	}
+
+	return (smf_parser_finish(parser));
+}
+
+/** Returns 0 iff both songs have the same tracks, with the same events. */
+static int
+compare_songs(smf_t *a, smf_t *b)
+{
+	int i, j;
+	smf_track_t *track_a, *track_b;
+	smf_event_t *event_a, *event_b;
+
+	if (a->number_of_tracks != b->number_of_tracks) {
+		fprintf(stderr, "Number of tracks differs: %d != %d.\n", a->number_of_tracks, b->number_of_tracks);
+		return (-1);
+	}
+
+	for (i = 1; i <= a->number_of_tracks; i++) {
+		track_a = smf_get_track_by_number(a, i);
+		track_b = smf_get_track_by_number(b, i);
+
+		if (track_a->number_of_events != track_b->number_of_events) {
+			fprintf(stderr, "Number of events in track %d differs: %d != %d.\n", i,
+				track_a->number_of_events, track_b->number_of_events);
+			return (-2);
+		}
+
+		for (j = 1; j <= track_a->number_of_events; j++) {
+			event_a = smf_track_get_event_by_number(track_a, j);
+			event_b = smf_track_get_event_by_number(track_b, j);
+
+			if (event_a->time_pulses != event_b->time_pulses ||
+				event_a->midi_buffer_length != event_b->midi_buffer_length ||
+				memcmp(event_a->midi_buffer, event_b->midi_buffer, event_a->midi_buffer_length)) {
+				fprintf(stderr, "Event %d in track %d differs.\n", j, i);
+				return (-3);
+			}
+		}
+	}
+
+	return (0);
+}
+
+/** Loads the file with bad signature of track "bad_track" using both entry points. */
+static int
+check_bad_signature(int bad_track, int expected_number_of_tracks)
+{
+	int length, ret;
+	unsigned char buf[sizeof(mthd) + 3 * sizeof(mtrk)];
+	smf_t *eager, *parsed;
+
+	length = make_file(buf, bad_track);
+
+	eager = smf_load_from_memory(buf, length);
+	parsed = load_using_parser(buf, length);
+
+	if (eager == NULL || parsed == NULL) {
+		fprintf(stderr, "Bad signature of track %d: smf_load_from_memory() returned %p, smf_parser_finish() returned %p.\n",
+			bad_track, (void *)eager, (void *)parsed);
+		ret = -1;
+	} else if (eager->number_of_tracks != expected_number_of_tracks) {
+		fprintf(stderr, "Bad signature of track %d: expected %d tracks, got %d.\n",
+			bad_track, expected_number_of_tracks, eager->number_of_tracks);
+		ret = -2;
+	} else {
+		ret = compare_songs(eager, parsed);
+	}
+
+	if (eager != NULL)
+		smf_delete(eager);
+	if (parsed != NULL)
+		smf_delete(parsed);
+
+	return (ret);
+}
+
+int
+main(void)
+{
+	int failed = 0;
+
+	/* No bad signature; sanity check of the test itself. */
+	if (check_bad_signature(0, 3))
+		failed++;
+
+	if (check_bad_signature(1, 0))
+		failed++;
+
+	if (check_bad_signature(2, 1))
+		failed++;
+
+	if (check_bad_signature(3, 2))
+		failed++;
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed.\n", failed);
+		return (1);
+	}
+
+	return (0);
+}